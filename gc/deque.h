@@ -0,0 +1,94 @@
+/*
+ * This file is part of the koala-lang project, under the MIT License.
+ *
+ * Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>
+ */
+
+#ifndef _KOALA_GC_DEQUE_H_
+#define _KOALA_GC_DEQUE_H_
+
+#include "util/common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Work-stealing deque of grey objects(Chase-Lev).
+ * The owner pushes and pops at bottom, and the other workers steal at top.
+ * The size is fixed, so push fails if it's full.
+ * see: `Dynamic Circular Work-Stealing Deque`
+ */
+
+#define GC_DEQUE_SIZE 1024
+
+typedef struct _GcDeque {
+    long top;
+    long bottom;
+    void **items;
+} GcDeque;
+
+static inline int deque_empty(GcDeque *dq)
+{
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+    return t >= b;
+}
+
+/* push by owner, 0 if it's full */
+static inline int deque_push(GcDeque *dq, void *obj)
+{
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    if (b - t >= GC_DEQUE_SIZE) return 0;
+    __atomic_store_n(&dq->items[b & (GC_DEQUE_SIZE - 1)], obj,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* pop by owner, nil if it's empty */
+static inline void *deque_pop(GcDeque *dq)
+{
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&dq->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+    if (t > b) {
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+        return nil;
+    }
+
+    void *obj =
+        __atomic_load_n(&dq->items[b & (GC_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (t == b) {
+        /* the last one, race with thieves */
+        if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            obj = nil;
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return obj;
+}
+
+/* steal by other workers, nil if it's empty or lost the race */
+static inline void *deque_steal(GcDeque *dq)
+{
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) return nil;
+
+    void *obj =
+        __atomic_load_n(&dq->items[t & (GC_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_RELAXED))
+        return nil;
+    return obj;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _KOALA_GC_DEQUE_H_ */
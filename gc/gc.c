@@ -5,8 +5,15 @@
  */
 
 #include "gc.h"
+#include "deque.h"
+#include "util/list.h"
 #include "util/mm.h"
 #include "util/vector.h"
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -14,12 +21,30 @@ extern "C" {
 
 /*
  * The gc algorithm:
- * semi-space copying
+ * generational, the small objects are allocated in nursery by bumping a
+ * pointer in the tlab of thread. The minor gc copies the live objects of nursery to old generation,
+ * its roots are the gc roots and the old objects in dirty cards.
+ * The old generation is mark-region(Immix), it's divided into blocks and
+ * lines, and the objects are allocated in the holes of free lines. The full gc
+ * marks the live objects and their lines, and evacuates the objects of sparse
+ * blocks to defragment them.
+ * The large objects are allocated in pages of large object space, they are
+ * not moved, and the dead ones are swept after marking.
+ * The old generation is also marked incrementally, after a minor gc, in
+ * slices with a pause budget. The snapshot-at-the-beginning barrier keeps
+ * the overwritten references.
+ * The collection is stop-the-world and parallel, the mutators are parked at
+ * safepoints, and the gc workers trace the objects. Each worker has its own
+ * holes and work-stealing deque of grey objects, so the native stack is not
+ * proportional to the depth of objects.
  * see: `The Garbage Collection Handbook`
+ *      `Immix: A Mark-Region Garbage Collector with Space Efficiency,
+ *       Fast Collection, and Mutator Performance`
  */
 
 typedef enum _GcKind {
-    GC_NONE_KIND,
+    /* being moved by gc worker */
+    GC_BUSY_KIND,
     GC_OBJECT_KIND,
     GC_ARRAY_KIND,
     GC_FORWARD_KIND,
@@ -32,8 +57,16 @@ typedef struct {
 
 /* gc header */
 typedef struct _GcHeader {
-    uint32 kind : 2;
-    uint32 objsize : 30;
+    union {
+        struct {
+            uint32 kind : 2;
+            /* marked, if it's equal to mark_epoch */
+            uint32 marked : 1;
+            uint32 objsize : 29;
+        };
+        /* all bits, which are updated atomically by gc workers */
+        uint32 bits;
+    };
     union {
         void *forward;
         int *objmap;
@@ -41,53 +74,577 @@ typedef struct _GcHeader {
     };
 } GcHeader, *GcHeaderRef;
 
-/* semi-copy space */
-static int space_size;
-static char *from_space;
-static char *to_space;
-static char *free_ptr;
+#define HDR_KIND(bits)    ((bits)&3)
+#define HDR_MARKED(bits)  (((bits) >> 2) & 1)
+#define HDR_OBJSIZE(bits) ((bits) >> 3)
+
+#define LINES_PER_BLOCK (GC_BLOCK_SIZE / GC_LINE_SIZE)
+
+/* nursery, the tlabs are carved from it atomically */
+static uintptr nursery_size;
+static char *nursery;
+static char *nursery_ptr;
+
+/* old generation, its max size is reserved, and old_size is in use */
+static uintptr old_size;
+static uintptr min_old_size;
+static uintptr max_old_size;
+static char *old_space;
+static int nlines;
+static int nblocks;
+static int free_lines;
+
+/*
+ * Large object space is after old generation, with the same size. The object
+ * is allocated in pages, page_run is the number of pages of the object at
+ * its first page.
+ */
+#define GC_PAGE_SIZE 4096
+
+static char *large_space;
+static int npages;
+static uint8 *page_used;
+static int *page_run;
+/* used pages, max of them before full gc, and the end of used pages */
+static int large_used;
+static int large_limit;
+static int large_top;
+static pthread_mutex_t large_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* pause time since last full gc, and the time of it, in microseconds */
+static uint64 pause_start;
+static uint64 pause_time;
+static uint64 last_gc;
+/* target percent of gc time */
+static int time_ratio;
+
+/* line is used by live or new objects */
+static uint8 *line_used;
+/* line is marked by current full gc */
+static uint8 *line_marks;
+/* block is evacuated by current full gc */
+static uint8 *evacuating;
+static int mark_epoch;
+
+/* bump allocator in a hole of free lines */
+typedef struct _Hole {
+    char *cursor;
+    char *limit;
+} Hole;
+
+/* the medium object, which is not fit, is allocated in overflow hole */
+typedef struct _GcAllocator {
+    Hole normal;
+    Hole overflow;
+} GcAllocator;
+
+/* the holes are found with lock */
+static pthread_mutex_t hole_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_line;
+
+/* mutator thread, its tlab and holes are private */
+typedef struct _GcThread {
+    List link;
+    char *tlab_ptr;
+    char *tlab_end;
+    GcAllocator alloc;
+} GcThread;
+
+static List threads = LIST_INIT(threads);
+static __thread GcThread *self;
+
+/* one bit per word of old generation, set at start of object */
+static uint64 *start_bits;
+/* start bits of marked objects, they are start bits after marking */
+static uint64 *next_bits;
+
+/* card table of old generation */
+uint8 *gc_cards;
+char *gc_old_start;
+uintptr gc_old_size;
+
+/* start bits of dirty cards, which are scanned by minor gc */
+static uint64 *dirty_bits;
+static int next_card;
+
+/* only nursery is collected */
+static int minor;
+
+/* gc worker, the worker 0 is the thread which starts gc */
+typedef struct _GcWorker {
+    int id;
+    int epoch;
+    pthread_t thread;
+    GcDeque deque;
+    GcAllocator alloc;
+} GcWorker;
+
+static GcWorker *workers;
+static int nworkers;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static int pool_epoch;
+static int pool_done;
+static int pool_exit;
+/* workers, which may have grey objects */
+static int active;
+
+/* grey objects, which are overflowed from deques */
+static pthread_mutex_t overflow_lock = PTHREAD_MUTEX_INITIALIZER;
+static Vector overflow;
+static int noverflow;
+
+/* mutators and safepoint */
+static pthread_mutex_t world_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t world_cond = PTHREAD_COND_INITIALIZER;
+static int nthreads;
+static int nparked;
+int gc_stopping;
+
+/* old generation is being marked, by full gc or incrementally */
+int gc_marking;
 
-/* all roots */
-void *gcroots;
+/* incremental marker, its grey objects are in mark_stack */
+static GcWorker marker = { .id = -1 };
+static pthread_mutex_t mark_lock = PTHREAD_MUTEX_INITIALIZER;
+static Vector mark_stack;
+static int incremental;
+/* pause budget of incremental marking, in microseconds */
+static int pause_us;
+
+/* roots of current thread, or of its running task */
+__thread void *gcroots;
+
+/* root chains of threads and suspended tasks */
+static Vector chains;
+
+/* root scanners, e.g. of vm stacks */
+typedef struct _GcScanner {
+    GcScanFunc scan;
+    void *arg;
+} GcScanner;
+
+static Vector scanners;
+
+static uint64 now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline int in_space(char *space, uintptr size, void *ptr)
+{
+    return (char *)ptr >= space && (char *)ptr < space + size;
+}
+
+static inline int line_of(void *ptr)
+{
+    return ((char *)ptr - old_space) / GC_LINE_SIZE;
+}
+
+static inline char *line_addr(int line)
+{
+    return old_space + (uintptr)line * GC_LINE_SIZE;
+}
+
+static inline char *page_addr(int page)
+{
+    return large_space + (uintptr)page * GC_PAGE_SIZE;
+}
+
+/* size of object with its header in space */
+static inline int gc_objsize(GcHeaderRef hdr)
+{
+    return ALIGN_PTR(sizeof(GcHeader) + hdr->objsize);
+}
+
+/*
+ * The object is indexed by its body, same as the card. A card is 64 words,
+ * so the starts of objects in card i are the bits of start_bits[i].
+ */
+static inline void set_start(uint64 *bits, void *obj)
+{
+    uintptr i = ((char *)obj - old_space) / sizeof(uintptr);
+    __atomic_fetch_or(&bits[i >> 6], (uint64)1 << (i & 63), __ATOMIC_RELAXED);
+}
+
+static void mark_lines(GcHeaderRef hdr, int objsize)
+{
+    int first = line_of(hdr);
+    int last = line_of((char *)hdr + objsize - 1);
+    for (int i = first; i <= last; i++)
+        __atomic_store_n(&line_marks[i], 1, __ATOMIC_RELAXED);
+}
+
+/* the unused lines of hole are free again, with hole_lock */
+static void release_hole(Hole *hole)
+{
+    if (hole->cursor < hole->limit) {
+        int first = (hole->cursor - old_space + GC_LINE_SIZE - 1) / GC_LINE_SIZE;
+        int last = line_of(hole->limit);
+        memset(line_used + first, 0, last - first);
+        free_lines += last - first;
+    }
+    hole->cursor = nil;
+    hole->limit = nil;
+}
+
+/*
+ * Find a hole of at least size bytes, with hole_lock. The lines of it are
+ * used, and it's at most to the end of block, unless the object is bigger,
+ * so the free lines are not held by one allocator.
+ */
+static int next_hole(Hole *hole, int size)
+{
+    release_hole(hole);
+    int need = (size + GC_LINE_SIZE - 1) / GC_LINE_SIZE;
+    int start = next_line;
+    int i = start;
+    int wrapped = 0;
+
+    while (!wrapped || i < start) {
+        if (i >= nlines) {
+            if (wrapped) break;
+            wrapped = 1;
+            i = 0;
+            continue;
+        }
+        if (line_used[i] || evacuating[i / LINES_PER_BLOCK]) {
+            i++;
+            continue;
+        }
+        int j = i;
+        while (j < nlines && !line_used[j] && !evacuating[j / LINES_PER_BLOCK])
+            j++;
+        if (j - i >= need) {
+            int end = (i / LINES_PER_BLOCK + 1) * LINES_PER_BLOCK;
+            j = MIN(j, MAX(i + need, end));
+            memset(line_used + i, 1, j - i);
+            free_lines -= j - i;
+            hole->cursor = line_addr(i);
+            hole->limit = line_addr(j);
+            next_line = j;
+            return 1;
+        }
+        i = j;
+    }
+    return 0;
+}
+
+/* allocate in old generation, nil if there is no hole */
+static GcHeaderRef old_alloc(GcAllocator *alloc, int objsize)
+{
+    Hole *hole = &alloc->normal;
+    if (hole->cursor + objsize > hole->limit) {
+        if (objsize > GC_LINE_SIZE) hole = &alloc->overflow;
+        if (hole->cursor + objsize > hole->limit) {
+            pthread_mutex_lock(&hole_lock);
+            int found = next_hole(hole, objsize);
+            if (!found) {
+                /* the other hole may hold the free lines */
+                release_hole(hole == &alloc->normal ? &alloc->overflow
+                                                    : &alloc->normal);
+                found = next_hole(hole, objsize);
+            }
+            pthread_mutex_unlock(&hole_lock);
+            if (!found) return nil;
+        }
+    }
+    GcHeaderRef hdr = (GcHeaderRef)hole->cursor;
+    hole->cursor += objsize;
+    hdr->marked = mark_epoch;
+    set_start(start_bits, hdr + 1);
+    /* allocated black during marking */
+    if (gc_marking) {
+        mark_lines(hdr, objsize);
+        set_start(next_bits, hdr + 1);
+    }
+    return hdr;
+}
+
+static int hole_free(Hole *hole)
+{
+    return hole->limit - hole->cursor;
+}
+
+/* free bytes of old generation, the world is stopped */
+static uintptr old_free(void)
+{
+    uintptr avail = (uintptr)free_lines * GC_LINE_SIZE;
+    GcThread *t;
+    list_foreach(t, link, &threads, {
+        avail += hole_free(&t->alloc.normal);
+        avail += hole_free(&t->alloc.overflow);
+    });
+    return avail;
+}
+
+/*
+ * Carve a tlab of at least size bytes from nursery, 0 if nursery is full.
+ * It's lock free, the threads race on nursery_ptr. The tlab is zeroed by its
+ * thread, so the nursery is not zeroed by gc.
+ */
+static int tlab_refill(GcThread *t, int size)
+{
+    char *ptr = __atomic_load_n(&nursery_ptr, __ATOMIC_RELAXED);
+    char *end;
+    do {
+        uintptr avail = nursery + nursery_size - ptr;
+        if (avail < size) return 0;
+        end = ptr + MIN(avail, MAX(size, GC_TLAB_SIZE));
+    } while (!__atomic_compare_exchange_n(&nursery_ptr, &ptr, end, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    memset(ptr, 0, end - ptr);
+    t->tlab_ptr = ptr;
+    t->tlab_end = end;
+    return 1;
+}
+
+/* reserve zero memory, the pages are committed when they are touched */
+static void *reserve(uintptr size)
+{
+    void *ptr = mmap(nil, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) {
+        printf("gc-error: cannot reserve %lu bytes\n", (unsigned long)size);
+        abort();
+    }
+    return ptr;
+}
+
+static inline uintptr bits_size(uintptr size)
+{
+    return (size / GC_CARD_SIZE + 1) * sizeof(uint64);
+}
+
+/*
+ * Resize old generation to size, which is multiple of GC_BLOCK_SIZE. It's
+ * shrunk only by the free blocks at end, and their pages are returned to os.
+ * The world is stopped, or with hole_lock.
+ */
+static void resize_old(uintptr size)
+{
+    int lines = size / GC_LINE_SIZE;
+    if (size < old_size) {
+        int last = nlines;
+        while (last > lines && !line_used[last - 1]) last--;
+        lines = ALIGN(last, LINES_PER_BLOCK);
+        if (lines >= nlines) return;
+        size = (uintptr)lines * GC_LINE_SIZE;
+        int from = size / GC_CARD_SIZE;
+        int to = old_size / GC_CARD_SIZE + 1;
+        memset(gc_cards + from, 0, to - from);
+        memset(start_bits + from, 0, (to - from) * sizeof(uint64));
+        memset(next_bits + from, 0, (to - from) * sizeof(uint64));
+        madvise(old_space + size, old_size - size, MADV_DONTNEED);
+        free_lines -= nlines - lines;
+    } else {
+        memset(line_marks + nlines, 0, lines - nlines);
+        free_lines += lines - nlines;
+    }
+
+    printf("gc-debug: heap is resized from %lu to %lu\n",
+           (unsigned long)old_size, (unsigned long)size);
+    old_size = size;
+    nlines = lines;
+    nblocks = lines / LINES_PER_BLOCK;
+}
+
+/* grow old generation by at least size bytes, 0 if it's max */
+static int grow_old(uintptr size)
+{
+    if (old_size >= max_old_size) return 0;
+    uintptr newsize = MAX(old_size * 2, ALIGN(old_size + size, GC_BLOCK_SIZE));
+    resize_old(MIN(newsize, max_old_size));
+    return 1;
+}
+
+/* grow old generation by the mutators or gc workers, 0 if it's max */
+static int grow_old_locked(uintptr size)
+{
+    pthread_mutex_lock(&hole_lock);
+    int grown = grow_old(size);
+    pthread_mutex_unlock(&hole_lock);
+    return grown;
+}
+
+/*
+ * Resize by the occupancy after full gc and the percent of gc time, it
+ * grows if the objects are dense or gc is too often, and shrinks if the
+ * objects are sparse.
+ */
+static void adjust_old(void)
+{
+    /* the rest of current pause is in next period */
+    uint64 now = now_us();
+    pause_time += now - pause_start;
+    pause_start = now;
+    int ratio = (int)(pause_time * 100 / MAX(now - last_gc, 1));
+    uintptr used = old_size - old_free();
+    uintptr newsize = old_size;
+    if (used > old_size / 100 * GC_GROW_PERCENT || ratio > time_ratio) {
+        newsize = MAX(old_size * 2, used / GC_GROW_PERCENT * 100);
+    } else if (used < old_size / 100 * GC_SHRINK_PERCENT &&
+               ratio <= time_ratio) {
+        newsize = MAX(old_size / 2, used * 2);
+    }
+    newsize = ALIGN(newsize, GC_BLOCK_SIZE);
+    newsize = MAX(MIN(newsize, max_old_size), min_old_size);
+    if (newsize != old_size) resize_old(newsize);
+    /* next full gc is started, if the large objects are doubled */
+    large_limit = MIN(MAX(large_used * 2, min_old_size / GC_PAGE_SIZE), npages);
+    pause_time = 0;
+    last_gc = now;
+}
+
+/* first fit of num free pages, -1 if there are not */
+static int find_pages(int num)
+{
+    int i = 0;
+    while (i + num <= npages) {
+        int j = i;
+        while (j < i + num && !page_used[j]) j++;
+        if (j == i + num) return i;
+        i = j + 1;
+    }
+    return -1;
+}
+
+/*
+ * Allocate in large object space, nil if it's full. If it's limited, it
+ * fails too when the used pages are more than large_limit, so it's time to
+ * collect.
+ */
+static GcHeaderRef large_alloc(int objsize, int limited)
+{
+    int num = (objsize + GC_PAGE_SIZE - 1) / GC_PAGE_SIZE;
+    pthread_mutex_lock(&large_lock);
+    int page = -1;
+    if (!limited || large_used + num <= large_limit) page = find_pages(num);
+    if (page >= 0) {
+        memset(page_used + page, 1, num);
+        page_run[page] = num;
+        large_used += num;
+        large_top = MAX(large_top, page + num);
+    }
+    pthread_mutex_unlock(&large_lock);
+    if (page < 0) return nil;
+
+    /* the pages are zero, they are new or returned to os */
+    GcHeaderRef hdr = (GcHeaderRef)page_addr(page);
+    hdr->marked = mark_epoch;
+    set_start(start_bits, hdr + 1);
+    if (gc_marking) set_start(next_bits, hdr + 1);
+    return hdr;
+}
+
+/* free the large objects, which are not marked */
+static void sweep_large(void)
+{
+    int top = 0;
+    int p = 0;
+    while (p < large_top) {
+        int num = page_run[p];
+        if (!num) {
+            p++;
+            continue;
+        }
+        GcHeaderRef hdr = (GcHeaderRef)page_addr(p);
+        if (hdr->marked != mark_epoch) {
+            int card = ((char *)hdr - old_space) / GC_CARD_SIZE;
+            int ncards = num * GC_PAGE_SIZE / GC_CARD_SIZE;
+            memset(start_bits + card, 0, ncards * sizeof(uint64));
+            memset(next_bits + card, 0, ncards * sizeof(uint64));
+            madvise(hdr, (uintptr)num * GC_PAGE_SIZE, MADV_DONTNEED);
+            memset(page_used + p, 0, num);
+            page_run[p] = 0;
+            large_used -= num;
+        } else {
+            top = p + num;
+        }
+        p += num;
+    }
+    large_top = top;
+}
+
+static int stop_world(void);
+static void start_world(void);
+static void minor_collect(void);
+static void full_collect(void);
+
+static void collect(void)
+{
+    if (!stop_world()) return;
+
+    /*
+     * The holes of threads are counted when the world is stopped, and all
+     * of nursery is promoted if old generation can hold them. The free lines
+     * may be too fragmented for the objects, then it grows during promotion,
+     * so if it can't, a full gc is done unless there is twice as much room.
+     */
+    uintptr young = __atomic_load_n(&nursery_ptr, __ATOMIC_RELAXED) - nursery;
+    uintptr avail = old_free();
+    if (avail >= young && (old_size < max_old_size || avail / 2 >= young))
+        minor_collect();
+    else
+        full_collect();
+
+    start_world();
+}
 
 static GcHeaderRef __new__(int size)
 {
     int objsize = sizeof(GcHeader) + size;
     objsize = ALIGN_PTR(objsize);
-    char *new_ptr;
-    int tried = 0;
-
-Lrealloc:
-    new_ptr = free_ptr + objsize;
-    if (new_ptr > (from_space + space_size)) {
-        int waste = space_size - (free_ptr - from_space);
-        if (tried) {
+    GcThread *t = self;
+    GcHeaderRef hdr;
+
+    if (objsize >= GC_LARGE_SIZE) {
+        hdr = large_alloc(objsize, 1);
+        if (!hdr) {
             printf("gc-debug: alloc size:%d failed\n", objsize);
-            printf("gc-debug: %d bytes wasted(total:%d)\n", waste, space_size);
+            gc();
+            hdr = large_alloc(objsize, 0);
+        }
+        if (!hdr) {
             printf("gc-error: too small managed memory\n");
             abort();
         }
-        printf("gc-debug: alloc size:%d failed\n", objsize);
-        printf("gc-debug: %d bytes wasted(total:%d)\n", waste, space_size);
-        tried = 1;
-        gc();
-        goto Lrealloc;
+    } else if (objsize > nursery_size / 2) {
+        /* big object is allocated in old generation directly */
+        hdr = old_alloc(&t->alloc, objsize);
+        if (!hdr) {
+            printf("gc-debug: alloc size:%d failed\n", objsize);
+            gc();
+            hdr = old_alloc(&t->alloc, objsize);
+        }
+        while (!hdr) {
+            if (!grow_old_locked(objsize)) {
+                printf("gc-error: too small managed memory\n");
+                abort();
+            }
+            hdr = old_alloc(&t->alloc, objsize);
+        }
+        /* the hole may have dead objects */
+        memset(hdr + 1, 0, objsize - sizeof(GcHeader));
+    } else {
+        while (t->tlab_ptr + objsize > t->tlab_end) {
+            if (!tlab_refill(t, objsize)) collect();
+        }
+        hdr = (GcHeaderRef)t->tlab_ptr;
+        t->tlab_ptr += objsize;
     }
 
-    printf("gc-debug: alloc: %d\n", objsize);
-
-    GcHeaderRef hdr = (GcHeaderRef)free_ptr;
     // 8 bytes alignment
     assert(!((uintptr)hdr & 7));
-
-    free_ptr = new_ptr;
     hdr->objsize = size;
     return hdr;
 }
 
 void *gc_alloc(int size, int *objmap)
 {
-    printf("gc-debug: alloc object %d\n", size);
     assert(size > 0);
     GcHeaderRef hdr = __new__(size);
     hdr->kind = GC_OBJECT_KIND;
@@ -98,7 +655,6 @@ void *gc_alloc(int size, int *objmap)
 void *gc_alloc_array(int num, int size, int isobj)
 {
     int arrsize = num * size;
-    printf("gc-debug: alloc array %dx%d@%d\n", num, size, isobj);
     GcHeaderRef hdr = __new__(arrsize);
     hdr->kind = GC_ARRAY_KIND;
     hdr->arrinfo.isobj = isobj;
@@ -106,133 +662,853 @@ void *gc_alloc_array(int num, int size, int isobj)
     return (void *)(hdr + 1);
 }
 
-void gc_init(int size)
+static void *worker_main(void *arg);
+
+/* KOALA_GC_WORKERS, default is the number of cpus */
+static int num_workers(void)
+{
+    char *env = getenv("KOALA_GC_WORKERS");
+    int num = env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num < 1) num = 1;
+    return MIN(num, GC_MAX_WORKERS);
+}
+
+static void start_workers(void)
+{
+    nworkers = num_workers();
+    workers = mm_alloc(sizeof(GcWorker) * nworkers);
+    pool_exit = 0;
+    for (int i = 0; i < nworkers; i++) {
+        GcWorker *w = &workers[i];
+        w->id = i;
+        w->epoch = pool_epoch;
+        w->deque.items = mm_alloc(sizeof(void *) * GC_DEQUE_SIZE);
+        if (i > 0) pthread_create(&w->thread, nil, worker_main, w);
+    }
+}
+
+static void stop_workers(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_exit = 1;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    for (int i = 0; i < nworkers; i++) {
+        GcWorker *w = &workers[i];
+        if (i > 0) pthread_join(w->thread, nil);
+        mm_free(w->deque.items);
+    }
+    mm_free(workers);
+    workers = nil;
+    nworkers = 0;
+}
+
+/* current thread is a mutator, with world_lock */
+static void new_thread(void)
+{
+    GcThread *t = mm_alloc_obj(t);
+    list_push_back(&threads, &t->link);
+    self = t;
+    void **roots = &gcroots;
+    vector_push_back(&chains, &roots);
+    nthreads++;
+}
+
+static void remove_chain(void **roots)
+{
+    void **chain;
+    for (int i = 0; i < vector_size(&chains); i++) {
+        vector_get(&chains, i, &chain);
+        if (chain == roots) {
+            vector_remove(&chains, i, &chain);
+            return;
+        }
+    }
+}
+
+void gc_init_heap(uintptr min, uintptr max)
 {
-    space_size = size;
-    from_space = mm_alloc(space_size);
-    to_space = mm_alloc(space_size);
-    free_ptr = from_space;
+    min_old_size = ALIGN(min, GC_BLOCK_SIZE);
+    max_old_size = ALIGN(MAX(min, max), GC_BLOCK_SIZE);
+    old_size = min_old_size;
+    /* the large object space is after old generation */
+    old_space = reserve(max_old_size * 2);
+    large_space = old_space + max_old_size;
+    npages = max_old_size / GC_PAGE_SIZE;
+    page_used = reserve(npages);
+    page_run = reserve(npages * sizeof(int));
+    large_used = 0;
+    large_limit = min_old_size / GC_PAGE_SIZE;
+    large_top = 0;
+    nlines = old_size / GC_LINE_SIZE;
+    nblocks = (nlines + LINES_PER_BLOCK - 1) / LINES_PER_BLOCK;
+    free_lines = nlines;
+    line_used = reserve(max_old_size / GC_LINE_SIZE);
+    line_marks = reserve(max_old_size / GC_LINE_SIZE);
+    evacuating = reserve(max_old_size / GC_BLOCK_SIZE);
+
+    nursery_size = ALIGN_PTR(min / 4);
+    nursery = mm_alloc(nursery_size);
+    nursery_ptr = nursery;
+
+    gc_cards = reserve(max_old_size * 2 / GC_CARD_SIZE + 1);
+    start_bits = reserve(bits_size(max_old_size * 2));
+    next_bits = reserve(bits_size(max_old_size * 2));
+    dirty_bits = reserve(bits_size(max_old_size * 2));
+    gc_old_start = old_space;
+    gc_old_size = max_old_size * 2;
+
+    vector_init_ptr(&overflow);
+    vector_init_ptr(&mark_stack);
+    vector_init_ptr(&chains);
+    vector_init(&scanners, sizeof(GcScanner));
+    char *env = getenv("KOALA_GC_PAUSE_US");
+    pause_us = env ? atoi(env) : GC_PAUSE_US;
+    env = getenv("KOALA_GC_TIME_RATIO");
+    time_ratio = env ? atoi(env) : GC_TIME_RATIO;
+    pause_time = 0;
+    last_gc = now_us();
+    start_workers();
+    /* current thread is a mutator */
+    nthreads = 0;
+    new_thread();
+}
+
+void gc_init(uintptr size)
+{
+    gc_init_heap(size, size);
+}
+
+uintptr gc_heap_size(void)
+{
+    return old_size;
 }
 
 void gc_fini(void)
 {
-    mm_free(from_space);
-    mm_free(to_space);
+    stop_workers();
+    munmap(old_space, max_old_size * 2);
+    munmap(page_used, npages);
+    munmap(page_run, npages * sizeof(int));
+    munmap(line_used, max_old_size / GC_LINE_SIZE);
+    munmap(line_marks, max_old_size / GC_LINE_SIZE);
+    munmap(evacuating, max_old_size / GC_BLOCK_SIZE);
+    mm_free(nursery);
+    munmap(gc_cards, max_old_size * 2 / GC_CARD_SIZE + 1);
+    munmap(start_bits, bits_size(max_old_size * 2));
+    munmap(next_bits, bits_size(max_old_size * 2));
+    munmap(dirty_bits, bits_size(max_old_size * 2));
+    vector_fini(&overflow);
+    vector_fini(&mark_stack);
+    vector_fini(&chains);
+    vector_fini(&scanners);
+    GcThread *t, *nxt;
+    list_foreach_safe(t, nxt, link, &threads, {
+        list_remove(&t->link);
+        mm_free(t);
+    });
+    self = nil;
+    incremental = 0;
+    gc_marking = 0;
+    next_line = 0;
+}
+
+static void push_grey(GcWorker *w, void *obj)
+{
+    if (w == &marker) {
+        pthread_mutex_lock(&mark_lock);
+        vector_push_back(&mark_stack, &obj);
+        pthread_mutex_unlock(&mark_lock);
+        return;
+    }
+    if (deque_push(&w->deque, obj)) return;
+    pthread_mutex_lock(&overflow_lock);
+    vector_push_back(&overflow, &obj);
+    __atomic_add_fetch(&noverflow, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&overflow_lock);
 }
 
-static void *copy(void *ptr)
+static void *pop_overflow(void)
 {
-    if (!ptr) return nil;
+    if (!__atomic_load_n(&noverflow, __ATOMIC_ACQUIRE)) return nil;
+    void *obj = nil;
+    pthread_mutex_lock(&overflow_lock);
+    if (!vector_empty(&overflow)) {
+        vector_pop_back(&overflow, &obj);
+        __atomic_sub_fetch(&noverflow, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&overflow_lock);
+    return obj;
+}
 
-    GcHeaderRef hdr = (GcHeaderRef)ptr - 1;
+static void *steal(GcWorker *w)
+{
+    for (int i = 1; i < nworkers; i++) {
+        GcWorker *victim = &workers[(w->id + i) % nworkers];
+        void *obj = deque_steal(&victim->deque);
+        if (obj) return obj;
+    }
+    return nil;
+}
 
-    switch (hdr->kind) {
-        case GC_FORWARD_KIND:
-            printf("gc-debug: already copied\n");
-            return hdr->forward;
-        case GC_ARRAY_KIND: {
-            GcArrayInfo *arrinfo = &hdr->arrinfo;
-            int num_objs = hdr->objsize / arrinfo->size;
-            int obj_size = arrinfo->size;
-            int isobj = arrinfo->isobj;
-            void *newarr = gc_alloc_array(num_objs, obj_size, isobj);
-            memcpy(newarr, ptr, hdr->objsize);
-            hdr->forward = newarr;
-            hdr->kind = GC_FORWARD_KIND;
-            if (isobj) {
-                void **elems = (void **)newarr;
-                for (int i = 0; i < num_objs; i++) elems[i] = copy(elems[i]);
-            }
-            return newarr;
-        }
-        case GC_OBJECT_KIND: {
-            int *objmap = hdr->objmap;
-            void *newobj = gc_alloc(hdr->objsize, objmap);
-            memcpy(newobj, ptr, hdr->objsize);
-            hdr->forward = newobj;
-            hdr->kind = GC_FORWARD_KIND;
-            if (objmap) {
-                int num_fields = objmap[0];
-                int *offset = objmap + 1;
-                for (int i = 0; i < num_fields; i++) {
-                    void **field = (void **)(newobj + offset[i]);
-                    *field = copy(*field);
+static int has_work(void)
+{
+    if (__atomic_load_n(&noverflow, __ATOMIC_ACQUIRE)) return 1;
+    for (int i = 0; i < nworkers; i++) {
+        if (!deque_empty(&workers[i].deque)) return 1;
+    }
+    return 0;
+}
+
+/* wait for the object, which is being moved by other worker */
+static uint32 wait_moved(GcHeaderRef hdr)
+{
+    uint32 bits;
+    while (HDR_KIND(bits = __atomic_load_n(&hdr->bits, __ATOMIC_ACQUIRE)) ==
+           GC_BUSY_KIND)
+        sched_yield();
+    return bits;
+}
+
+/* claim the object to move or mark it, 0 if other worker is faster */
+static inline int claim(GcHeaderRef hdr, uint32 bits, uint32 newbits)
+{
+    return __atomic_compare_exchange_n(&hdr->bits, &bits, newbits, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/*
+ * Move object, which is claimed as busy, to old generation and leave the
+ * forward pointer. The bits are its header before it's claimed.
+ */
+static void *move(GcWorker *w, GcHeaderRef hdr, uint32 bits)
+{
+    int objsize = ALIGN_PTR(sizeof(GcHeader) + HDR_OBJSIZE(bits));
+    GcHeaderRef newhdr = old_alloc(&w->alloc, objsize);
+    if (!newhdr) return nil;
+    memcpy(newhdr, hdr, objsize);
+    newhdr->bits = bits;
+    newhdr->marked = mark_epoch;
+    mark_lines(newhdr, objsize);
+    hdr->forward = newhdr + 1;
+    __atomic_store_n(&hdr->bits, (bits & ~3) | GC_FORWARD_KIND,
+                     __ATOMIC_RELEASE);
+    push_grey(w, newhdr + 1);
+    return newhdr + 1;
+}
+
+/* promote young object, the fields are updated when it's popped */
+static void *promote(GcWorker *w, void *ptr)
+{
+    GcHeaderRef hdr = (GcHeaderRef)ptr - 1;
+    uint32 bits = __atomic_load_n(&hdr->bits, __ATOMIC_ACQUIRE);
+    for (;;) {
+        switch (HDR_KIND(bits)) {
+            case GC_FORWARD_KIND:
+                return hdr->forward;
+            case GC_BUSY_KIND:
+                bits = wait_moved(hdr);
+                break;
+            default: {
+                if (!claim(hdr, bits, (bits & ~3) | GC_BUSY_KIND)) {
+                    bits = __atomic_load_n(&hdr->bits, __ATOMIC_ACQUIRE);
+                    break;
+                }
+                /* the free lines may be too fragmented for it */
+                void *newobj = move(w, hdr, bits);
+                while (!newobj) {
+                    int size = ALIGN_PTR(sizeof(GcHeader) + HDR_OBJSIZE(bits));
+                    if (!grow_old_locked(size)) {
+                        printf("gc-error: too small managed memory\n");
+                        abort();
+                    }
+                    newobj = move(w, hdr, bits);
                 }
+                return newobj;
             }
-            return newobj;
-        }
-        default: {
-            printf("gc-error: invalid gcheader(kind %d?)\n", hdr->kind);
-            abort();
         }
     }
 }
 
-void gc(void)
+/* mark old object, or evacuate it if its block is sparse */
+static void *mark(GcWorker *w, void *ptr)
 {
-    printf("gc-debug: === gc is starting ===\n");
+    GcHeaderRef hdr = (GcHeaderRef)ptr - 1;
+    uint32 bits = __atomic_load_n(&hdr->bits, __ATOMIC_ACQUIRE);
+    for (;;) {
+        if (HDR_KIND(bits) == GC_FORWARD_KIND) return hdr->forward;
+        if (HDR_KIND(bits) == GC_BUSY_KIND) {
+            bits = wait_moved(hdr);
+            continue;
+        }
+        if (HDR_MARKED(bits) == mark_epoch) return ptr;
 
-    // TODO: wait other threads stopped?
+        uint32 marked = (bits & ~4) | (mark_epoch << 2);
+        if (evacuating[line_of(hdr) / LINES_PER_BLOCK]) {
+            if (claim(hdr, bits, (bits & ~3) | GC_BUSY_KIND)) {
+                void *newobj = move(w, hdr, bits);
+                if (newobj) return newobj;
+                /* no free lines, it's marked in place */
+                __atomic_store_n(&hdr->bits, marked, __ATOMIC_RELEASE);
+                break;
+            }
+        } else if (claim(hdr, bits, marked)) {
+            break;
+        }
+        bits = __atomic_load_n(&hdr->bits, __ATOMIC_ACQUIRE);
+    }
 
-    // swap space
-    char *tmp = from_space;
-    from_space = to_space;
-    to_space = tmp;
-    free_ptr = from_space;
-    memset(from_space, 0, space_size);
+    mark_lines(hdr, gc_objsize(hdr));
+    set_start(next_bits, ptr);
+    push_grey(w, ptr);
+    return ptr;
+}
 
-    // exchange from_fini_objs and to_fini_objs
-    /*
-    VectorRef vec = from_fini_objs;
-    from_fini_objs = to_fini_objs;
-    to_fini_objs = vec;
-    vector_clear(from_fini_objs);
-    */
+/* mark large object, it's never moved */
+static void *mark_large(GcWorker *w, void *ptr)
+{
+    GcHeaderRef hdr = (GcHeaderRef)ptr - 1;
+    uint32 bits = __atomic_load_n(&hdr->bits, __ATOMIC_ACQUIRE);
+    for (;;) {
+        if (HDR_MARKED(bits) == mark_epoch) return ptr;
+        if (claim(hdr, bits, (bits & ~4) | (mark_epoch << 2))) break;
+        bits = __atomic_load_n(&hdr->bits, __ATOMIC_ACQUIRE);
+    }
+    set_start(next_bits, ptr);
+    push_grey(w, ptr);
+    return ptr;
+}
+
+static void *trace(GcWorker *w, void *ptr)
+{
+    if (!ptr) return ptr;
+    if (in_space(nursery, nursery_size, ptr)) return promote(w, ptr);
+    if (minor) return ptr;
+    if (in_space(old_space, old_size, ptr)) return mark(w, ptr);
+    if (in_space(large_space, max_old_size, ptr)) return mark_large(w, ptr);
+    return ptr;
+}
+
+/* trace the children of object */
+static void scan(GcWorker *w, GcHeaderRef hdr)
+{
+    void *obj = hdr + 1;
+    if (hdr->kind == GC_ARRAY_KIND) {
+        GcArrayInfo *arrinfo = &hdr->arrinfo;
+        if (!arrinfo->isobj) return;
+        int num_objs = hdr->objsize / arrinfo->size;
+        void **elems = (void **)obj;
+        for (int i = 0; i < num_objs; i++) elems[i] = trace(w, elems[i]);
+    } else {
+        int *objmap = hdr->objmap;
+        if (!objmap) return;
+        int num_fields = objmap[0];
+        int *offset = objmap + 1;
+        for (int i = 0; i < num_fields; i++) {
+            void **field = (void **)((char *)obj + offset[i]);
+            *field = trace(w, *field);
+        }
+    }
+}
 
-    // foreach roots
+static void trace_chain(GcWorker *w, void **root)
+{
     void **pptr;
-    void **root = (void **)gcroots;
     while (root) {
         int nroots = (int)(uintptr)root[0];
         for (int i = 0; i < nroots; i++) {
             pptr = root[2 + i];
             if (!pptr || !*pptr) continue;
-            *pptr = copy(*pptr);
+            *pptr = trace(w, *pptr);
         }
         root = (void **)root[1];
     }
+}
 
-    // call object's fini func
-    /*
-    void **item;
-    vector_foreach(item, to_fini_objs, {
-        GcHeaderRef hdr = (GcHeaderRef)(*item);
-        if (hdr->kind != GC_OBJECT_KIND) continue;
-        printf("gc-debug: object is freed\n");
-        if (hdr->fini) hdr->fini(hdr + 1);
-    });
-    */
+static void visit_root(void *ctx, void **slot)
+{
+    if (*slot) *slot = trace(ctx, *slot);
+}
 
-    /*
-    GcHeaderRef hdr = (GcHeaderRef)to_space;
-    char *end = to_space + space_size;
-    while ((char *)hdr < end && hdr->kind != GC_NONE_KIND) {
-        if (hdr->kind == GC_OBJECT_KIND) {
-            printf("gc-debug: object is freed\n");
-            if (hdr->fini) hdr->fini(hdr + 1);
+static void trace_roots(GcWorker *w)
+{
+    void **chain;
+    for (int i = 0; i < vector_size(&chains); i++) {
+        vector_get(&chains, i, &chain);
+        trace_chain(w, *chain);
+    }
+
+    GcScanner scanner;
+    for (int i = 0; i < vector_size(&scanners); i++) {
+        vector_get(&scanners, i, &scanner);
+        scanner.scan(scanner.arg, visit_root, w);
+    }
+}
+
+/* the cards of old generation, and of used pages of large object space */
+static inline int num_cards(void)
+{
+    return (old_size + (uintptr)large_top * GC_PAGE_SIZE) / GC_CARD_SIZE;
+}
+
+static inline int card_of(int i)
+{
+    int n = old_size / GC_CARD_SIZE;
+    return i < n ? i : max_old_size / GC_CARD_SIZE + i - n;
+}
+
+static void clear_cards(void)
+{
+    memset(gc_cards, 0, old_size / GC_CARD_SIZE);
+    memset(gc_cards + max_old_size / GC_CARD_SIZE, 0,
+           (uintptr)large_top * GC_PAGE_SIZE / GC_CARD_SIZE);
+}
+
+/* snapshot the start bits of dirty cards, before objects are promoted */
+static void snapshot_cards(void)
+{
+    int ncards = num_cards();
+    for (int i = 0; i < ncards; i++) {
+        int c = card_of(i);
+        dirty_bits[c] = gc_cards[c] ? start_bits[c] : 0;
+        gc_cards[c] = 0;
+    }
+    next_card = 0;
+}
+
+/* scan the old objects in dirty cards, 64 cards per claim */
+static void trace_cards(GcWorker *w)
+{
+    int ncards = num_cards();
+    for (;;) {
+        int first = __atomic_fetch_add(&next_card, 64, __ATOMIC_RELAXED);
+        if (first >= ncards) return;
+        int last = MIN(first + 64, ncards);
+        for (int i = first; i < last; i++) {
+            int c = card_of(i);
+            uint64 bits = dirty_bits[c];
+            while (bits) {
+                int bit = __builtin_ctzll(bits);
+                bits &= bits - 1;
+                char *obj = old_space + (c * 64 + bit) * sizeof(uintptr);
+                scan(w, (GcHeaderRef)obj - 1);
+            }
+        }
+    }
+}
+
+static void trace_grey(GcWorker *w)
+{
+    void *obj;
+    for (;;) {
+        while ((obj = deque_pop(&w->deque)) || (obj = pop_overflow()))
+            scan(w, (GcHeaderRef)obj - 1);
+        if ((obj = steal(w))) {
+            scan(w, (GcHeaderRef)obj - 1);
+            continue;
+        }
+
+        /* terminate if all workers have no grey objects */
+        __atomic_sub_fetch(&active, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if (has_work()) {
+                __atomic_add_fetch(&active, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            if (!__atomic_load_n(&active, __ATOMIC_SEQ_CST)) return;
+            sched_yield();
         }
+    }
+}
+
+static void work(GcWorker *w)
+{
+    if (w->id == 0) trace_roots(w);
+    if (minor || incremental) trace_cards(w);
+    trace_grey(w);
+}
 
-        if (hdr->kind == GC_ARRAY_KIND) {
-            printf("gc-debug: array is freed\n");
+static void *worker_main(void *arg)
+{
+    GcWorker *w = arg;
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        while (pool_epoch == w->epoch && !pool_exit)
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        if (pool_exit) {
+            pthread_mutex_unlock(&pool_lock);
+            return nil;
         }
+        w->epoch = pool_epoch;
+        pthread_mutex_unlock(&pool_lock);
+
+        work(w);
+
+        pthread_mutex_lock(&pool_lock);
+        if (++pool_done == nworkers - 1) pthread_cond_signal(&done_cond);
+        pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+/* trace by all workers, current thread is worker 0 */
+static void run_workers(void)
+{
+    active = nworkers;
+    pthread_mutex_lock(&pool_lock);
+    pool_done = 0;
+    pool_epoch++;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    work(&workers[0]);
+
+    pthread_mutex_lock(&pool_lock);
+    while (pool_done < nworkers - 1)
+        pthread_cond_wait(&done_cond, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+
+    /* the unused lines of workers are free */
+    for (int i = 0; i < nworkers; i++) {
+        release_hole(&workers[i].alloc.normal);
+        release_hole(&workers[i].alloc.overflow);
+    }
+}
 
-        hdr = (GcHeaderRef)((char *)(hdr + 1) + hdr->objsize);
+void gc_attach(void)
+{
+    pthread_mutex_lock(&world_lock);
+    /* it's parked until gc is finished */
+    while (gc_stopping) pthread_cond_wait(&world_cond, &world_lock);
+    new_thread();
+    pthread_mutex_unlock(&world_lock);
+}
+
+void gc_detach(void)
+{
+    pthread_mutex_lock(&world_lock);
+    /* it's a mutator until gc is finished */
+    while (gc_stopping) {
+        pthread_mutex_unlock(&world_lock);
+        gc_park();
+        pthread_mutex_lock(&world_lock);
     }
-    */
+    GcThread *t = self;
+    pthread_mutex_lock(&hole_lock);
+    release_hole(&t->alloc.normal);
+    release_hole(&t->alloc.overflow);
+    pthread_mutex_unlock(&hole_lock);
+    remove_chain(&gcroots);
+    list_remove(&t->link);
+    mm_free(t);
+    self = nil;
+    nthreads--;
+    pthread_cond_broadcast(&world_cond);
+    pthread_mutex_unlock(&world_lock);
+}
+
+void gc_add_roots(void **roots)
+{
+    pthread_mutex_lock(&world_lock);
+    vector_push_back(&chains, &roots);
+    pthread_mutex_unlock(&world_lock);
+}
+
+void gc_remove_roots(void **roots)
+{
+    pthread_mutex_lock(&world_lock);
+    remove_chain(roots);
+    pthread_mutex_unlock(&world_lock);
+}
+
+void gc_add_scanner(GcScanFunc scan, void *arg)
+{
+    GcScanner scanner = { scan, arg };
+    pthread_mutex_lock(&world_lock);
+    vector_push_back(&scanners, &scanner);
+    pthread_mutex_unlock(&world_lock);
+}
+
+void gc_remove_scanner(GcScanFunc scan, void *arg)
+{
+    GcScanner scanner;
+    pthread_mutex_lock(&world_lock);
+    for (int i = 0; i < vector_size(&scanners); i++) {
+        vector_get(&scanners, i, &scanner);
+        if (scanner.scan == scan && scanner.arg == arg) {
+            vector_remove(&scanners, i, &scanner);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&world_lock);
+}
+
+void gc_park(void)
+{
+    pthread_mutex_lock(&world_lock);
+    nparked++;
+    pthread_cond_broadcast(&world_cond);
+    while (gc_stopping) pthread_cond_wait(&world_cond, &world_lock);
+    nparked--;
+    pthread_mutex_unlock(&world_lock);
+}
+
+void gc_enter_safe(void)
+{
+    if (!self) return;
+    pthread_mutex_lock(&world_lock);
+    nparked++;
+    pthread_cond_broadcast(&world_cond);
+    pthread_mutex_unlock(&world_lock);
+}
+
+void gc_leave_safe(void)
+{
+    if (!self) return;
+    pthread_mutex_lock(&world_lock);
+    while (gc_stopping) pthread_cond_wait(&world_cond, &world_lock);
+    nparked--;
+    pthread_mutex_unlock(&world_lock);
+}
+
+/* stop all mutators at safepoints, 0 if other thread is collecting */
+static int stop_world(void)
+{
+    pthread_mutex_lock(&world_lock);
+    if (gc_stopping) {
+        pthread_mutex_unlock(&world_lock);
+        gc_park();
+        return 0;
+    }
+    __atomic_store_n(&gc_stopping, 1, __ATOMIC_RELEASE);
+    pause_start = now_us();
+    while (nparked < nthreads - 1) pthread_cond_wait(&world_cond, &world_lock);
+    pthread_mutex_unlock(&world_lock);
+    return 1;
+}
+
+static void start_world(void)
+{
+    pthread_mutex_lock(&world_lock);
+    pause_time += now_us() - pause_start;
+    __atomic_store_n(&gc_stopping, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&world_cond);
+    pthread_mutex_unlock(&world_lock);
+}
+
+static void reset_nursery(void)
+{
+    nursery_ptr = nursery;
+    GcThread *t;
+    list_foreach(t, link, &threads, {
+        t->tlab_ptr = nil;
+        t->tlab_end = nil;
+    });
+}
+
+static void reset_holes(void)
+{
+    GcThread *t;
+    list_foreach(t, link, &threads, {
+        release_hole(&t->alloc.normal);
+        release_hole(&t->alloc.overflow);
+    });
+    next_line = 0;
+}
+
+/* start to mark old generation, the marked objects are black */
+static void start_marking(void)
+{
+    gc_marking = 1;
+    mark_epoch = !mark_epoch;
+    memset(line_marks, 0, nlines);
+    memset(next_bits, 0, bits_size(old_size));
+    memset(next_bits + max_old_size / GC_CARD_SIZE, 0,
+           (uintptr)large_top * GC_PAGE_SIZE / GC_CARD_SIZE * sizeof(uint64));
+}
+
+/* the unmarked lines are free, and the start bits are of marked objects */
+static void finish_marking(void)
+{
+    reset_holes();
+    memcpy(line_used, line_marks, nlines);
+    memset(evacuating, 0, nblocks);
+    free_lines = 0;
+    for (int i = 0; i < nlines; i++) free_lines += !line_used[i];
+    sweep_large();
+
+    uint64 *bits = start_bits;
+    start_bits = next_bits;
+    next_bits = bits;
+    gc_marking = 0;
+    incremental = 0;
+}
+
+static void *pop_mark_stack(void)
+{
+    void *obj = nil;
+    pthread_mutex_lock(&mark_lock);
+    if (!vector_empty(&mark_stack)) vector_pop_back(&mark_stack, &obj);
+    pthread_mutex_unlock(&mark_lock);
+    return obj;
+}
+
+/*
+ * Mark grey objects until the pause budget is used up, the nursery is empty,
+ * so only old objects are traced. It finishes marking, if there are no grey
+ * objects.
+ */
+static void mark_slice(void)
+{
+    uint64 deadline = now_us() + pause_us;
+    int count = 0;
+    void *obj;
+    while ((obj = pop_mark_stack())) {
+        scan(&marker, (GcHeaderRef)obj - 1);
+        if (!(++count & 63) && now_us() >= deadline) {
+            printf("gc-debug: %d objects marked\n", count);
+            return;
+        }
+    }
+
+    finish_marking();
+    printf("gc-debug: === marking finished ===\n");
+    printf("gc-debug: %lu totoal, %lu used, %lu avail\n",
+           (unsigned long)old_size, (unsigned long)(old_size - old_free()),
+           (unsigned long)old_free());
+}
+
+/*
+ * Snapshot at the beginning, right after a minor gc, so the roots are the gc
+ * roots. The objects, which are reachable at the snapshot, are kept by the
+ * barrier, and the new objects are black.
+ */
+static void start_incremental(void)
+{
+    printf("gc-debug: === marking is starting ===\n");
+    start_marking();
+    incremental = 1;
+    trace_roots(&marker);
+}
+
+void gc_shade(void *obj)
+{
+    if (in_space(old_space, old_size, obj))
+        mark(&marker, obj);
+    else if (in_space(large_space, max_old_size, obj))
+        mark_large(&marker, obj);
+}
+
+static void minor_gc(void)
+{
+    printf("gc-debug: === minor gc is starting ===\n");
+
+    minor = 1;
+    uintptr avail = old_free();
+    /* the holes of mutators are free for workers */
+    reset_holes();
+    snapshot_cards();
+    run_workers();
+    reset_nursery();
+    minor = 0;
+
+    printf("gc-debug: === minor gc finished ===\n");
+    printf("gc-debug: %lu bytes promoted\n",
+           (unsigned long)(avail - old_free()));
+}
+
+/* minor gc, the world is stopped */
+static void minor_collect(void)
+{
+    minor_gc();
+    if (incremental)
+        mark_slice();
+    else if (old_size - old_free() >= old_size / 100 * GC_MARK_START)
+        start_incremental();
+}
+
+void gc_minor(void)
+{
+    if (!stop_world()) return;
+    minor_collect();
+    start_world();
+}
+
+void gc_start_marking(void)
+{
+    if (!stop_world()) return;
+
+    minor_gc();
+    if (!incremental) start_incremental();
+
+    start_world();
+}
+
+/*
+ * The sparse blocks are evacuated, if their live lines can be moved to the
+ * free lines of other blocks, with the young objects.
+ */
+static void select_evacuation(void)
+{
+    int reserved = (nursery_ptr - nursery + GC_LINE_SIZE - 1) / GC_LINE_SIZE;
+    int avail = free_lines - reserved;
+    for (int b = 0; b < nblocks; b++) {
+        int first = b * LINES_PER_BLOCK;
+        int num = MIN(LINES_PER_BLOCK, nlines - first);
+        int used = 0;
+        for (int i = first; i < first + num; i++) used += line_used[i];
+        if (!used || used > LINES_PER_BLOCK / 4) continue;
+        /* its free lines are not available, and its live lines are moved */
+        if (num > avail) continue;
+        avail -= num;
+        evacuating[b] = 1;
+    }
+}
+
+/* full gc, the world is stopped */
+static void full_collect(void)
+{
+    printf("gc-debug: === gc is starting ===\n");
+
+    reset_holes();
+    /* the young objects are promoted */
+    uintptr young = nursery_ptr - nursery;
+    if (old_free() < young) grow_old(young - old_free());
+    if (incremental) {
+        /*
+         * incremental marking is finished by workers, the epoch is not
+         * flipped again, otherwise the objects, which are not marked yet,
+         * look as marked.
+         */
+        void *obj;
+        while (!vector_empty(&mark_stack)) {
+            vector_pop_back(&mark_stack, &obj);
+            vector_push_back(&overflow, &obj);
+            noverflow++;
+        }
+        /* the marked objects are not scanned again, their young are dirty */
+        snapshot_cards();
+    } else {
+        select_evacuation();
+        start_marking();
+        clear_cards();
+    }
+
+    run_workers();
+    reset_nursery();
+    finish_marking();
+    adjust_old();
 
     printf("gc-debug: === gc finished ===\n");
-    printf("gc-debug: %d totoal, %ld used, %ld avail\n", space_size,
-           (free_ptr - from_space), space_size - (free_ptr - from_space));
+    printf("gc-debug: %lu totoal, %lu used, %lu avail\n",
+           (unsigned long)old_size, (unsigned long)(old_size - old_free()),
+           (unsigned long)old_free());
+}
+
+void gc(void)
+{
+    if (!stop_world()) return;
+    full_collect();
+    start_world();
 }
 
 #ifdef __cplusplus
@@ -13,8 +13,12 @@
 extern "C" {
 #endif
 
-/* FIXME: per-thread? */
-extern void *gcroots;
+/*
+ * The gc roots of current thread. A task, which is switched on threads(e.g.
+ * coroutine), has its own root chain, it's swapped with gcroots, when the
+ * task is switched, and it's added by gc_add_roots.
+ */
+extern __thread void *gcroots;
 
 /*
  roots[0] = num_roots,
@@ -40,17 +44,148 @@ extern void *gcroots;
  objmap[1...n] = offset,
 */
 
+/*
+ * Card table of old generation and large object space, one byte per
+ * GC_CARD_SIZE bytes. The card of an old object is dirty, if its reference
+ * field is written, so the minor gc scans the objects in dirty cards only.
+ */
+#define GC_CARD_SIZE 512
+
+/* the old generation is divided into blocks and lines */
+#define GC_BLOCK_SIZE (32 * 1024)
+#define GC_LINE_SIZE  128
+
+extern uint8 *gc_cards;
+extern char *gc_old_start;
+extern uintptr gc_old_size;
+
+/* remember old object, whose reference field is written */
+static inline void gc_write_barrier(void *obj)
+{
+    uintptr offset = (char *)obj - gc_old_start;
+    if (offset < gc_old_size) gc_cards[offset / GC_CARD_SIZE] = 1;
+}
+
+/* old generation is being marked */
+extern int gc_marking;
+
+/* mark the object, which is reachable at the snapshot */
+void gc_shade(void *obj);
+
+/* keep the reference, which is overwritten during marking */
+static inline void gc_satb_barrier(void *old)
+{
+    if (gc_marking && old) gc_shade(old);
+}
+
+/* write reference val to field of obj */
+#define gc_write(obj, field, val)                \
+    do {                                         \
+        gc_satb_barrier((void *)(uintptr)(field)); \
+        (field) = (val);                         \
+        gc_write_barrier(obj);                   \
+    } while (0)
+
+/*
+ * Thread local allocation buffer, the small objects are allocated in it
+ * without lock, and it's refilled from nursery atomically.
+ */
+#define GC_TLAB_SIZE (4 * 1024)
+
+/*
+ * The object of at least GC_LARGE_SIZE bytes is allocated in large object
+ * space, it's not moved by gc.
+ */
+#define GC_LARGE_SIZE (8 * 1024)
+
 /* allocate object */
 void *gc_alloc(int size, int *objmap);
 
 /* allocate array */
 void *gc_alloc_array(int num, int size, int isobj);
 
-/* start to gc */
+/* max number of gc workers */
+#define GC_MAX_WORKERS 32
+
+/* the world is stopping for gc */
+extern int gc_stopping;
+
+/* park current thread until gc is finished */
+void gc_park(void);
+
+/* safepoint of mutator, it's polled at calls and loops */
+static inline void gc_safepoint(void)
+{
+    if (__atomic_load_n(&gc_stopping, __ATOMIC_ACQUIRE)) gc_park();
+}
+
+/*
+ * Safe region of current thread, e.g. a blocking system call. It doesn't
+ * touch the heap in it, so gc runs without waiting for it, and it's parked
+ * when it leaves, if gc is not finished.
+ */
+void gc_enter_safe(void);
+
+void gc_leave_safe(void);
+
+/* current thread is a mutator, which is stopped by gc at safepoints */
+void gc_attach(void);
+
+/* current thread is not a mutator any more, its roots are not scanned */
+void gc_detach(void);
+
+/* add root chain of task, it's scanned until it's removed */
+void gc_add_roots(void **roots);
+
+/* remove root chain of task */
+void gc_remove_roots(void **roots);
+
+/* trace the object in slot, and update the slot if the object is moved */
+typedef void (*GcVisitFunc)(void *ctx, void **slot);
+
+/* scan the roots of arg by visit, e.g. the stacks of vm */
+typedef void (*GcScanFunc)(void *arg, GcVisitFunc visit, void *ctx);
+
+/* add root scanner, it's called by gc until it's removed */
+void gc_add_scanner(GcScanFunc scan, void *arg);
+
+/* remove root scanner */
+void gc_remove_scanner(GcScanFunc scan, void *arg);
+
+/* start to gc, the mutators are stopped at safepoints */
 void gc(void);
 
-/* initialize gc */
-void gc_init(int size);
+/* start to minor gc, only nursery is collected */
+void gc_minor(void);
+
+/*
+ * The old generation is marked incrementally, after a minor gc, if it's
+ * GC_MARK_START percent used. Each minor gc marks a slice, which is at
+ * most KOALA_GC_PAUSE_US(default GC_PAUSE_US) microseconds.
+ */
+#define GC_MARK_START 50
+#define GC_PAUSE_US   1000
+
+/* start to mark old generation incrementally */
+void gc_start_marking(void);
+
+/*
+ * The old generation grows, after a full gc, if it's GC_GROW_PERCENT used or
+ * the gc time is more than KOALA_GC_TIME_RATIO(default GC_TIME_RATIO)
+ * percent, and it shrinks, if it's less than GC_SHRINK_PERCENT used.
+ */
+#define GC_GROW_PERCENT   70
+#define GC_SHRINK_PERCENT 30
+#define GC_TIME_RATIO     5
+
+/* initialize gc, the heap is resized between min and max bytes */
+void gc_init_heap(uintptr min, uintptr max);
+
+/* initialize gc, the heap is size bytes */
+void gc_init(uintptr size);
+
+/* current size of heap(old generation) */
+uintptr gc_heap_size(void);
 
 /* finalize gc */
 void gc_fini(void);
@@ -56,7 +56,7 @@ objref array_new(uint32 tp_map)
     arr->tp_map = tp_map;
     arr->itemsize = itemsize;
     arr->count = ARRAY_DEFAULT_SIZE;
-    arr->gcarr = gcarr;
+    gc_write(arr, arr->gcarr, gcarr);
     gc_pop();
     return (objref)arr;
 }
@@ -77,8 +77,9 @@ void array_reserve(objref self, int32 count)
         int ref = tp_is_ref(arr->tp_map, 0);
         void *gcarr = gc_alloc_array(num, arr->itemsize, ref);
         memcpy(gcarr, arr->gcarr, arr->count * arr->itemsize);
+        if (ref) gc_write_barrier(gcarr);
         arr->count = num;
-        arr->gcarr = gcarr;
+        gc_write(arr, arr->gcarr, gcarr);
     }
     arr->next = count;
 
@@ -104,12 +105,15 @@ void array_set(objref self, uint32 index, anyref val)
         void *gcarr;
         gcarr = gc_alloc_array(num, arr->itemsize, ref);
         memcpy(gcarr, arr->gcarr, arr->count * arr->itemsize);
+        if (ref) gc_write_barrier(gcarr);
         arr->count = num;
-        arr->gcarr = gcarr;
+        gc_write(arr, arr->gcarr, gcarr);
     }
 
     char *addr = (char *)arr->gcarr + index * arr->itemsize;
+    if (ref) gc_satb_barrier(*(void **)addr);
     memcpy(addr, &val, arr->itemsize);
+    if (ref) gc_write_barrier(arr->gcarr);
     if (index == arr->next) ++arr->next;
 
     gc_pop();
@@ -143,12 +147,14 @@ void array_append(objref self, anyref val)
         void *gcarr;
         gcarr = gc_alloc_array(num, arr->itemsize, ref);
         memcpy(gcarr, arr->gcarr, arr->count * arr->itemsize);
+        if (ref) gc_write_barrier(gcarr);
         arr->count = num;
-        arr->gcarr = gcarr;
+        gc_write(arr, arr->gcarr, gcarr);
     }
 
     char *addr = (char *)arr->gcarr + arr->next * arr->itemsize;
     memcpy(addr, &val, arr->itemsize);
+    if (ref) gc_write_barrier(arr->gcarr);
     ++arr->next;
 
     gc_pop();
@@ -19,6 +19,7 @@ void init_field_type(void);
 void init_method_type(void);
 void init_package_type(void);
 void init_string_type(void);
+void init_int_type(void);
 void init_array_type(void);
 void init_map_type(void);
 void init_option_type(void);
@@ -42,14 +43,7 @@ static int mn_equal(void *m1, void *m2)
 void init_core(void)
 {
     hashmap_init(&pkg_map, mn_equal);
-
-    char *name = "/";
-    PkgNode *pkg = mm_alloc_obj(pkg);
-    pkg->name = name;
-    hashmap_entry_init(pkg, str_hash(name));
-    hashmap_init(&pkg->map, mn_equal);
-
-    hashmap_put_absent(&pkg_map, pkg);
+    pkg_new("/");
 
     init_any_type();
 
@@ -59,6 +53,7 @@ void init_core(void)
     init_package_type();
 
     init_string_type();
+    init_int_type();
     init_array_type();
     init_map_type();
     init_option_type();
@@ -417,13 +412,26 @@ int type_add_field(TypeInfo *ty, char *name, TypeDesc *desc)
     return 0;
 }
 
+static inline void __add_method(TypeInfo *ty, FuncNode *fn)
+{
+    Vector *vec = ty->methods;
+    if (!vec) {
+        vec = vector_create(PTR_SIZE);
+        ty->methods = vec;
+    }
+    vector_push_back(vec, &fn);
+}
+
 int type_add_kfunc(TypeInfo *ty, char *name, TypeDesc *desc, CodeInfo *code)
 {
     FuncNode *fn = _add_func(__get_mtbl(ty), name, desc);
     if (!fn) return -1;
     fn->kind = MNODE_KFUNC_KIND;
+    fn->pkg = ty->pkg;
     fn->ptr = (uintptr)code;
     fn->slot = -1;
+    code->name = name;
+    __add_method(ty, fn);
     return 0;
 }
 
@@ -434,12 +442,7 @@ int type_add_cfunc(TypeInfo *ty, char *name, TypeDesc *desc, void *ptr)
     fn->kind = MNODE_CFUNC_KIND;
     fn->ptr = (uintptr)ptr;
     fn->slot = -1;
-    Vector *vec = ty->methods;
-    if (!vec) {
-        vec = vector_create(PTR_SIZE);
-        ty->methods = vec;
-    }
-    vector_push_back(vec, &fn);
+    __add_method(ty, fn);
     return 0;
 }
 
@@ -524,10 +527,27 @@ FuncNode *object_get_func(objref obj, int offset)
     return vtbl->func[offset];
 }
 
+void pkg_new(char *path)
+{
+    if (_get_pkg(path)) return;
+    PkgNode *pkg = mm_alloc_obj(pkg);
+    pkg->name = path;
+    hashmap_entry_init(pkg, str_hash(path));
+    hashmap_init(&pkg->map, mn_equal);
+    hashmap_put_absent(&pkg_map, pkg);
+}
+
 void pkg_add_type(char *path, TypeInfo *type)
 {
     PkgNode *pkg = _get_pkg(path);
     _add_type(&pkg->map, type->name, type);
+    type->pkg = pkg;
+
+    /* the methods added before */
+    FuncNode **fn;
+    vector_foreach(fn, type->methods, {
+        if ((*fn)->kind == MNODE_KFUNC_KIND) (*fn)->pkg = pkg;
+    });
 }
 
 void pkg_add_var(char *path, char *name, TypeDesc *desc)
@@ -551,7 +571,89 @@ void pkg_add_kfunc(char *path, char *name, TypeDesc *desc, CodeInfo *code)
     FuncNode *fn = _add_func(&pkg->map, name, desc);
     if (!fn) return;
     fn->kind = MNODE_KFUNC_KIND;
+    fn->pkg = pkg;
     fn->ptr = (uintptr)code;
+    code->name = name;
+}
+
+MNode *pkg_find(char *path, char *name)
+{
+    PkgNode *pkg = _get_pkg(path);
+    if (!pkg) return nil;
+    MNode key = { .name = name };
+    hashmap_entry_init(&key, str_hash(name));
+    return hashmap_get(&pkg->map, &key);
+}
+
+int pkg_add_rel(char *path, char *relpath, char *name)
+{
+    PkgNode *pkg = _get_pkg(path);
+    /* the vector may be moved, but functions point to it */
+    if (pkg->relocated) {
+        printf("error: '%s' is relocated, '%s' can't be referenced\n", path,
+               name);
+        return -1;
+    }
+    Vector *vec = pkg->rel;
+    if (!vec) {
+        vec = vector_create(sizeof(RelInfo));
+        pkg->rel = vec;
+    }
+    RelInfo rel = { 0, relpath, name };
+    vector_push_back(vec, &rel);
+    return vector_size(vec) - 1;
+}
+
+static void _set_relinfo(void *entry, void *arg)
+{
+    PkgNode *pkg = arg;
+    MNode *node = entry;
+    if (node->kind == MNODE_TYPE_KIND) {
+        /* methods of type, the inherited ones are of their packages */
+        TypeInfo *type = ((TypeNode *)node)->type;
+        if (type->mtbl) hashmap_visit(type->mtbl, _set_relinfo, pkg);
+        return;
+    }
+    if (node->kind != MNODE_KFUNC_KIND) return;
+    FuncNode *fn = (FuncNode *)node;
+    if (fn->pkg != pkg) return;
+    ((CodeInfo *)fn->ptr)->relinfo = (RelInfo *)pkg->rel->objs;
+}
+
+int pkg_relocate(char *path)
+{
+    PkgNode *pkg = _get_pkg(path);
+    RelInfo *rel;
+    MNode *node;
+    vector_foreach(rel, pkg->rel, {
+        if (rel->addr) continue;
+        node = pkg_find(rel->path, rel->name);
+        if (!node) {
+            printf("error: symbol '%s' not found in '%s'\n", rel->name,
+                   rel->path);
+            return -1;
+        }
+        switch (node->kind) {
+            case MNODE_KFUNC_KIND:
+            case MNODE_CFUNC_KIND:
+                rel->addr = (uintptr)node;
+                break;
+            case MNODE_TYPE_KIND:
+                rel->addr = (uintptr)((TypeNode *)node)->type;
+                break;
+            case MNODE_VAR_KIND:
+                rel->addr = (uintptr)&((VarNode *)node)->val;
+                break;
+            default:
+                printf("error: symbol '%s' can't be relocated\n", rel->name);
+                return -1;
+        }
+    });
+
+    /* the table is not changed any more, functions point to it directly */
+    if (pkg->rel) hashmap_visit(&pkg->map, _set_relinfo, pkg);
+    pkg->relocated = 1;
+    return 0;
 }
 
 #ifdef __cplusplus
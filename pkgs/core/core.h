@@ -150,6 +150,8 @@ struct _TypeInfo {
     Vector *lro;
     /* all symbols */
     HashMap *mtbl;
+    /* package of type, set by pkg_add_type() */
+    PkgNode *pkg;
 };
 
 /* virtual table */
@@ -235,6 +237,11 @@ struct _FuncNode {
     TypeDesc *desc;
     PkgNode *pkg;
     uintptr ptr;
+    /* call stub and ffi_cif of c function, see vm/ffi.h */
+    void *stub;
+    void *cif;
+    /* number of arguments of stub */
+    int8 argc;
 };
 
 struct _ProtoNode {
@@ -258,6 +265,8 @@ struct _PkgNode {
     HashMap map;
     Vector *rel;
     Vector *gc_map;
+    /* relocated, no more symbol references are added */
+    int8 relocated;
 };
 
 struct _MNode {
@@ -265,13 +274,42 @@ struct _MNode {
 };
 
 struct _CodeInfo {
+    /* name of function, for profilers */
+    char *name;
     Vector locvars;
     Vector freevars;
     Vector upvars;
+    /* number of registers */
+    uint32 stacksize;
+    /* inline caches of method call sites, see vm/vm.h */
+    void *icache;
+    /* number of calls, see vm/jit.h */
+    uint32 calls;
+    /* number of backward jumps, for on-stack replacement */
+    uint32 loops;
+    /* jit tier, see vm/jit.h */
+    uint32 tier;
+    /* native code compiled by jit */
+    void *jitcode;
+    /* baseline code, it's kept after optimized, its frames may be running */
+    void *basecode;
+    /* module of optimized code, see vm/jit_llvm.c */
+    void *optcode;
+    /* native entry of interpreter for perf, see vm/perf.h */
+    void *trampoline;
+    /* relocations of package, set by pkg_relocate() */
+    RelInfo *relinfo;
+    /* stack maps of safepoints, built by verifier, see vm/stackmap.h */
+    void *stackmap;
     uint32 size;
     uint8 codes[0];
 };
 
+/*
+ * Symbol reference of package, which is resolved by pkg_relocate().
+ * addr is FuncNode of function, TypeInfo of type, or address of value of
+ * variable, and it's 0 before relocation.
+ */
 struct _RelInfo {
     uintptr addr;
     char *path;
@@ -342,16 +380,33 @@ bool map_remove(objref self, anyref key, anyref *val);
 objref string_new(char *s);
 void string_show(objref self);
 
+/* int object, which boxes the integer out of tagged int, see vm/value.h */
+
+objref int_new(int64 val);
+/* the object is int object */
+int int_check(objref self);
+int64 int_get(objref self);
+
 /* reflect(class, field, method, package) object */
 
 objref class_new(objref obj);
 
 /* package operations */
 
+void pkg_new(char *path);
 void pkg_add_type(char *path, TypeInfo *type);
 void pkg_add_var(char *path, char *name, TypeDesc *desc);
 void pkg_add_cfunc(char *path, char *name, TypeDesc *desc, void *ptr);
 void pkg_add_kfunc(char *path, char *name, TypeDesc *desc, CodeInfo *code);
+MNode *pkg_find(char *path, char *name);
+/* add symbol reference to package, return its index, -1 if it's relocated */
+int pkg_add_rel(char *path, char *relpath, char *name);
+/*
+ * resolve all symbol references of package, 0: ok, -1: not found
+ * The functions of package and its types point to the references directly,
+ * so all of them must be added before it's called.
+ */
+int pkg_relocate(char *path);
 
 /* core pkg("/") initialize and finalize */
 
@@ -0,0 +1,56 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#include "core.h"
+#include "gc/gc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* final class Int {}, the integer out of range of tagged int */
+typedef struct _IntObj IntObj;
+
+struct _IntObj {
+    VTable *vtbl;
+    int64 val;
+};
+
+static TypeInfo int_type = {
+    .name = "Int",
+    .flags = TF_CLASS | TF_FINAL,
+};
+
+void init_int_type(void)
+{
+    type_ready(&int_type);
+    type_show(&int_type);
+    pkg_add_type("/", &int_type);
+}
+
+objref int_new(int64 val)
+{
+    IntObj *obj = gc_alloc(sizeof(*obj), nil);
+    obj->vtbl = int_type.vtbl[0];
+    obj->val = val;
+    return (objref)obj;
+}
+
+int int_check(objref self)
+{
+    return self && __GET_VTBL(self) == int_type.vtbl[0];
+}
+
+int64 int_get(objref self)
+{
+    return ((IntObj *)self)->val;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -101,7 +101,7 @@ static void alloc_entries(MapObj *map, uint32 size)
     MapEntry **entries = gc_alloc_array(size, sizeof(MapEntry *), 1);
 
     map->size = size;
-    map->entries = entries;
+    gc_write(map, map->entries, entries);
 
     /* set thresholds */
     map->grow_at = size * MAP_LOAD_FACTOR / 100;
@@ -150,6 +150,19 @@ static MapEntry **find_entry(MapObj *map, anyref key)
     return e;
 }
 
+/*
+ * The slot is in entries array or the next of an entry, which is the first
+ * field, so the slot is the entry itself.
+ */
+static void entry_barrier(MapObj *map, MapEntry **slot)
+{
+    MapEntry **entries = map->entries;
+    if (slot >= entries && slot < entries + map->size)
+        gc_write_barrier(entries);
+    else
+        gc_write_barrier(slot);
+}
+
 static MapEntry *entry_new(anyref key, anyref val, int key_ref, int val_ref)
 {
     int *objmap;
@@ -174,6 +187,7 @@ static MapEntry *entry_new(anyref key, anyref val, int key_ref, int val_ref)
     entry->hash = __hash(key, key_ref);
     entry->key = key;
     entry->val = val;
+    gc_write_barrier(entry);
 
     gc_pop();
 
@@ -200,8 +214,8 @@ static void rehash(MapObj *map, int newsize)
         while (e) {
             n = e->next;
             b = bucket(map, e->hash);
-            e->next = map->entries[b];
-            map->entries[b] = e;
+            gc_write(e, e->next, map->entries[b]);
+            gc_write(map->entries, map->entries[b], e);
             e = n;
         }
     }
@@ -222,8 +236,8 @@ bool map_put_absent(objref self, anyref key, anyref val)
     int val_ref = tp_is_ref(map->tp_map, 1);
     MapEntry *entry = entry_new(key, val, key_ref, val_ref);
     int b = bucket(map, entry->hash);
-    entry->next = map->entries[b];
-    map->entries[b] = entry;
+    gc_write(entry, entry->next, map->entries[b]);
+    gc_write(map->entries, map->entries[b], entry);
     map->count++;
     if (map->count > map->grow_at) rehash(map, map->size << 1);
 
@@ -237,7 +251,10 @@ void map_put(objref self, anyref key, anyref val, anyref *old)
     MapEntry **entry = find_entry(map, key);
     if (*entry) {
         if (old) *old = (*entry)->val;
-        (*entry)->val = val;
+        if (tp_is_ref(map->tp_map, 1))
+            gc_write(*entry, (*entry)->val, val);
+        else
+            (*entry)->val = val;
     } else {
         map_put_absent(self, key, val);
     }
@@ -259,7 +276,9 @@ bool map_remove(objref self, anyref key, anyref *val)
     if (!*entry) return 0;
 
     MapEntry *old = *entry;
+    gc_satb_barrier(old);
     *entry = old->next;
+    entry_barrier(map, entry);
     old->next = nil;
 
     GC_STACK(1);
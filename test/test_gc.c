@@ -8,6 +8,7 @@
 
 #include "gc/gc.h"
 #include "util/mm.h"
+#include <pthread.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -118,8 +119,489 @@ void test_array_gc2(void)
     gc_pop();
 }
 
+struct Node {
+    int value;
+    struct Node *next;
+};
+
+int Node_objmap[2] = {
+    1,
+    offsetof(struct Node, next),
+};
+
+/* the list is copied without recursion */
+void test_list_gc(void)
+{
+    int num = 4000;
+    struct Node *head = nil;
+    struct Node *node = nil;
+    GC_STACK(2);
+    gc_push(&head, 0);
+    gc_push(&node, 1);
+
+    for (int i = 0; i < num; i++) {
+        node = gc_alloc(sizeof(struct Node), Node_objmap);
+        node->value = i;
+        node->next = head;
+        head = node;
+    }
+    node = nil;
+
+    gc();
+
+    int i = num;
+    for (node = head; node; node = node->next) assert(node->value == --i);
+    assert(i == 0);
+
+    gc_pop();
+}
+
+/* old object points to young object by write barrier */
+void test_minor_gc(void)
+{
+    struct Foo *foo = nil;
+    struct Bar *bar = nil;
+    GC_STACK(1);
+    gc_push(&foo, 0);
+
+    foo = gc_alloc(sizeof(struct Foo), Foo_objmap);
+    foo->value = 1;
+    gc();
+    struct Foo *old_foo = foo;
+
+    bar = gc_alloc(sizeof(struct Bar), nil);
+    bar->value = 2;
+    gc_write(foo, foo->bar, bar);
+    bar = nil;
+
+    /* garbage */
+    for (int i = 0; i < 10000; i++) {
+        struct Bar *tmp = gc_alloc(sizeof(struct Bar), nil);
+        tmp->value = i;
+    }
+
+    gc_minor();
+    assert(foo == old_foo);
+    assert(foo->value == 1);
+    assert(foo->bar->value == 2);
+
+    /* old object is not moved */
+    gc();
+    assert(foo == old_foo);
+    assert(foo->bar->value == 2);
+
+    gc_pop();
+}
+
+/* live objects of sparse blocks are evacuated */
+void test_evacuation(void)
+{
+    int num = 2048;
+    struct Node *head = nil;
+    struct Node *node = nil;
+    struct Node **live = nil;
+    struct Node *olds[64];
+    GC_STACK(3);
+    gc_push(&head, 0);
+    gc_push(&node, 1);
+    gc_push(&live, 2);
+
+    live = (struct Node **)gc_alloc_array(num / 32, sizeof(void *), 1);
+    for (int i = 0; i < num; i++) {
+        node = gc_alloc(sizeof(struct Node), Node_objmap);
+        node->value = i;
+        node->next = head;
+        head = node;
+        if (!(i % 32)) gc_write(live, live[i / 32], node);
+    }
+    node = nil;
+
+    /* the list is in old generation, and the most of it is dead */
+    gc();
+    head = nil;
+    for (int i = 0; i < num / 32; i++) live[i]->next = nil;
+    gc();
+    for (int i = 0; i < num / 32; i++) olds[i] = live[i];
+
+    gc();
+    int moved = 0;
+    for (int i = 0; i < num / 32; i++) {
+        assert(live[i]->value == i * 32);
+        moved += live[i] != olds[i];
+    }
+    assert(moved > 0);
+
+    gc_pop();
+}
+
+struct Tree {
+    int value;
+    struct Tree *left;
+    struct Tree *right;
+};
+
+int Tree_objmap[3] = {
+    2,
+    offsetof(struct Tree, left),
+    offsetof(struct Tree, right),
+};
+
+static struct Tree *new_tree(int depth, int value)
+{
+    struct Tree *tree = gc_alloc(sizeof(struct Tree), Tree_objmap);
+    tree->value = value;
+    if (depth > 0) {
+        GC_STACK(1);
+        gc_push(&tree, 0);
+        struct Tree *sub = new_tree(depth - 1, value * 2);
+        gc_write(tree, tree->left, sub);
+        sub = new_tree(depth - 1, value * 2 + 1);
+        gc_write(tree, tree->right, sub);
+        gc_pop();
+    }
+    return tree;
+}
+
+static int check_tree(struct Tree *tree, int depth, int value)
+{
+    if (tree->value != value) return 0;
+    if (!depth) return !tree->left && !tree->right;
+    return check_tree(tree->left, depth - 1, value * 2) &&
+           check_tree(tree->right, depth - 1, value * 2 + 1);
+}
+
+/* the workers steal the subtrees */
+void test_parallel_gc(void)
+{
+    struct Tree *tree = nil;
+    GC_STACK(1);
+    gc_push(&tree, 0);
+
+    tree = new_tree(10, 1);
+    gc_minor();
+    assert(check_tree(tree, 10, 1));
+    gc();
+    assert(check_tree(tree, 10, 1));
+    gc();
+    assert(check_tree(tree, 10, 1));
+
+    gc_pop();
+}
+
+/* each mutator allocates in its own tlab, and its roots are scanned */
+static void *mutator_main(void *arg)
+{
+    int num = 500;
+    int id = (int)(uintptr)arg;
+    struct Node *head = nil;
+    struct Node *node = nil;
+    gc_attach();
+    GC_STACK(2);
+    gc_push(&head, 0);
+    gc_push(&node, 1);
+
+    for (int i = 0; i < num; i++) {
+        /* garbage */
+        for (int j = 0; j < 3; j++) gc_alloc(sizeof(struct Node), Node_objmap);
+        node = gc_alloc(sizeof(struct Node), Node_objmap);
+        node->value = id * num + i;
+        gc_write(node, node->next, head);
+        head = node;
+        gc_safepoint();
+    }
+
+    int i = num - 1;
+    for (node = head; node; node = node->next)
+        assert(node->value == id * num + i--);
+    assert(i == -1);
+
+    gc_pop();
+    gc_detach();
+    return nil;
+}
+
+void test_tlab_gc(void)
+{
+    pthread_t threads[3];
+    /* main thread is joining, it's not a mutator */
+    gc_detach();
+    for (int i = 0; i < 3; i++)
+        pthread_create(&threads[i], nil, mutator_main, (void *)(uintptr)i);
+    for (int i = 0; i < 3; i++) pthread_join(threads[i], nil);
+    gc_attach();
+}
+
+/* the heap grows for live objects, and shrinks after they are dead */
+void test_growable_heap(void)
+{
+    int num = 8000;
+    struct Node *head = nil;
+    struct Node *node = nil;
+    GC_STACK(2);
+    gc_push(&head, 0);
+    gc_push(&node, 1);
+
+    for (int i = 0; i < num; i++) {
+        node = gc_alloc(sizeof(struct Node), Node_objmap);
+        node->value = i;
+        gc_write(node, node->next, head);
+        head = node;
+    }
+    gc();
+    assert(gc_heap_size() > 4 * GC_BLOCK_SIZE);
+
+    int i = num - 1;
+    for (node = head; node; node = node->next) assert(node->value == i--);
+    assert(i == -1);
+
+    head = nil;
+    for (i = 0; i < 8; i++) gc();
+    assert(gc_heap_size() == 4 * GC_BLOCK_SIZE);
+
+    gc_pop();
+}
+
+/* a line and two lines with the 16 bytes header */
+struct Line {
+    struct Line *next;
+    char pad[GC_LINE_SIZE - 24];
+};
+
+struct Lines {
+    struct Lines *next;
+    char pad[GC_LINE_SIZE * 2 - 24];
+};
+
+int Line_objmap[2] = {
+    1,
+    offsetof(struct Line, next),
+};
+
+/* the old generation grows, if its free lines are too fragmented to promote */
+void test_fragmented_heap(void)
+{
+    int num = 1200;
+    struct Line **lines = nil;
+    struct Line *line = nil;
+    struct Lines *head = nil;
+    struct Lines *node = nil;
+    GC_STACK(4);
+    gc_push(&lines, 0);
+    gc_push(&line, 1);
+    gc_push(&head, 2);
+    gc_push(&node, 3);
+
+    lines = (struct Line **)gc_alloc_array(num, sizeof(void *), 1);
+    for (int i = 0; i < num; i++) {
+        line = gc_alloc(sizeof(struct Line), Line_objmap);
+        gc_write(lines, lines[i], line);
+    }
+    line = nil;
+    gc();
+
+    /* every other line is free */
+    for (int i = 1; i < num; i += 2) lines[i] = nil;
+    gc();
+    uintptr size = gc_heap_size();
+
+    for (int i = 0; i < 120; i++) {
+        node = gc_alloc(sizeof(struct Lines), Line_objmap);
+        node->pad[0] = i;
+        gc_write(node, node->next, head);
+        head = node;
+    }
+    node = nil;
+    gc_minor();
+    assert(gc_heap_size() > size);
+
+    int i = 119;
+    for (node = head; node; node = node->next) assert(node->pad[0] == i--);
+    assert(i == -1);
+
+    gc_pop();
+}
+
+/* the large array is not moved, and the dead ones are swept */
+void test_large_object(void)
+{
+    int num = 4096;
+    struct Node **arr = nil;
+    struct Node *node = nil;
+    GC_STACK(2);
+    gc_push(&arr, 0);
+    gc_push(&node, 1);
+
+    arr = (struct Node **)gc_alloc_array(num, sizeof(void *), 1);
+    struct Node **old_arr = arr;
+    for (int i = 0; i < num; i += 64) {
+        node = gc_alloc(sizeof(struct Node), Node_objmap);
+        node->value = i;
+        gc_write(arr, arr[i], node);
+    }
+    node = nil;
+
+    /* the young nodes are found by card of array */
+    gc_minor();
+    assert(arr == old_arr);
+    gc();
+    assert(arr == old_arr);
+    for (int i = 0; i < num; i += 64) assert(arr[i]->value == i);
+
+    /* 32 pages are reused */
+    for (int i = 0; i < 16; i++) {
+        arr = (struct Node **)gc_alloc_array(num, sizeof(void *), 1);
+        assert(!arr[num - 1]);
+        arr[num - 1] = (struct Node *)arr;
+    }
+
+    gc_pop();
+}
+
+/* old and large space are 3 GiB, the cards and bits are past 2^31 bytes */
+void test_huge_heap(void)
+{
+    assert(gc_heap_size() == 4 * GC_BLOCK_SIZE);
+    test_large_object();
+    assert(gc_heap_size() == 4 * GC_BLOCK_SIZE);
+}
+
+/* the memory of dead objects is zero, when it's allocated again */
+void test_zero_alloc(void)
+{
+    int num = 100;
+    void **arr = nil;
+    GC_STACK(1);
+    gc_push(&arr, 0);
+
+    for (int n = 0; n < 8; n++) {
+        /* big array in old generation, and small one in nursery */
+        arr = gc_alloc_array(num, sizeof(void *), 0);
+        for (int i = 0; i < num; i++) assert(!arr[i]);
+        for (int i = 0; i < num; i++) arr[i] = (void *)(uintptr)(i + 1);
+        arr = gc_alloc_array(num / 10, sizeof(void *), 0);
+        for (int i = 0; i < num / 10; i++) assert(!arr[i]);
+        for (int i = 0; i < num / 10; i++) arr[i] = (void *)(uintptr)(i + 1);
+        arr = nil;
+        gc();
+    }
+
+    gc_pop();
+}
+
+/* the reference, which is moved to root during marking, is kept */
+void test_incremental_gc(void)
+{
+    int num = 2000;
+    struct Node *head = nil;
+    struct Node *node = nil;
+    struct Node *tail = nil;
+    struct Node **live = nil;
+    GC_STACK(4);
+    gc_push(&head, 0);
+    gc_push(&node, 1);
+    gc_push(&tail, 2);
+    gc_push(&live, 3);
+
+    for (int i = 0; i < num; i++) {
+        node = gc_alloc(sizeof(struct Node), Node_objmap);
+        node->value = i;
+        gc_write(node, node->next, head);
+        head = node;
+    }
+    gc();
+
+    gc_start_marking();
+    assert(gc_marking);
+
+    /* the tail is only in root, after it's cut from list */
+    node = head;
+    for (int i = 0; i < num / 2 - 1; i++) node = node->next;
+    tail = node->next;
+    gc_write(node, node->next, nil);
+    node = nil;
+    head = nil;
+
+    /* each minor gc marks a slice */
+    int slices = 0;
+    while (gc_marking) {
+        gc_minor();
+        slices++;
+    }
+    assert(slices > 1);
+
+    /* the free lines are reused */
+    live = (struct Node **)gc_alloc_array(512, sizeof(void *), 1);
+    for (int i = 0; i < 512; i++) {
+        node = gc_alloc(sizeof(struct Node), Node_objmap);
+        node->value = -1;
+        gc_write(live, live[i], node);
+    }
+    node = nil;
+    gc_minor();
+
+    int i = num / 2 - 1;
+    for (node = tail; node; node = node->next) assert(node->value == i--);
+    assert(i == -1);
+
+    gc_pop();
+}
+
+/* the young objects of marked ones are promoted, when full gc ends marking */
+void test_marking_full_gc(void)
+{
+    int num = 2000;
+    struct Node *head = nil;
+    struct Node *node = nil;
+    struct Foo **foos = nil;
+    struct Bar *bar = nil;
+    GC_STACK(4);
+    gc_push(&head, 0);
+    gc_push(&node, 1);
+    gc_push(&foos, 2);
+    gc_push(&bar, 3);
+
+    foos = (struct Foo **)gc_alloc_array(256, sizeof(void *), 1);
+    for (int i = 0; i < 256; i++) {
+        struct Foo *foo = gc_alloc(sizeof(struct Foo), Foo_objmap);
+        gc_write(foos, foos[i], foo);
+    }
+    for (int i = 0; i < num; i++) {
+        node = gc_alloc(sizeof(struct Node), Node_objmap);
+        gc_write(node, node->next, head);
+        head = node;
+    }
+    node = nil;
+    gc();
+
+    /* the first slice marks some of foos */
+    gc_start_marking();
+    gc_minor();
+    assert(gc_marking);
+
+    for (int i = 0; i < 256; i++) {
+        bar = gc_alloc(sizeof(struct Bar), nil);
+        bar->value = i;
+        gc_write(foos[i], foos[i]->bar, bar);
+    }
+    bar = nil;
+    gc();
+    assert(!gc_marking);
+
+    /* the nursery is reused */
+    for (int i = 0; i < 1000; i++) {
+        bar = gc_alloc(sizeof(struct Bar), nil);
+        bar->value = -1;
+    }
+    for (int i = 0; i < 256; i++) assert(foos[i]->bar->value == i);
+
+    gc_pop();
+}
+
 int main(int argc, char *argv[])
 {
+    setenv("KOALA_GC_WORKERS", "4", 1);
+    setenv("KOALA_GC_PAUSE_US", "0", 1);
+    setenv("KOALA_GC_TIME_RATIO", "100", 1);
     gc_init(200);
 
     mm_stat();
@@ -132,6 +614,54 @@ int main(int argc, char *argv[])
 
     gc_fini();
 
+    gc_init(4000 * 40);
+    test_list_gc();
+    gc_fini();
+
+    gc_init(4096);
+    test_minor_gc();
+    gc_fini();
+
+    gc_init(4 * GC_BLOCK_SIZE);
+    test_evacuation();
+    gc_fini();
+
+    gc_init(4 * GC_BLOCK_SIZE);
+    test_parallel_gc();
+    gc_fini();
+
+    gc_init(4 * GC_BLOCK_SIZE);
+    test_incremental_gc();
+    gc_fini();
+
+    gc_init(4 * GC_BLOCK_SIZE);
+    test_marking_full_gc();
+    gc_fini();
+
+    gc_init(4 * GC_BLOCK_SIZE);
+    test_tlab_gc();
+    gc_fini();
+
+    gc_init_heap(4 * GC_BLOCK_SIZE, 32 * GC_BLOCK_SIZE);
+    test_growable_heap();
+    gc_fini();
+
+    gc_init_heap(4 * GC_BLOCK_SIZE, 32 * GC_BLOCK_SIZE);
+    test_fragmented_heap();
+    gc_fini();
+
+    gc_init(4 * GC_BLOCK_SIZE);
+    test_large_object();
+    gc_fini();
+
+    gc_init_heap(4 * GC_BLOCK_SIZE, 3UL << 29);
+    test_huge_heap();
+    gc_fini();
+
+    gc_init(4096);
+    test_zero_alloc();
+    gc_fini();
+
     mm_stat();
 
     return 0;
@@ -7,8 +7,21 @@
 \*===----------------------------------------------------------------------===*/
 
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "core/core.h"
+#include "gc/gc.h"
 #include "util/mm.h"
+#include "vm/coroutine.h"
+#include "vm/ffi.h"
+#include "vm/jit.h"
 #include "vm/opcode.h"
+#include "vm/stackmap.h"
+#include "vm/value.h"
+#include "vm/verify.h"
 #include "vm/vm.h"
 
 #ifdef __cplusplus
@@ -34,13 +47,26 @@ extern "C" {
     (val) & 0xFF, ((val) >> 8) & 0xFF, ((val) >> 16) & 0xFF, \
         ((val) >> 24) & 0xFF
 
+/* free the stack and the call infos of ks */
+static void free_state(KoalaState *ks)
+{
+    CallInfo *ci = ks->base_ci.next;
+    CallInfo *next;
+    while (ci) {
+        next = ci->next;
+        mm_free(ci);
+        ci = next;
+    }
+    mm_free(ks->stack);
+}
+
 void test_opcode(void)
 {
     uint8 codes[] = {
         OP_I8K, 0, VAL_I8(-3), OP_I32_ADDK, 0, 0, VAL_U8(254), OP_RET,
     };
 
-    KoalaState ks;
+    KoalaState ks = { 0 };
     ks.ci = &ks.base_ci;
     ks.nci = 1;
     ks.stack = mm_alloc(32 * sizeof(StkVal));
@@ -56,6 +82,17 @@ void test_opcode(void)
 
     koala_execute(&ks, ci);
     assert((int32)ci->base[0] == 251);
+    free_state(&ks);
+
+    /* the lengths of verifier, interpreter and tail call rewriting */
+    assert(opcode_length(OP_RET) == 1);
+    assert(opcode_length(OP_CALL) == 4);
+    assert(opcode_length(OP_I32_JMP_CMPKGT) == 5);
+    assert(opcode_length(OP_CMP_F64) == 6);
+    assert(opcode_length(OP_ANY_CMP) == 4);
+    /* not executed by interpreter */
+    assert(opcode_length(OP_JMP) == -1);
+    assert(!opcode_format(OP_JMP));
 
     /*
     // ci->base[0] = 10;
@@ -70,9 +107,1301 @@ void test_opcode(void)
     */
 }
 
+/*
+    func add<T>(a T, b T) T {
+        return a + b
+    }
+*/
+void test_quicken(void)
+{
+    uint8 codes[] = {
+        OP_ADD, 0, 0, 1, 0, 0, OP_RET,
+    };
+
+    KoalaState ks = { 0 };
+    ks.stack = mm_alloc(32 * sizeof(StkVal));
+    ks.stack_end = ks.stack + 32;
+
+    CallInfo *ci = &ks.base_ci;
+    ci->code = codes;
+    ci->base = ks.stack;
+    ci->top = ks.stack + 2;
+
+    /* add<i32> */
+    ci->tp_map = TP_1(TP_I32_KIND);
+    for (int i = 0; i < QUICKEN_THRESHOLD + 2; i++) {
+        ks.ci = ci;
+        ci->savedpc = codes;
+        ci->base[0] = 100;
+        ci->base[1] = 200;
+        koala_execute(&ks, ci);
+        assert((int32)ci->base[0] == 300);
+    }
+    assert(codes[0] == OP_ADD_I32);
+
+    /* add<f64>, de-quicken and quicken again */
+    ci->tp_map = TP_1(TP_F64_KIND);
+    for (int i = 0; i < QUICKEN_THRESHOLD + 2; i++) {
+        ks.ci = ci;
+        ci->savedpc = codes;
+        *(double *)&ci->base[0] = 1.5;
+        *(double *)&ci->base[1] = 2.25;
+        koala_execute(&ks, ci);
+        assert(*(double *)&ci->base[0] == 3.75);
+        if (i == 0) assert(codes[0] == OP_ADD);
+    }
+    assert(codes[0] == OP_ADD_F64);
+
+    free_state(&ks);
+}
+
+static void run_codes(KoalaState *ks, uint8 *codes)
+{
+    CallInfo *ci = &ks->base_ci;
+    ks->ci = ci;
+    ks->top = ci->top;
+    ci->savedpc = codes;
+    koala_execute(ks, ci);
+}
+
+/*
+    class Foo {
+        func value() int32 {
+            return 42
+        }
+    }
+*/
+void test_icache(void)
+{
+    uint8 value_codes[] = {
+        OP_I8K, 0, 42, OP_RET,
+    };
+    CodeInfo *code = mm_alloc(sizeof(CodeInfo) + sizeof(value_codes));
+    code->stacksize = 1;
+    code->size = sizeof(value_codes);
+    memcpy(code->codes, value_codes, sizeof(value_codes));
+
+    TypeInfo *foo_type = type_new("Foo", TF_CLASS);
+    type_add_kfunc(foo_type, "value", nil, code);
+    type_ready(foo_type);
+    pkg_add_type("/", foo_type);
+    VTable *foo = foo_type->vtbl[0];
+
+    uint8 codes[] = {
+        OP_PUSH, 0, OP_CALL_METHOD, 1, 0, 0, OP_SAVE_RET, 1, OP_RET,
+    };
+
+    InlineCache icache[1] = { { .name = "value" } };
+
+    KoalaState ks = { 0 };
+    ks.stack = mm_alloc(32 * sizeof(StkVal));
+    ks.stack_end = ks.stack + 32;
+
+    CallInfo *ci = &ks.base_ci;
+    ci->code = codes;
+    ci->base = ks.stack;
+    ci->top = ks.stack + 1;
+    ci->icache = icache;
+
+    /* monomorphic */
+    for (int i = 0; i < 3; i++) {
+        ci->base[0] = (StkVal)&foo;
+        ci->base[1] = 0;
+        run_codes(&ks, codes);
+        assert((int32)ci->base[1] == 42);
+        assert(icache[0].count == 1);
+        assert(icache[0].misses == 1);
+        assert(icache[0].entries[0].vtbl == foo);
+    }
+
+    /* polymorphic */
+    icache[0] = (InlineCache){ .name = "__hash__" };
+    objref arr = array_new(TP_1(TP_I32_KIND));
+    GC_STACK(1);
+    gc_push(&arr, 0);
+    objref objs[] = { (objref)&foo, arr, (objref)&foo, arr };
+    for (int i = 0; i < COUNT_OF(objs); i++) {
+        ci->base[0] = objs[i];
+        run_codes(&ks, codes);
+        assert((int32)ci->base[1] == tp_any_hash(objs[i], 1));
+    }
+    assert(icache[0].count == 2);
+    assert(icache[0].misses == 2);
+    assert(!ic_is_megamorphic(&icache[0]));
+    gc_pop();
+
+    free_state(&ks);
+}
+
+#if defined(KOALA_LLVM)
+
+static StkVal *moved_reg;
+
+/* the object of register is moved by gc during the call */
+static uintptr move_reg(void)
+{
+    *moved_reg += 16;
+    return 0;
+}
+
+void test_opt_jit(void)
+{
+    uint8 codes[] = {
+        OP_ADD_I32, 0, 0, 1, 0, 0, OP_DIV_I32, 0, 0, 1, 0, 0, OP_RET,
+    };
+    CodeInfo *code = mm_alloc(sizeof(CodeInfo) + sizeof(codes));
+    code->stacksize = 2;
+    code->size = sizeof(codes);
+    memcpy(code->codes, codes, sizeof(codes));
+
+    assert(!jit_opt_compile(code));
+    assert(code->tier == JIT_TIER_OPT);
+
+    KoalaState ks = { 0 };
+    ks.stack = mm_alloc(32 * sizeof(StkVal));
+    ks.stack_end = ks.stack + 32;
+
+    CallInfo *ci = &ks.base_ci;
+    ci->codeinfo = code;
+    ci->code = code->codes;
+    ci->base = ks.stack;
+    ci->top = ks.stack + 1;
+    ci->tp_map = TP_1(TP_I32_KIND);
+    ci->base[0] = 100;
+    ci->base[1] = 20;
+    assert(!((JitFunc)code->jitcode)(&ks, ci));
+    assert((int32)ci->base[0] == 6);
+
+    /* type parameter is changed, deoptimized at the first instruction */
+    ci->tp_map = TP_1(TP_I64_KIND);
+    assert(((JitFunc)code->jitcode)(&ks, ci));
+    assert(ci->savedpc == code->codes);
+
+    /* division by zero, deoptimized at the second instruction */
+    ci->tp_map = TP_1(TP_I32_KIND);
+    ci->base[0] = 100;
+    ci->base[1] = 0;
+    assert(((JitFunc)code->jitcode)(&ks, ci));
+    assert(ci->savedpc == code->codes + 6);
+    assert((int32)ci->base[0] == 100);
+
+    /* the module is removed after the running frame is returned */
+    void *opt;
+    assert(jit_opt_hold(code, &opt) == code->jitcode);
+    assert(opt);
+    jit_free(code);
+    assert(!code->jitcode && !code->optcode);
+    jit_opt_release(opt);
+    mm_free(code);
+
+    /* clang-format off */
+    /* R(0): object, R(1): n */
+    uint8 loop[] = {
+        OP_CALL, 0, 0, 0,
+        OP_I32_SUBK, 1, 1, 1,
+        OP_JGT, 1, 0xF4, 0xFF,
+        OP_RET,
+    };
+    /* clang-format on */
+
+    code = mm_alloc(sizeof(CodeInfo) + sizeof(loop));
+    code->stacksize = 2;
+    code->size = sizeof(loop);
+    memcpy(code->codes, loop, sizeof(loop));
+    pkg_new("/opt_jit");
+    pkg_add_kfunc("/opt_jit", "opt_loop", nil, code);
+    pkg_add_cfunc("/opt_jit", "move_reg", nil, move_reg);
+    int16 index = pkg_add_rel("/opt_jit", "/opt_jit", "move_reg");
+    memcpy(code->codes + 2, &index, 2);
+    assert(!pkg_relocate("/opt_jit"));
+    assert(!jit_opt_compile(code));
+
+    ks.ci = ci;
+    ks.budget = 0;
+    ci->codeinfo = code;
+    ci->code = code->codes;
+    ci->relinfo = code->relinfo;
+    ci->top = ci->base + code->stacksize - 1;
+    ks.top = ci->top;
+    ci->base[0] = 0x1000;
+    ci->base[1] = 3 * CO_TIME_SLICE;
+    moved_reg = ci->base;
+    assert(!((JitFunc)code->jitcode)(&ks, ci));
+    /* registers are loaded again after calls */
+    assert(ci->base[0] == 0x1000 + 16 * 3 * CO_TIME_SLICE);
+    /* backward branches are polled */
+    assert(ks.budget > 0 && ks.budget <= CO_TIME_SLICE);
+
+    jit_free(code);
+    free_state(&ks);
+
+#if defined(__x86_64__)
+    /* the baseline code is kept, and reused after deoptimized */
+    uint8 add[] = { OP_I32_ADD, 0, 0, 1, OP_RET };
+    code = mm_alloc(sizeof(CodeInfo) + sizeof(add));
+    code->stacksize = 2;
+    code->size = sizeof(add);
+    memcpy(code->codes, add, sizeof(add));
+    assert(!jit_compile(code));
+    void *base = code->jitcode;
+    assert(base && code->basecode == base);
+    assert(!jit_opt_compile(code));
+    assert(code->jitcode != base && code->basecode == base);
+    assert(jit_opt_hold(code, &opt) != base && opt);
+    jit_opt_discard(code, opt);
+    assert(code->jitcode == base && !code->optcode);
+    assert(code->tier == JIT_TIER_BASELINE && !code->calls);
+    /* discarded by another frame already */
+    jit_opt_discard(code, opt);
+    assert(code->jitcode == base);
+    jit_opt_release(opt);
+    jit_free(code);
+    assert(!code->jitcode && !code->basecode);
+    mm_free(code);
+#endif
+
+    /* not supported, it's interpreted and not compiled again */
+    uint8 neg[] = { OP_I64_NEG, 0, 0, OP_RET };
+    code = mm_alloc(sizeof(CodeInfo) + sizeof(neg));
+    code->stacksize = 1;
+    code->size = sizeof(neg);
+    memcpy(code->codes, neg, sizeof(neg));
+    assert(jit_opt_compile(code));
+    assert(code->tier == JIT_TIER_FAILED);
+    assert(!code->jitcode && !code->optcode);
+    mm_free(code);
+}
+
+#endif
+
+/*
+func sum(n int32, acc int32) int32 {
+    if n <= 0 return acc
+    return sum(n - 1, acc + n)
+}
+*/
+void test_tail_call(void)
+{
+    /* clang-format off */
+    uint8 codes[] = {
+        OP_I32_JMP_CMPKGT, 0, 0, 4, 0,
+        OP_MOVE, 0, 1,
+        OP_RET,
+        OP_I32_ADD, 1, 1, 0,
+        OP_PUSH_I32_SUBK, 0, 1,
+        OP_PUSH, 1,
+        OP_CALL, 2, 0, 0,
+        OP_SAVE_RET, 0,
+        OP_RET,
+    };
+    /* clang-format on */
+
+    CodeInfo *code = mm_alloc(sizeof(CodeInfo) + sizeof(codes));
+    code->stacksize = 2;
+    code->size = sizeof(codes);
+    memcpy(code->codes, codes, sizeof(codes));
+
+    pkg_new("/tail_call");
+    pkg_add_kfunc("/tail_call", "sum", nil, code);
+    int16 index = pkg_add_rel("/tail_call", "/tail_call", "sum");
+    memcpy(code->codes + 20, &index, 2);
+    assert(!pkg_relocate("/tail_call"));
+
+    assert(koala_tail_calls(code) == 1);
+    assert(code->codes[18] == OP_TAIL_CALL);
+
+    KoalaState ks = { 0 };
+    ks.ci = &ks.base_ci;
+    ks.nci = 1;
+    ks.stack = mm_alloc(32 * sizeof(StkVal));
+    ks.stack_end = ks.stack + 32;
+
+    CallInfo *ci = ks.ci;
+    ci->codeinfo = code;
+    ci->code = code->codes;
+    ci->base = ks.stack;
+    ci->top = ci->base + code->stacksize - 1;
+    ci->savedpc = code->codes;
+    ci->relinfo = code->relinfo;
+    ks.top = ci->top;
+
+    ci->base[0] = 10000;
+    ci->base[1] = 0;
+    ci->tp_map = 0x21;
+    koala_execute(&ks, ci);
+    assert((int32)ci->base[0] == 50005000);
+    /* no new frames */
+    assert(!ci->next);
+    /* type parameters of caller are not inherited */
+    assert(!ci->tp_map);
+    /* tail calls are counted, it's tried by each tier */
+    assert(code->calls == 10000);
+    assert(code->tier == JIT_TIER_FAILED);
+
+    /* callee frame is out of value stack */
+    pid_t pid = fork();
+    if (!pid) {
+        ks.stack_end = ks.stack + 1;
+        ci->savedpc = code->codes;
+        ci->base[0] = 10;
+        ci->base[1] = 0;
+        koala_execute(&ks, ci);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+
+    /* the hot callee of tail calls is compiled, and run natively */
+    uint8 inc[] = { OP_I32_ADDK, 0, 0, 1, OP_RET };
+    CodeInfo *leaf = mm_alloc(sizeof(CodeInfo) + sizeof(inc));
+    leaf->stacksize = 1;
+    leaf->size = sizeof(inc);
+    memcpy(leaf->codes, inc, sizeof(inc));
+    uint8 tail[] = { OP_PUSH, 0, OP_CALL, 1, 0, 0, OP_SAVE_RET, 0, OP_RET };
+    CodeInfo *caller = mm_alloc(sizeof(CodeInfo) + sizeof(tail));
+    caller->stacksize = 1;
+    caller->size = sizeof(tail);
+    memcpy(caller->codes, tail, sizeof(tail));
+    pkg_new("/tail_inc");
+    pkg_add_kfunc("/tail_inc", "inc", nil, leaf);
+    pkg_add_kfunc("/tail_inc", "call_inc", nil, caller);
+    index = pkg_add_rel("/tail_inc", "/tail_inc", "inc");
+    memcpy(caller->codes + 4, &index, 2);
+    assert(!pkg_relocate("/tail_inc"));
+    assert(koala_tail_calls(caller) == 1);
+
+    ci->codeinfo = caller;
+    ci->code = caller->codes;
+    ci->relinfo = caller->relinfo;
+    for (int i = 0; i < JIT_THRESHOLD + 1; i++) {
+        ks.ci = ci;
+        ks.nci = 1;
+        ci->savedpc = caller->codes;
+        ci->top = ci->base + caller->stacksize - 1;
+        ks.top = ci->top;
+        ci->base[0] = i;
+        koala_execute(&ks, ci);
+        assert((int32)ci->base[0] == i + 1);
+    }
+    assert(leaf->calls == JIT_THRESHOLD + 1);
+#if defined(__x86_64__)
+    assert(leaf->jitcode);
+#endif
+    jit_free(leaf);
+
+    free_state(&ks);
+}
+
+void test_osr(void)
+{
+    /* clang-format off */
+    /* R(0): n, R(1): sum */
+    uint8 codes[] = {
+        OP_I32_ADD, 1, 1, 0,
+        OP_I32_SUBK, 0, 0, 1,
+        OP_JGT, 0, 0xF4, 0xFF,
+        OP_MOVE, 0, 1,
+        OP_RET,
+    };
+    /* clang-format on */
+
+    CodeInfo *code = mm_alloc(sizeof(CodeInfo) + sizeof(codes));
+    code->stacksize = 2;
+    code->size = sizeof(codes);
+    memcpy(code->codes, codes, sizeof(codes));
+
+    KoalaState ks = { 0 };
+    ks.ci = &ks.base_ci;
+    ks.nci = 1;
+    ks.stack = mm_alloc(32 * sizeof(StkVal));
+    ks.stack_end = ks.stack + 32;
+
+    CallInfo *ci = ks.ci;
+    ci->codeinfo = code;
+    ci->code = code->codes;
+    ci->base = ks.stack;
+    ci->top = ci->base + code->stacksize - 1;
+    ci->savedpc = code->codes;
+    ks.top = ci->top;
+
+    /* called once, the loop is continued by jit code */
+    ci->base[0] = 60000;
+    ci->base[1] = 0;
+    koala_execute(&ks, ci);
+    assert((int32)ci->base[0] == 1800030000);
+#if defined(__x86_64__)
+    assert(code->jitcode);
+    assert(jit_osr_entry(code, code->codes));
+    assert(!jit_osr_entry(code, code->codes + 4));
+    /* not counted by jit code */
+    assert(code->loops == 0);
+    /* but polled at backward jumps */
+    assert(ks.budget > 0 && ks.budget <= CO_TIME_SLICE);
+#endif
+
+    jit_free(code);
+    free_state(&ks);
+    mm_free(code);
+}
+
+#if defined(__x86_64__)
+
+static int loop_done;
+
+/* the loop is replaced by jit code, it runs until R(0) is 0 */
+static void *loop_main(void *arg)
+{
+    KoalaState *ks = arg;
+    gc_attach();
+    koala_execute(ks, ks->ci);
+    gc_detach();
+    __atomic_store_n(&loop_done, 1, __ATOMIC_RELEASE);
+    return nil;
+}
+
+void test_jit_safepoint(void)
+{
+    /* clang-format off */
+    /* R(0): flag, R(1): counter */
+    uint8 codes[] = {
+        OP_I32_ADDK, 1, 1, 1,
+        OP_JGT, 0, 0xF8, 0xFF,
+        OP_RET,
+    };
+    /* clang-format on */
+
+    CodeInfo *code = mm_alloc(sizeof(CodeInfo) + sizeof(codes));
+    code->stacksize = 2;
+    code->size = sizeof(codes);
+    memcpy(code->codes, codes, sizeof(codes));
+
+    KoalaState ks = { 0 };
+    ks.ci = &ks.base_ci;
+    ks.nci = 1;
+    ks.stack = mm_alloc(32 * sizeof(StkVal));
+    ks.stack_end = ks.stack + 32;
+
+    CallInfo *ci = ks.ci;
+    ci->codeinfo = code;
+    ci->code = code->codes;
+    ci->base = ks.stack;
+    ci->top = ci->base + code->stacksize - 1;
+    ci->savedpc = code->codes;
+    ks.top = ci->top;
+    ci->base[0] = 1;
+    ci->base[1] = 0;
+
+    pthread_t thread;
+    pthread_create(&thread, nil, loop_main, &ks);
+    int32 *counter = (int32 *)(ci->base + 1);
+    while (__atomic_load_n(counter, __ATOMIC_RELAXED) < 100 * JIT_OSR_THRESHOLD)
+        ;
+
+    /* the loop of jit code is stopped by gc at its backward jump */
+    gc();
+    assert(!__atomic_load_n(&loop_done, __ATOMIC_ACQUIRE));
+    assert(code->jitcode);
+
+    __atomic_store_n((int32 *)ci->base, 0, __ATOMIC_RELAXED);
+    pthread_join(thread, nil);
+    assert(loop_done);
+
+    jit_free(code);
+    free_state(&ks);
+    mm_free(code);
+}
+
+#endif
+
+static uintptr twice(uintptr v)
+{
+    return v * 2;
+}
+
+void test_relocate(void)
+{
+    /* clang-format off */
+    uint8 codes[] = {
+        OP_PUSH, 0,
+        OP_CALL, 1, 0, 0,
+        OP_SAVE_RET, 0,
+        OP_RET,
+    };
+    /* clang-format on */
+
+    CodeInfo *code = mm_alloc(sizeof(CodeInfo) + sizeof(codes));
+    code->stacksize = 1;
+    code->size = sizeof(codes);
+    memcpy(code->codes, codes, sizeof(codes));
+
+    /* methods are added before and after the type is in package */
+    CodeInfo *m1 = mm_alloc(sizeof(CodeInfo) + sizeof(codes));
+    CodeInfo *m2 = mm_alloc(sizeof(CodeInfo) + sizeof(codes));
+    TypeInfo *bar_type = type_new("Bar", TF_CLASS);
+    type_add_kfunc(bar_type, "m1", nil, m1);
+
+    pkg_new("/relocate");
+    pkg_add_type("/relocate", bar_type);
+    type_add_kfunc(bar_type, "m2", nil, m2);
+    pkg_add_cfunc("/relocate", "twice", nil, twice);
+    pkg_add_var("/relocate", "counter", nil);
+    pkg_add_kfunc("/relocate", "call_twice", nil, code);
+    int16 index = pkg_add_rel("/relocate", "/relocate", "twice");
+    memcpy(code->codes + 4, &index, 2);
+    int var = pkg_add_rel("/relocate", "/relocate", "counter");
+    assert(!pkg_relocate("/relocate"));
+    /* the table may be moved, so it's fixed after relocated */
+    assert(pkg_add_rel("/relocate", "/relocate", "twice") < 0);
+
+    /* direct pointers */
+    assert(code->relinfo);
+    MNode *twice_fn = pkg_find("/relocate", "twice");
+    assert(code->relinfo[index].addr == (uintptr)twice_fn);
+    VarNode *vn = (VarNode *)pkg_find("/relocate", "counter");
+    assert(code->relinfo[var].addr == (uintptr)&vn->val);
+    assert(m1->relinfo == code->relinfo && m2->relinfo == code->relinfo);
+
+    KoalaState ks = { 0 };
+    ks.ci = &ks.base_ci;
+    ks.nci = 1;
+    ks.stack = mm_alloc(32 * sizeof(StkVal));
+    ks.stack_end = ks.stack + 32;
+
+    CallInfo *ci = ks.ci;
+    ci->codeinfo = code;
+    ci->code = code->codes;
+    ci->base = ks.stack;
+    ci->top = ci->base + code->stacksize - 1;
+    ci->savedpc = code->codes;
+    ci->relinfo = code->relinfo;
+    ks.top = ci->top;
+
+    ci->base[0] = 21;
+    koala_execute(&ks, ci);
+    assert(ci->base[0] == 42);
+
+    free_state(&ks);
+    mm_free(m1);
+    mm_free(m2);
+}
+
+static int verify(uint8 *codes, int size, int stacksize, int argc)
+{
+    CodeInfo *code = mm_alloc(sizeof(CodeInfo) + size);
+    code->stacksize = stacksize;
+    code->size = size;
+    memcpy(code->codes, codes, size);
+    int ret = verify_code(code, argc, nil);
+    if (code->stackmap) stackmap_free(code->stackmap);
+    mm_free(code);
+    return ret;
+}
+
+static double fadd(double a, double b)
+{
+    return a + b;
+}
+
+static double fmul(double a, double b)
+{
+    return a * b;
+}
+
+static uintptr sum6(uintptr a, uintptr b, uintptr c, uintptr d, uintptr e,
+                    uintptr f)
+{
+    return a + b + c + d + e + f;
+}
+
+static StkVal exec_code(CodeInfo *code, StkVal *args, int argc)
+{
+    KoalaState ks = { 0 };
+    ks.ci = &ks.base_ci;
+    ks.nci = 1;
+    ks.stack = mm_alloc(32 * sizeof(StkVal));
+    ks.stack_end = ks.stack + 32;
+
+    CallInfo *ci = ks.ci;
+    ci->codeinfo = code;
+    ci->code = code->codes;
+    ci->base = ks.stack;
+    ci->top = ci->base + code->stacksize - 1;
+    ci->savedpc = code->codes;
+    ci->relinfo = code->relinfo;
+    ks.top = ci->top;
+
+    memcpy(ci->base, args, argc * sizeof(StkVal));
+    koala_execute(&ks, ci);
+    StkVal ret = ci->base[0];
+    free_state(&ks);
+    return ret;
+}
+
+void test_ffi(void)
+{
+    /* clang-format off */
+    uint8 fcodes[] = {
+        OP_PUSH, 0,
+        OP_PUSH, 1,
+        OP_CALL, 2, 0, 0,
+        OP_SAVE_RET, 0,
+        OP_RET,
+    };
+    uint8 icodes[] = {
+        OP_PUSH, 0, OP_PUSH, 1, OP_PUSH, 2,
+        OP_PUSH, 3, OP_PUSH, 4, OP_PUSH, 5,
+        OP_CALL, 6, 0, 0,
+        OP_SAVE_RET, 0,
+        OP_RET,
+    };
+    /* clang-format on */
+
+    static TypeDesc f64 = { DESC_F64_KIND };
+    Vector *params = vector_create(PTR_SIZE);
+    TypeDesc *desc = &f64;
+    vector_push_back(params, &desc);
+    vector_push_back(params, &desc);
+    /* it's referenced by package */
+    static TypeProto proto;
+    proto.kind = DESC_PROTO_KIND;
+    proto.ret = &f64;
+    proto.params = params;
+
+    CodeInfo *add = mm_alloc(sizeof(CodeInfo) + sizeof(fcodes));
+    CodeInfo *mul = mm_alloc(sizeof(CodeInfo) + sizeof(fcodes));
+    CodeInfo *sum = mm_alloc(sizeof(CodeInfo) + sizeof(icodes));
+    add->stacksize = mul->stacksize = 2;
+    add->size = mul->size = sizeof(fcodes);
+    memcpy(add->codes, fcodes, sizeof(fcodes));
+    memcpy(mul->codes, fcodes, sizeof(fcodes));
+    sum->stacksize = 6;
+    sum->size = sizeof(icodes);
+    memcpy(sum->codes, icodes, sizeof(icodes));
+
+    pkg_new("/ffi");
+    pkg_add_cfunc("/ffi", "fadd", (TypeDesc *)&proto, fadd);
+    pkg_add_cfunc("/ffi", "fmul", (TypeDesc *)&proto, fmul);
+    pkg_add_cfunc("/ffi", "sum6", nil, sum6);
+    pkg_add_kfunc("/ffi", "call_fadd", nil, add);
+    pkg_add_kfunc("/ffi", "call_fmul", nil, mul);
+    pkg_add_kfunc("/ffi", "call_sum6", nil, sum);
+    int16 index = pkg_add_rel("/ffi", "/ffi", "fadd");
+    memcpy(add->codes + 6, &index, 2);
+    index = pkg_add_rel("/ffi", "/ffi", "fmul");
+    memcpy(mul->codes + 6, &index, 2);
+    index = pkg_add_rel("/ffi", "/ffi", "sum6");
+    memcpy(sum->codes + 14, &index, 2);
+    assert(!pkg_relocate("/ffi"));
+
+    /* doubles are passed by libffi */
+    double d[2] = { 1.5, 4.0 };
+    StkVal ret = exec_code(add, (StkVal *)d, 2);
+    double v;
+    memcpy(&v, &ret, sizeof(v));
+    assert(v == 5.5);
+    ret = exec_code(mul, (StkVal *)d, 2);
+    memcpy(&v, &ret, sizeof(v));
+    assert(v == 6.0);
+
+    /* the cif is cached by signature */
+    FuncNode *fn1 = (FuncNode *)pkg_find("/ffi", "fadd");
+    FuncNode *fn2 = (FuncNode *)pkg_find("/ffi", "fmul");
+    assert(fn1->cif && fn1->cif == fn2->cif);
+
+    /* more than FFI_MAX_DIRECT_ARGS arguments */
+    StkVal args[] = { 1, 2, 3, 4, 5, 6 };
+    assert(exec_code(sum, args, 6) == 21);
+    assert(((FuncNode *)pkg_find("/ffi", "sum6"))->cif);
+
+    /* direct call */
+    FuncNode *twice_fn = (FuncNode *)pkg_find("/relocate", "twice");
+    assert(twice_fn->stub && !twice_fn->cif);
+
+    /* the stub is of one argument */
+    pid_t pid = fork();
+    if (!pid) {
+        ffi_call_cfunc(twice_fn, args, 2);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+    assert(ffi_call_cfunc(twice_fn, args + 1, 1) == 4);
+}
+
+void test_verify(void)
+{
+    /* clang-format off */
+    uint8 fib[] = {
+        OP_I32_JMP_CMPKGT, 0, 1, 1, 0,
+        OP_RET,
+        OP_PUSH_I32_SUBK, 0, 1,
+        OP_CALL, 1, 0, 0,
+        OP_SAVE_RET, 1,
+        OP_PUSH_I32_SUBK, 0, 2,
+        OP_CALL, 1, 0, 0,
+        OP_I32_ADD_RET, 0, 1,
+        OP_RET,
+    };
+    assert(!verify(fib, sizeof(fib), 3, 1));
+    /* out of frame */
+    assert(verify(fib, sizeof(fib), 1, 1));
+    /* R(0) is not written */
+    assert(verify(fib, sizeof(fib), 3, 0));
+    /* truncated */
+    assert(verify(fib, sizeof(fib) - 2, 3, 1));
+
+    uint8 jmp[] = {
+        OP_JGT, 0, 1, 0,
+        OP_RET,
+        OP_RET,
+    };
+    assert(!verify(jmp, sizeof(jmp), 1, 1));
+    /* into the middle of OP_JGT */
+    jmp[2] = 0xFE;
+    jmp[3] = 0xFF;
+    assert(verify(jmp, sizeof(jmp), 1, 1));
+
+    uint8 back[] = {
+        OP_I8K, 0, 1,
+        OP_JGT, 0, 0xF9, 0xFF,
+        OP_RET,
+    };
+    assert(!verify(back, sizeof(back), 1, 0));
+    /* back into the middle of OP_I8K */
+    back[5] = 0xFB;
+    assert(verify(back, sizeof(back), 1, 0));
+    /* before the start of function */
+    back[5] = 0x00;
+    back[6] = 0x80;
+    assert(verify(back, sizeof(back), 1, 0));
+
+    uint8 loop[] = {
+        OP_NIL, 1,
+        OP_I8K, 1, 1,
+        OP_JGT, 0, 0xF9, 0xFF,
+        OP_RET,
+    };
+    /* R(1) is reference on entry and i32 on back edge */
+    assert(verify(loop, sizeof(loop), 2, 1));
+
+    uint8 undef[] = {
+        OP_JGT, 0, 3, 0,
+        OP_I8K, 1, 1,
+        OP_MOVE, 0, 1,
+        OP_RET,
+    };
+    /* R(1) is not written if jumped */
+    assert(verify(undef, sizeof(undef), 2, 1));
+
+    uint8 mixed[] = {
+        OP_I8K, 1, 1,
+        OP_JGT, 0, 2, 0,
+        OP_NIL, 1,
+        OP_RET,
+    };
+    /* R(1) is i32 or reference */
+    assert(verify(mixed, sizeof(mixed), 2, 1));
+    /* R(1) is not written or reference */
+    mixed[1] = 0;
+    assert(!verify(mixed, sizeof(mixed), 2, 1));
+
+    uint8 ref[] = {
+        OP_NIL, 1,
+        OP_I32_ADD, 0, 0, 1,
+        OP_RET,
+    };
+    assert(verify(ref, sizeof(ref), 2, 1));
+
+    uint8 call[] = {
+        OP_PUSH, 0,
+        OP_PUSH, 0,
+        OP_CALL, 1, 0, 0,
+        OP_RET,
+    };
+    assert(verify(call, sizeof(call), 1, 1));
+    call[5] = 2;
+    assert(!verify(call, sizeof(call), 1, 1));
+
+    uint8 end[] = {
+        OP_I8K, 0, 1,
+    };
+    assert(verify(end, sizeof(end), 1, 0));
+
+    uint8 generic[] = {
+        OP_ADD, 0, 0, 1, 0, 0,
+        OP_CMP_F64, 0, 0, 1, 8, 0,
+        OP_RET,
+    };
+    /* type parameter out of tp_map */
+    assert(verify(generic, sizeof(generic), 2, 2));
+    generic[10] = 0;
+    assert(!verify(generic, sizeof(generic), 2, 2));
+    /* clang-format on */
+}
+
+static int last_id;
+static int switches;
+static int traces;
+
+/* coroutines are run by more than one worker */
+static uintptr trace(uintptr id)
+{
+    if (__atomic_exchange_n(&last_id, (int)id, __ATOMIC_RELAXED) != (int)id)
+        __atomic_add_fetch(&switches, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&traces, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int arrived;
+static int released;
+
+/* the worker is blocked until it takes one of released */
+static uintptr hold(uintptr id)
+{
+    __atomic_add_fetch(&arrived, 1, __ATOMIC_SEQ_CST);
+    gc_enter_safe();
+    int n = __atomic_load_n(&released, __ATOMIC_ACQUIRE);
+    while (n <= 0 || !__atomic_compare_exchange_n(&released, &n, n - 1, 0,
+                                                  __ATOMIC_ACQ_REL,
+                                                  __ATOMIC_ACQUIRE)) {
+        usleep(100);
+        n = __atomic_load_n(&released, __ATOMIC_ACQUIRE);
+    }
+    gc_leave_safe();
+    return id;
+}
+
+/* wait for n coroutines in hold, which are running at the same time */
+static void wait_arrived(int n)
+{
+    for (int i = 0; i < 10000 && __atomic_load_n(&arrived, __ATOMIC_SEQ_CST) < n;
+         i++)
+        usleep(1000);
+    assert(__atomic_load_n(&arrived, __ATOMIC_SEQ_CST) == n);
+}
+
+static uintptr read_pipe(uintptr fd)
+{
+    int32 v = 0;
+    assert(!koala_wait_fd(fd, POLLIN));
+    assert(read(fd, &v, sizeof(v)) == sizeof(v));
+    return v;
+}
+
+static uintptr write_pipe(uintptr fd)
+{
+    int32 v = 42;
+    assert(write(fd, &v, sizeof(v)) == sizeof(v));
+    return 0;
+}
+
+static int joining;
+
+static uintptr join_co(uintptr co)
+{
+    __atomic_add_fetch(&joining, 1, __ATOMIC_SEQ_CST);
+    return koala_join((Coroutine *)co);
+}
+
+static void *spawn_in_thread(void *arg)
+{
+    gc_attach();
+    /* the coroutine is run by workers, not by the thread */
+    assert(!koala_current());
+    StkVal args[] = { 4, 100 };
+    Coroutine *co = koala_spawn(arg, args, 2);
+    StkVal ret = koala_join(co);
+    gc_detach();
+    return (void *)ret;
+}
+
+static void *join_in_thread(void *arg)
+{
+    gc_attach();
+    StkVal ret = koala_join(arg);
+    gc_detach();
+    return (void *)ret;
+}
+
+static void *wait_in_thread(void *arg)
+{
+    gc_attach();
+    assert(!koala_wait_fd((int)(uintptr)arg, POLLIN));
+    gc_detach();
+    return nil;
+}
+
+static CodeInfo *new_code(uint8 *codes, int size, int stacksize, char *path,
+                          char *name)
+{
+    CodeInfo *code = mm_alloc(sizeof(CodeInfo) + size);
+    code->stacksize = stacksize;
+    code->size = size;
+    memcpy(code->codes, codes, size);
+    pkg_new(path);
+    pkg_add_kfunc(path, name, nil, code);
+    return code;
+}
+
+void test_tagged(void)
+{
+    /* one mask tests */
+    StkVal i = val_int(-5);
+    assert(val_is_int(i) && val_is_number(i) && !val_is_f64(i));
+    assert(val_get_int(i) == -5);
+    StkVal d = val_f64(2.5);
+    assert(val_is_f64(d) && !val_is_int(d) && !val_is_ref(d));
+    assert(val_get_f64(d) == 2.5);
+    assert(val_is_f64(val_f64(0.0)) && val_is_f64(val_f64(-1.0 / 0.0)));
+    assert(val_is_f64(val_f64(__builtin_nan(""))));
+    assert(val_is_bool(VAL_TRUE) && val_get_bool(VAL_TRUE));
+    assert(val_is_char(val_char(0x10FFFF)));
+    assert(val_get_char(val_char(0x10FFFF)) == 0x10FFFF);
+    assert(!val_is_ref(val_char('a')) && !val_is_bool(val_char('a')));
+    assert(val_is_ref(VAL_NIL));
+    /* references are raw pointers */
+    assert(val_is_ref((StkVal)&i));
+    assert(val_from_raw(TP_REF_KIND, (StkVal)&i) == (StkVal)&i);
+    assert(val_int_fits((1L << 48) - 1) && !val_int_fits(1L << 48));
+
+    /* the integers out of 49 bits are boxed */
+    StkVal big = val_from_raw(TP_I64_KIND, (StkVal)(1L << 60));
+    assert(val_is_ref(big) && val_is_bigint(big));
+    assert(val_to_raw(TP_I64_KIND, big) == (StkVal)(1L << 60));
+    StkVal r = val_arith(OP_ADD, big, val_int(1));
+    assert(val_is_bigint(r) && val_get_int64(r) == (1L << 60) + 1);
+    r = val_arith(OP_SUB, r, big);
+    assert(val_is_int(r) && val_get_int(r) == 1);
+    r = val_arith(OP_ADD, val_int((1L << 48) - 1), val_int(1));
+    assert(val_is_bigint(r) && val_get_int64(r) == 1L << 48);
+    r = val_arith(OP_MUL, big, val_f64(0.5));
+    assert(val_is_f64(r) && val_get_f64(r) == (double)(1L << 59));
+    assert(val_arith(OP_CMP, big, val_int(1)) == 1);
+    /* i64 wraps around, whatever the signs are */
+    r = val_arith(OP_MUL, big, val_int(-32));
+    assert(val_is_int(r) && val_get_int(r) == 0);
+    r = val_arith(OP_MUL, val_from_raw(TP_I64_KIND, (StkVal)(3L << 61)),
+                  val_int(-3));
+    assert(val_is_bigint(r) && val_get_int64(r) == (int64)(7UL << 61));
+    assert(!val_is_bigint(val_int(1)) && !val_is_bigint(VAL_NIL));
+
+    /* clang-format off */
+    /* R(0): i32, R(1): f64 */
+    uint8 codes[] = {
+        OP_TO_ANY, 2, 0, TP_I32_KIND,
+        OP_TO_ANY, 3, 1, TP_F64_KIND,
+        OP_ANY_ADD, 4, 2, 2,
+        OP_ANY_ADD, 4, 4, 3,
+        OP_ANY_CMP, 0, 4, 3,
+        OP_FROM_ANY, 1, 4, TP_F64_KIND,
+        OP_RET,
+    };
+    /* clang-format on */
+
+    CodeInfo *code = mm_alloc(sizeof(CodeInfo) + sizeof(codes));
+    code->stacksize = 5;
+    code->size = sizeof(codes);
+    memcpy(code->codes, codes, sizeof(codes));
+    uint8 kinds[] = { TP_I32_KIND, TP_F64_KIND };
+    assert(!verify_code(code, 2, kinds));
+    /* boxing instructions are safepoints */
+    assert(stackmap_find(code->stackmap, 0));
+    assert(!stackmap_find(code->stackmap, 16));
+    /* R(2) and R(3) are Any, which are tested by their tags */
+    StackMap *map = code->stackmap;
+    assert(!*stackmap_find(map, 8) && *stackmap_anys(map, 2) == 0xC);
+    /* i32 is not boxed as f64 */
+    kinds[0] = TP_F64_KIND;
+    assert(verify_code(code, 2, kinds));
+    /* raw f64 is not unboxed */
+    kinds[0] = TP_I32_KIND;
+    code->codes[22] = 1;
+    assert(verify_code(code, 2, kinds));
+    code->codes[22] = 4;
+    assert(!verify_code(code, 2, kinds));
+
+    KoalaState ks = { 0 };
+    ks.ci = &ks.base_ci;
+    ks.nci = 1;
+    ks.stack = mm_alloc(32 * sizeof(StkVal));
+    ks.stack_end = ks.stack + 32;
+
+    CallInfo *ci = ks.ci;
+    ci->codeinfo = code;
+    ci->code = code->codes;
+    ci->base = ks.stack;
+    ci->top = ci->base + code->stacksize - 1;
+    ci->savedpc = code->codes;
+    ks.top = ci->top;
+
+    double v = 0.5;
+    ci->base[0] = 3;
+    memcpy(ci->base + 1, &v, sizeof(v));
+    koala_execute(&ks, ci);
+    /* 3 + 3 is int, and 6 + 0.5 is double */
+    assert(val_is_f64(ci->base[4]));
+    assert((int32)ci->base[0] == 1);
+    memcpy(&v, ci->base + 1, sizeof(v));
+    assert(v == 6.5);
+
+    free_state(&ks);
+    stackmap_free(code->stackmap);
+    mm_free(code);
+}
+
+void test_coroutine(void)
+{
+    /* clang-format off */
+    /* R(0): id, R(1): n */
+    uint8 loop[] = {
+        OP_PUSH, 0,
+        OP_CALL, 1, 0, 0,
+        OP_I32_SUBK, 1, 1, 1,
+        OP_JGT, 1, 0xF2, 0xFF,
+        OP_RET,
+    };
+    /* R(0): fd */
+    uint8 io[] = {
+        OP_PUSH, 0,
+        OP_CALL, 1, 0, 0,
+        OP_SAVE_RET, 0,
+        OP_RET,
+    };
+    /* clang-format on */
+
+    CodeInfo *work = new_code(loop, sizeof(loop), 2, "/coroutine", "co_work");
+    CodeInfo *reader = new_code(io, sizeof(io), 1, "/coroutine", "co_reader");
+    CodeInfo *writer = new_code(io, sizeof(io), 1, "/coroutine", "co_writer");
+    CodeInfo *joiner = new_code(io, sizeof(io), 1, "/coroutine", "co_joiner");
+    CodeInfo *holder = new_code(io, sizeof(io), 1, "/coroutine", "co_holder");
+    pkg_add_cfunc("/coroutine", "trace", nil, trace);
+    pkg_add_cfunc("/coroutine", "read_pipe", nil, read_pipe);
+    pkg_add_cfunc("/coroutine", "write_pipe", nil, write_pipe);
+    pkg_add_cfunc("/coroutine", "join_co", nil, join_co);
+    pkg_add_cfunc("/coroutine", "hold", nil, hold);
+    int16 index = pkg_add_rel("/coroutine", "/coroutine", "trace");
+    memcpy(work->codes + 4, &index, 2);
+    index = pkg_add_rel("/coroutine", "/coroutine", "read_pipe");
+    memcpy(reader->codes + 4, &index, 2);
+    index = pkg_add_rel("/coroutine", "/coroutine", "write_pipe");
+    memcpy(writer->codes + 4, &index, 2);
+    index = pkg_add_rel("/coroutine", "/coroutine", "join_co");
+    memcpy(joiner->codes + 4, &index, 2);
+    index = pkg_add_rel("/coroutine", "/coroutine", "hold");
+    memcpy(holder->codes + 4, &index, 2);
+    assert(!pkg_relocate("/coroutine"));
+    /* the workers are started by the first coroutine */
+    setenv("KOALA_CO_WORKERS", "4", 1);
+
+    /* the stack of coroutine is scanned by stack maps */
+    StkVal args1[] = { 1, 2000 };
+    StkVal args2[] = { 2, 2000 };
+    assert(!koala_spawn(work, args1, 2));
+    uint8 kinds[] = { TP_I32_KIND, TP_I32_KIND };
+    assert(!verify_code(work, 2, kinds));
+    assert(!verify_code(reader, 1, kinds));
+    assert(!verify_code(writer, 1, kinds));
+    /* the coroutine to join is not a gc object */
+    kinds[0] = TP_I64_KIND;
+    assert(!verify_code(joiner, 1, kinds));
+    kinds[0] = TP_I32_KIND;
+    assert(!verify_code(holder, 1, kinds));
+
+    /* the coroutines run on 4 workers at the same time */
+    StkVal ids[] = { 10, 11, 12, 13 };
+    Coroutine *holders[4];
+    for (int i = 0; i < 4; i++) holders[i] = koala_spawn(holder, &ids[i], 1);
+    wait_arrived(4);
+    __atomic_store_n(&released, 4, __ATOMIC_RELEASE);
+    for (int i = 0; i < 4; i++) assert(koala_join(holders[i]) == ids[i]);
+
+    /* preempted at calls and backward jumps, on the only released worker */
+    arrived = 0;
+    for (int i = 0; i < 4; i++) holders[i] = koala_spawn(holder, &ids[i], 1);
+    wait_arrived(4);
+    Coroutine *co1 = koala_spawn(work, args1, 2);
+    Coroutine *co2 = koala_spawn(work, args2, 2);
+    __atomic_store_n(&released, 1, __ATOMIC_RELEASE);
+    assert(koala_join(co1) == 1);
+    assert(koala_join(co2) == 2);
+    assert(traces == 4000);
+    /* the loop is replaced by jit code, which yields at the same points */
+    assert(switches >= 4000 / CO_TIME_SLICE);
+    __atomic_store_n(&released, 3, __ATOMIC_RELEASE);
+    for (int i = 0; i < 4; i++) assert(koala_join(holders[i]) == ids[i]);
+
+    /* the reader is blocked until the writer is done */
+    int fds[2];
+    assert(!pipe(fds));
+    StkVal rfd = fds[0];
+    StkVal wfd = fds[1];
+    co1 = koala_spawn(reader, &rfd, 1);
+    co2 = koala_spawn(writer, &wfd, 1);
+    assert(koala_join(co1) == 42);
+    assert(!koala_join(co2));
+    close(fds[0]);
+    close(fds[1]);
+
+    /* more than one joiners, the last one frees it */
+    StkVal id3 = 3;
+    StkVal co3 = (StkVal)koala_spawn(holder, &id3, 1);
+    co1 = koala_spawn(joiner, &co3, 1);
+    co2 = koala_spawn(joiner, &co3, 1);
+    /* they are joined before it's done, or it may be freed by the first */
+    while (__atomic_load_n(&joining, __ATOMIC_SEQ_CST) < 2) usleep(1000);
+    usleep(10000);
+    __atomic_store_n(&released, 1, __ATOMIC_RELEASE);
+    assert(koala_join(co1) == 3);
+    assert(koala_join(co2) == 3);
+
+    pthread_t tid;
+    void *ret;
+    assert(!pthread_create(&tid, nil, spawn_in_thread, work));
+    assert(!pthread_join(tid, &ret));
+    assert((StkVal)ret == 4);
+
+    /* joined by other thread */
+    StkVal args5[] = { 5, 100 };
+    co1 = koala_spawn(work, args5, 2);
+    assert(!pthread_create(&tid, nil, join_in_thread, co1));
+    assert(!pthread_join(tid, &ret));
+    assert((StkVal)ret == 5);
+
+    /* gc doesn't wait for the thread blocked in poll */
+    assert(!pipe(fds));
+    assert(!pthread_create(&tid, nil, wait_in_thread, (void *)(uintptr)fds[0]));
+    usleep(10000);
+    gc();
+    int32 v = 42;
+    assert(write(fds[1], &v, sizeof(v)) == sizeof(v));
+    assert(!pthread_join(tid, nil));
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static KoalaState *gc_state;
+
+static uintptr alloc_garbage(uintptr obj)
+{
+    for (int i = 0; i < 16; i++) gc_alloc(sizeof(int64), nil);
+    gc_minor();
+    /* the pushed argument is moved with the register */
+    assert(*gc_state->top == gc_state->ci->base[0]);
+    return 0;
+}
+
+void test_stackmap(void)
+{
+    /* clang-format off */
+    /* R(0): object, R(1): n, R(2): not written */
+    uint8 codes[] = {
+        OP_PUSH, 0,
+        OP_CALL, 1, 0, 0,
+        OP_I32_SUBK, 1, 1, 1,
+        OP_JGT, 1, 0xF2, 0xFF,
+        OP_RET,
+    };
+    /* clang-format on */
+
+    CodeInfo *code = new_code(codes, sizeof(codes), 3, "/stackmap", "stackmap");
+    pkg_add_cfunc("/stackmap", "alloc_garbage", nil, alloc_garbage);
+    int16 index = pkg_add_rel("/stackmap", "/stackmap", "alloc_garbage");
+    memcpy(code->codes + 4, &index, 2);
+    assert(!pkg_relocate("/stackmap"));
+    uint8 kinds[] = { TP_REF_KIND, TP_I32_KIND };
+    assert(!verify_code(code, 2, kinds));
+
+    /* safepoints are the entry(loop header) and the instruction after call */
+    StackMap *map = code->stackmap;
+    assert(map->count == 2);
+    assert(stackmap_offset(map, 0) == 0 && stackmap_offset(map, 1) == 6);
+    assert(*stackmap_find(map, 0) == 1);
+    /* R(0) and the pushed argument */
+    assert(*stackmap_find(map, 6) == 9);
+    assert(!*stackmap_anys(map, 1));
+    assert(!stackmap_find(map, 10));
+
+    KoalaState ks = { 0 };
+    ks.ci = &ks.base_ci;
+    ks.nci = 1;
+    ks.stack = mm_alloc(32 * sizeof(StkVal));
+    ks.stack_end = ks.stack + 32;
+
+    CallInfo *ci = ks.ci;
+    ci->codeinfo = code;
+    ci->code = code->codes;
+    ci->base = ks.stack;
+    ci->top = ci->base + code->stacksize - 1;
+    ci->savedpc = code->codes;
+    ci->relinfo = code->relinfo;
+    ks.top = ci->top;
+
+    int64 *obj = gc_alloc(sizeof(int64), nil);
+    *obj = 42;
+    int64 *stale = gc_alloc(sizeof(int64), nil);
+    ci->base[0] = (StkVal)obj;
+    /* the loop is replaced by jit code, which is scanned by stack map too */
+    ci->base[1] = 2 * JIT_OSR_THRESHOLD;
+    ci->base[2] = (StkVal)stale;
+
+    gc_state = &ks;
+    koala_gc_register(&ks);
+    koala_execute(&ks, ci);
+    koala_gc_unregister(&ks);
+
+    /* the object is promoted, and the stale pointer is not seen by gc */
+    assert(ci->base[0] != (StkVal)obj);
+    assert(*(int64 *)ci->base[0] == 42);
+    assert(ci->base[2] == (StkVal)stale);
+#if defined(__x86_64__)
+    assert(code->jitcode);
+#endif
+
+    /* a frame without stack map can't be scanned */
+    StackMap *saved = code->stackmap;
+    code->stackmap = nil;
+    ks.ci = ci;
+    ci->savedpc = code->codes;
+    pid_t pid = fork();
+    if (!pid) {
+        koala_gc_register(&ks);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+    code->stackmap = saved;
+
+    stackmap_free(code->stackmap);
+    free_state(&ks);
+}
+
 int main(int argc, char *argv[])
 {
+    gc_init(1024);
+    init_core();
+
     test_opcode();
+    test_quicken();
+    test_icache();
+    test_tail_call();
+    test_osr();
+#if defined(__x86_64__)
+    test_jit_safepoint();
+#endif
+    test_relocate();
+    test_ffi();
+    test_verify();
+    test_tagged();
+    test_coroutine();
+    test_stackmap();
+#if defined(KOALA_LLVM)
+    test_opt_jit();
+#endif
+
+    gc_fini();
     return 0;
 }
 
@@ -7,9 +7,17 @@
 \*===----------------------------------------------------------------------===*/
 
 #include <assert.h>
+#include <pthread.h>
 #include <time.h>
+#include <unistd.h>
+#include "gc/gc.h"
 #include "util/mm.h"
+#include "vm/aot.h"
+#include "vm/coroutine.h"
+#include "vm/jit.h"
 #include "vm/opcode.h"
+#include "vm/sampler.h"
+#include "vm/verify.h"
 #include "vm/vm.h"
 
 #ifdef __cplusplus
@@ -73,6 +81,19 @@ func fib(n int32) int32 {
 #define OP_CALL           5
 #endif
 
+/* free the stack and the call infos of ks */
+static void free_state(KoalaState *ks)
+{
+    CallInfo *ci = ks->base_ci.next;
+    CallInfo *next;
+    while (ci) {
+        next = ci->next;
+        mm_free(ci);
+        ci = next;
+    }
+    mm_free(ks->stack);
+}
+
 void test_fib(void)
 {
     /* clang-format off */
@@ -125,19 +146,33 @@ void test_fib(void)
 
     /* clang-format on */
 
+    CodeInfo *code = mm_alloc(sizeof(CodeInfo) + sizeof(codes));
+    code->stacksize = 3;
+    code->size = sizeof(codes);
+    memcpy(code->codes, codes, sizeof(codes));
+    uint8 kinds[] = { TP_I32_KIND };
+    assert(!verify_code(code, 1, kinds));
+
+    pkg_new("/fib");
+    pkg_add_kfunc("/fib", "fib", nil, code);
+    int16 index = pkg_add_rel("/fib", "/fib", "fib");
+    memcpy(code->codes + 11, &index, 2);
+    memcpy(code->codes + 20, &index, 2);
+    assert(!pkg_relocate("/fib"));
+
     KoalaState ks = { 0 };
     ks.ci = &ks.base_ci;
     ks.nci = 1;
     ks.stack = mm_alloc(320 * sizeof(StkVal));
     ks.stack_end = ks.stack + 320;
 
-    int stacksize = 3;
     CallInfo *ci = ks.ci;
-    ci->code = codes;
+    ci->codeinfo = code;
+    ci->code = code->codes;
     ci->base = ks.stack;
-    ci->top = ci->base + stacksize - 1;
-    ci->savedpc = codes;
-    ci->relinfo = (uintptr)codes;
+    ci->top = ci->base + code->stacksize - 1;
+    ci->savedpc = code->codes;
+    ci->relinfo = code->relinfo;
 
     ks.top = ci->top;
 
@@ -146,10 +181,262 @@ void test_fib(void)
     clock_t start, end;
     // time(&start);
     start = clock();
+    assert(!sampler_start(&ks, 100));
     koala_execute(&ks, ci);
+    int samples = sampler_stop("./fib.folded");
     // time(&end);
     end = clock();
     printf("k-fib:%ld, %lf\n", ci->base[0], difftime(end, start));
+    printf("samples:%d\n", samples);
+    assert(samples > 0);
+    FILE *fp = fopen("./fib.folded", "r");
+    char line[1024];
+    assert(fgets(line, sizeof(line), fp));
+    assert(!strncmp(line, "fib;fib", 7));
+    fclose(fp);
+    unlink("./fib.folded");
+    assert(ci->base[0] == 102334155);
+    assert(code->jitcode);
+#if defined(KOALA_LLVM)
+    assert(code->tier == JIT_TIER_OPT);
+#else
+    /* no optimizing jit, it keeps the baseline code */
+    assert(code->tier == JIT_TIER_FAILED);
+#endif
+
+    jit_free(code);
+    free_state(&ks);
+}
+
+static void *burn_cpu(void *arg)
+{
+    clock_t start = clock();
+    volatile long n = 0;
+    while (clock() - start < CLOCKS_PER_SEC / 5) ++n;
+    return nil;
+}
+
+void test_sampler_thread(void)
+{
+    KoalaState ks = { 0 };
+    ks.ci = &ks.base_ci;
+
+    /* the other threads are not sampled */
+    assert(!sampler_start(&ks, 1000));
+    pthread_t tid;
+    assert(!pthread_create(&tid, nil, burn_cpu, nil));
+    pthread_join(tid, nil);
+    assert(sampler_stop("./thread.folded") == 0);
+    unlink("./thread.folded");
+}
+
+static CodeInfo *mt_fib;
+
+/* fib(25) by its own state, the function is tiered up by any of them */
+static void *fib_in_thread(void *arg)
+{
+    gc_attach();
+    KoalaState ks = { 0 };
+    ks.ci = &ks.base_ci;
+    ks.nci = 1;
+    ks.stack = mm_alloc(320 * sizeof(StkVal));
+    ks.stack_end = ks.stack + 320;
+
+    CallInfo *ci = ks.ci;
+    ci->codeinfo = mt_fib;
+    ci->code = mt_fib->codes;
+    ci->base = ks.stack;
+    ci->top = ci->base + mt_fib->stacksize - 1;
+    ci->savedpc = mt_fib->codes;
+    ci->relinfo = mt_fib->relinfo;
+    ks.top = ci->top;
+
+    ci->base[0] = 25;
+    koala_execute(&ks, ci);
+    int32 r = ci->base[0];
+    free_state(&ks);
+    gc_detach();
+    return (void *)(uintptr)r;
+}
+
+void test_fib_threads(void)
+{
+    /* clang-format off */
+    uint8 codes[] = {
+        OP_I32_JMP_CMPKGT, 0, 1, 1, 0,
+        OP_RET,
+        OP_PUSH_I32_SUBK, 0, 1,
+        OP_CALL, 1, 0, 0,
+        OP_SAVE_RET, 1,
+        OP_PUSH_I32_SUBK, 0, 2,
+        OP_CALL, 1, 0, 0,
+        OP_I32_ADD_RET, 0, 1,
+        OP_RET,
+    };
+    /* clang-format on */
+
+    CodeInfo *code = mm_alloc(sizeof(CodeInfo) + sizeof(codes));
+    code->stacksize = 3;
+    code->size = sizeof(codes);
+    memcpy(code->codes, codes, sizeof(codes));
+    uint8 kinds[] = { TP_I32_KIND };
+    assert(!verify_code(code, 1, kinds));
+
+    pkg_new("/fib_mt");
+    pkg_add_kfunc("/fib_mt", "fib_mt", nil, code);
+    int16 index = pkg_add_rel("/fib_mt", "/fib_mt", "fib_mt");
+    memcpy(code->codes + 11, &index, 2);
+    memcpy(code->codes + 20, &index, 2);
+    assert(!pkg_relocate("/fib_mt"));
+    mt_fib = code;
+
+    /* all threads tier it up at the same time, it's compiled once */
+    pthread_t tids[4];
+    for (int i = 0; i < 4; i++)
+        assert(!pthread_create(&tids[i], nil, fib_in_thread, nil));
+    void *r;
+    for (int i = 0; i < 4; i++) {
+        pthread_join(tids[i], &r);
+        assert((uintptr)r == 75025);
+    }
+    assert(code->jitcode && code->basecode);
+#if defined(KOALA_LLVM)
+    assert(code->tier == JIT_TIER_OPT);
+#else
+    assert(code->tier == JIT_TIER_FAILED);
+#endif
+    jit_free(code);
+}
+
+void test_aot_fib(void)
+{
+    /* clang-format off */
+    uint8 codes[] = {
+        OP_I32_JMP_CMPKGT, 0, 1, 1, 0,
+        OP_RET,
+        OP_PUSH_I32_SUBK, 0, 1,
+        OP_CALL, 1, 0, 0,
+        OP_SAVE_RET, 1,
+        OP_PUSH_I32_SUBK, 0, 2,
+        OP_CALL, 1, 0, 0,
+        OP_I32_ADD_RET, 0, 1,
+        OP_RET,
+    };
+    /* clang-format on */
+
+    CodeInfo *code = mm_alloc(sizeof(CodeInfo) + sizeof(codes));
+    code->stacksize = 3;
+    code->size = sizeof(codes);
+    memcpy(code->codes, codes, sizeof(codes));
+
+    pkg_new("/aot");
+    pkg_add_kfunc("/aot", "aot_fib", nil, code);
+    int16 index = pkg_add_rel("/aot", "/aot", "aot_fib");
+    memcpy(code->codes + 11, &index, 2);
+    memcpy(code->codes + 20, &index, 2);
+    assert(!pkg_relocate("/aot"));
+
+    /* clang-format off */
+    uint8 loop_codes[] = {
+        OP_I32_SUBK, 0, 0, 1,
+        OP_JGT, 0, 0xF8, 0xFF,
+        OP_RET,
+    };
+    /* clang-format on */
+
+    CodeInfo *loop = mm_alloc(sizeof(CodeInfo) + sizeof(loop_codes));
+    loop->stacksize = 1;
+    loop->size = sizeof(loop_codes);
+    memcpy(loop->codes, loop_codes, sizeof(loop_codes));
+    pkg_add_kfunc("/aot", "aot_loop", nil, loop);
+
+    FuncNode *funcs[] = {
+        (FuncNode *)pkg_find("/aot", "aot_fib"),
+        (FuncNode *)pkg_find("/aot", "aot_loop"),
+    };
+
+    assert(aot_compile(funcs, 2, "./fib_aot.so") == 2);
+
+    /* stale kfunc is not bound */
+    loop->codes[3] = 2;
+    assert(!aot_load(funcs, 2, "./fib_aot.so"));
+    assert(!loop->jitcode);
+    loop->codes[3] = 1;
+
+    assert(!aot_load(funcs, 2, "./fib_aot.so"));
+    assert(code->jitcode);
+    assert(code->tier == JIT_TIER_AOT);
+    assert(loop->jitcode);
+
+    KoalaState ks = { 0 };
+    ks.ci = &ks.base_ci;
+    ks.nci = 1;
+    ks.stack = mm_alloc(320 * sizeof(StkVal));
+    ks.stack_end = ks.stack + 320;
+
+    CallInfo *ci = ks.ci;
+    ci->codeinfo = code;
+    ci->code = code->codes;
+    ci->base = ks.stack;
+    ci->top = ci->base + code->stacksize - 1;
+    ci->savedpc = code->codes;
+    ci->relinfo = code->relinfo;
+
+    ks.top = ci->top;
+
+    ci->base[0] = 30;
+    koala_execute(&ks, ci);
+    printf("aot-fib:%ld\n", ci->base[0]);
+    assert(ci->base[0] == 832040);
+    assert(code->tier == JIT_TIER_AOT);
+
+    /* backward jump polls and refills budget */
+    ci->codeinfo = loop;
+    ci->code = loop->codes;
+    ci->savedpc = loop->codes;
+    ci->relinfo = nil;
+    ci->base[0] = 3 * CO_TIME_SLICE + 5;
+    ks.budget = 0;
+    assert(!((JitFunc)loop->jitcode)(&ks, ci));
+    assert(ci->base[0] == 0);
+    assert(ks.budget > 0 && ks.budget <= CO_TIME_SLICE);
+
+    unlink("./fib_aot.so");
+    free_state(&ks);
+    mm_free(loop);
+}
+
+static int file_contains(char *path, char *str)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+    char line[256];
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), fp))
+        found = strstr(line, str) != nil;
+    fclose(fp);
+    return found;
+}
+
+void test_perf(void)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+    assert(file_contains(path, "koala:fib:interp"));
+    assert(file_contains(path, "koala:fib:baseline"));
+#if defined(KOALA_LLVM)
+    assert(file_contains(path, "koala:fib:opt"));
+#endif
+    unlink(path);
+
+    snprintf(path, sizeof(path), "./jit-%d.dump", getpid());
+    FILE *fp = fopen(path, "r");
+    assert(fp);
+    uint32 magic = 0;
+    assert(fread(&magic, 4, 1, fp) == 1);
+    assert(magic == 0x4A695444);
+    fclose(fp);
+    unlink(path);
 }
 
 static int fib(int n)
@@ -165,7 +452,20 @@ int main(int argc, char *argv[])
     int r = fib(40);
     end = clock();
     printf("c-fib:%d, %lf\n", r, difftime(end, start));
+
+    setenv("KOALA_PERF_MAP", "1", 1);
+    setenv("KOALA_JITDUMP", "1", 1);
+    setenv("KOALA_PERF_TRAMPOLINE", "1", 1);
+    setenv("JITDUMPDIR", ".", 1);
+
+    gc_init(1024);
+    init_core();
     test_fib();
+    test_sampler_thread();
+    test_fib_threads();
+    test_aot_fib();
+    test_perf();
+    gc_fini();
     return 0;
 }
 
@@ -20,7 +20,7 @@ typedef struct _Block {
     uint32_t magic;
 } Block;
 
-/* allocated memory size */
+/* allocated memory size, by all threads */
 static int usedsize = 0;
 
 /* the heap size */
@@ -28,7 +28,7 @@ static const int maxsize = 512 * 1024;
 
 void *mm_alloc(int size)
 {
-    if (usedsize >= maxsize) {
+    if (__atomic_load_n(&usedsize, __ATOMIC_RELAXED) >= maxsize) {
         printf("error: there is no more memory for heap allocator.\n");
         abort();
     }
@@ -37,7 +37,7 @@ void *mm_alloc(int size)
     assert(blk);
     blk->size = size;
     blk->magic = 0xdeadbeaf;
-    usedsize += size;
+    __atomic_add_fetch(&usedsize, size, __ATOMIC_RELAXED);
 
     return (void *)(blk + 1);
 }
@@ -53,7 +53,7 @@ void mm_free(void *ptr)
         abort();
     }
 
-    usedsize -= blk->size;
+    __atomic_sub_fetch(&usedsize, blk->size, __ATOMIC_RELAXED);
     free(blk);
 }
 
@@ -0,0 +1,338 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#include "aot.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "jit.h"
+#include "opcode.h"
+#include "gc/gc.h"
+#include "util/hash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* length of supported instruction, -1 if not supported */
+static int insn_length(uint8 op)
+{
+    switch (op) {
+        case OP_RET:
+            return 1;
+        case OP_NIL:
+        case OP_PUSH:
+        case OP_SAVE_RET:
+            return 2;
+        case OP_MOVE:
+        case OP_I8K:
+        case OP_PUSH_I32_SUBK:
+        case OP_I32_ADD_RET:
+            return 3;
+        case OP_I32_ADD:
+        case OP_I32_ADDK:
+        case OP_I32_SUBK:
+        case OP_I32_CMPK:
+        case OP_JGT:
+        case OP_CALL:
+            return 4;
+        case OP_I32_JMP_CMPKGT:
+            return 5;
+        default:
+            return -1;
+    }
+}
+
+static void symbol_name(char *buf, int size, int index, char *name)
+{
+    int n = snprintf(buf, size, "__koala_aot_%d_", index);
+    while (*name && n < size - 1) {
+        buf[n++] = isalnum(*name) ? *name : '_';
+        name++;
+    }
+    buf[n] = '\0';
+}
+
+static void emit_prelude(FILE *fp)
+{
+    fprintf(fp, "/* generated by koala aot, DO NOT EDIT */\n\n");
+    fprintf(fp, "#include <stdint.h>\n\n");
+    fprintf(fp, "const uint32_t __koala_aot_version = %d;\n", AOT_VERSION);
+    fprintf(fp, "void (*__koala_call)(void *, void *, uint8_t *);\n");
+    fprintf(fp, "void (*__koala_poll)(void *, void *, uint8_t *);\n");
+    fprintf(fp, "int *__koala_gc_stopping;\n\n");
+    fprintf(fp, "#define FIELD(p, off, T) (*(T *)((char *)(p) + (off)))\n");
+    fprintf(fp, "#define I32(r) (*(int32_t *)(base + (r)))\n");
+    fprintf(fp, "#define U32(r) ((uint32_t)I32(r))\n");
+    fprintf(fp, "#define KS_TOP FIELD(ks, %d, int64_t *)\n",
+            (int)offsetof(KoalaState, top));
+    fprintf(fp, "#define KS_BUDGET FIELD(ks, %d, int32_t)\n",
+            (int)offsetof(KoalaState, budget));
+    fprintf(fp, "#define CI_TOP FIELD(ci, %d, int64_t *)\n",
+            (int)offsetof(CallInfo, top));
+    fprintf(fp, "#define CI_BASE FIELD(ci, %d, int64_t *)\n",
+            (int)offsetof(CallInfo, base));
+    fprintf(fp, "#define CI_CODE FIELD(ci, %d, uint8_t *)\n",
+            (int)offsetof(CallInfo, code));
+    /* the same as baseline jit, see vm/jit.h */
+    fprintf(fp, "#define POLL(off) \\\n"
+                "    if (__atomic_load_n(__koala_gc_stopping, __ATOMIC_ACQUIRE) "
+                "|| \\\n"
+                "        --KS_BUDGET <= 0) \\\n"
+                "        __koala_poll(ks, ci, CI_CODE + (off))\n\n");
+}
+
+/* check instructions and jump targets, 0: ok */
+static int check_code(CodeInfo *code, char *labels)
+{
+    uint8 *pc = code->codes;
+    uint8 *end = pc + code->size;
+    int len;
+    while (pc < end) {
+        len = insn_length(pc[0]);
+        if (len < 0 || pc + len > end) return -1;
+        labels[pc - code->codes] = 1;
+        pc += len;
+    }
+
+    /* the last one must be OP_RET */
+    if (pc[-len] != OP_RET) return -1;
+
+    pc = code->codes;
+    int16 offset;
+    int target;
+    while (pc < end) {
+        len = insn_length(pc[0]);
+        if (pc[0] == OP_JGT || pc[0] == OP_I32_JMP_CMPKGT) {
+            memcpy(&offset, pc + len - 2, 2);
+            target = pc - code->codes + len + offset;
+            if (target < 0 || target >= code->size || !labels[target])
+                return -1;
+        }
+        pc += len;
+    }
+    return 0;
+}
+
+/* jump to target if cond, which is polled if it's backward */
+static void emit_jump(FILE *fp, int off, int target)
+{
+    if (target > off)
+        fprintf(fp, "goto L%d;\n", target);
+    else
+        fprintf(fp, "{ POLL(%d); goto L%d; }\n", target, target);
+}
+
+static void emit_insn(FILE *fp, uint8 *pc, int off, int len)
+{
+    int16 offset;
+    int next = off + len;
+    fprintf(fp, "L%d:;\n    ", off);
+    switch (pc[0]) {
+        case OP_MOVE:
+            fprintf(fp, "base[%d] = base[%d];\n", pc[1], pc[2]);
+            break;
+        case OP_NIL:
+            fprintf(fp, "base[%d] = 0;\n", pc[1]);
+            break;
+        case OP_I8K:
+            fprintf(fp, "I32(%d) = %d;\n", pc[1], (int8)pc[2]);
+            break;
+        case OP_I32_ADD:
+            fprintf(fp, "I32(%d) = (int32_t)(U32(%d) + U32(%d));\n", pc[1],
+                    pc[2], pc[3]);
+            break;
+        case OP_I32_ADDK:
+            fprintf(fp, "I32(%d) = (int32_t)(U32(%d) + %uu);\n", pc[1], pc[2],
+                    pc[3]);
+            break;
+        case OP_I32_SUBK:
+            fprintf(fp, "I32(%d) = (int32_t)(U32(%d) - %uu);\n", pc[1], pc[2],
+                    pc[3]);
+            break;
+        case OP_I32_CMPK:
+            fprintf(fp, "I32(%d) = I32(%d) > %d ? 1 : (I32(%d) < %d ? -1 : 0);\n",
+                    pc[1], pc[2], pc[3], pc[2], pc[3]);
+            break;
+        case OP_I32_JMP_CMPKGT:
+            memcpy(&offset, pc + 3, 2);
+            fprintf(fp, "if (I32(%d) > %d) ", pc[1], pc[2]);
+            emit_jump(fp, off, next + offset);
+            break;
+        case OP_JGT:
+            memcpy(&offset, pc + 2, 2);
+            fprintf(fp, "if (I32(%d) > 0) ", pc[1]);
+            emit_jump(fp, off, next + offset);
+            break;
+        case OP_RET:
+            fprintf(fp, "return 0;\n");
+            break;
+        case OP_PUSH:
+            fprintf(fp, "*++KS_TOP = base[%d];\n", pc[1]);
+            break;
+        case OP_PUSH_I32_SUBK:
+            fprintf(fp, "*++KS_TOP = (int32_t)(U32(%d) - %uu);\n", pc[1],
+                    pc[2]);
+            break;
+        case OP_SAVE_RET:
+            fprintf(fp, "base[%d] = CI_TOP[1];\n", pc[1]);
+            break;
+        case OP_I32_ADD_RET:
+            fprintf(fp,
+                    "I32(%d) = (int32_t)((uint32_t)*(int32_t *)(CI_TOP + 1) "
+                    "+ U32(%d));\n",
+                    pc[1], pc[2]);
+            break;
+        case OP_CALL:
+            fprintf(fp, "__koala_call(ks, ci, CI_CODE + %d);\n", next);
+            break;
+        default:
+            assert(0);
+            break;
+    }
+}
+
+/* translate kfunc to C, return -1 if it's not supported */
+static int emit_func(FILE *fp, CodeInfo *code, char *name)
+{
+    if (!code->size) return -1;
+
+    char *labels = calloc(1, code->size);
+    if (check_code(code, labels)) {
+        free(labels);
+        return -1;
+    }
+    free(labels);
+
+    fprintf(fp, "const uint32_t %s_hash = %uu;\n\n", name,
+            mem_hash(code->codes, code->size));
+    fprintf(fp, "int %s(void *ks, void *ci)\n{\n", name);
+    fprintf(fp, "    int64_t *base = CI_BASE;\n");
+    uint8 *pc = code->codes;
+    uint8 *end = pc + code->size;
+    int len;
+    while (pc < end) {
+        len = insn_length(pc[0]);
+        emit_insn(fp, pc, pc - code->codes, len);
+        pc += len;
+    }
+    fprintf(fp, "}\n\n");
+    return 0;
+}
+
+/* run C compiler without shell, so the paths are not escaped */
+static int run_cc(char *cc, char *sofile, char *cfile)
+{
+    char *argv[] = {
+        cc, "-O2", "-fPIC", "-shared", "-w", "-o", sofile, cfile, nil,
+    };
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (!pid) {
+        execvp(cc, argv);
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int aot_compile(FuncNode **funcs, int num, char *sofile)
+{
+    char cfile[256];
+    snprintf(cfile, sizeof(cfile), "%s.c", sofile);
+    FILE *fp = fopen(cfile, "w");
+    if (!fp) {
+        printf("aot-error: cannot open '%s'\n", cfile);
+        return -1;
+    }
+
+    emit_prelude(fp);
+
+    char name[128];
+    FuncNode *fn;
+    int count = 0;
+    for (int i = 0; i < num; i++) {
+        fn = funcs[i];
+        if (fn->kind != MNODE_KFUNC_KIND) continue;
+        symbol_name(name, sizeof(name), i, fn->name);
+        if (!emit_func(fp, (CodeInfo *)fn->ptr, name)) ++count;
+    }
+    fclose(fp);
+
+    char *cc = getenv("CC");
+    if (!cc) cc = "cc";
+    int status = run_cc(cc, sofile, cfile);
+    unlink(cfile);
+    if (status) {
+        printf("aot-error: '%s' failed to compile '%s'\n", cc, cfile);
+        return -1;
+    }
+    return count;
+}
+
+int aot_load(FuncNode **funcs, int num, char *sofile)
+{
+    /* the native code is used until exit, it's never closed */
+    void *handle = dlopen(sofile, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        printf("aot-error: %s\n", dlerror());
+        return -1;
+    }
+
+    uint32 *version = dlsym(handle, "__koala_aot_version");
+    void (**call)(KoalaState *, CallInfo *, uint8 *);
+    call = dlsym(handle, "__koala_call");
+    void (**poll)(KoalaState *, CallInfo *, uint8 *);
+    poll = dlsym(handle, "__koala_poll");
+    int **stopping = dlsym(handle, "__koala_gc_stopping");
+    if (!version || !call || !poll || !stopping) {
+        printf("aot-error: '%s' is not koala aot image\n", sofile);
+        dlclose(handle);
+        return -1;
+    }
+    if (*version != AOT_VERSION) {
+        printf("aot-error: '%s' is version %u, but %d is expected\n", sofile,
+               *version, AOT_VERSION);
+        dlclose(handle);
+        return -1;
+    }
+    *call = koala_call;
+    *poll = koala_poll;
+    *stopping = &gc_stopping;
+
+    char name[128];
+    char hname[160];
+    FuncNode *fn;
+    CodeInfo *code;
+    uint32 *hash;
+    void *sym;
+    for (int i = 0; i < num; i++) {
+        fn = funcs[i];
+        if (fn->kind != MNODE_KFUNC_KIND) continue;
+        code = (CodeInfo *)fn->ptr;
+        symbol_name(name, sizeof(name), i, fn->name);
+        /* the byte codes are changed after it's compiled */
+        snprintf(hname, sizeof(hname), "%s_hash", name);
+        hash = dlsym(handle, hname);
+        if (!hash || *hash != mem_hash(code->codes, code->size)) continue;
+        sym = dlsym(handle, name);
+        if (!sym) continue;
+        code->jitcode = sym;
+        code->tier = JIT_TIER_AOT;
+    }
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,47 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#ifndef _KOALA_AOT_H_
+#define _KOALA_AOT_H_
+
+#include "vm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Ahead-of-time compilation.
+ *
+ * The kfuncs of an image are translated to C, one native function per kfunc,
+ * which is the same as JitFunc, and compiled to a shared object by system C
+ * compiler($CC or cc). The symbol of kfunc is `__koala_aot_<index>_<name>`,
+ * so the functions must be in the same order when compiled and loaded.
+ *
+ * A kfunc, which has any instruction not supported, is not compiled and it's
+ * interpreted(and jit) as usual.
+ *
+ * The shared object records AOT_VERSION and the hash of byte codes of each
+ * kfunc, so a stale one is not loaded, or its changed kfuncs are not bound.
+ * The backward jumps poll gc and coroutine like the baseline jit.
+ */
+
+/* version of shared object, it's changed with the opcodes or the layout */
+#define AOT_VERSION 2
+
+/* compile kfuncs to shared object, return number of compiled, -1 if error */
+int aot_compile(FuncNode **funcs, int num, char *sofile);
+
+/* load shared object and bind native code to kfuncs, -1 if error */
+int aot_load(FuncNode **funcs, int num, char *sofile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _KOALA_AOT_H_ */
@@ -0,0 +1,460 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#include "coroutine.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "gc/gc.h"
+#include "stackmap.h"
+#include "util/list.h"
+#include "util/mm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* native stack, the lowest page is guard */
+#define CO_STACK_SIZE (1 << 20)
+/* slots of value stack */
+#define CO_VALUE_STACK_SIZE 1024
+
+typedef enum _CoState {
+    CO_READY = 1,
+    CO_RUNNING = 2,
+    /* waiting for fd */
+    CO_BLOCKED = 3,
+    /* waiting for other coroutine */
+    CO_JOINING = 4,
+    /* returned, but it's not switched out from its stack */
+    CO_EXITING = 5,
+    CO_DONE = 6,
+} CoState;
+
+/* worker thread, which runs the coroutines of the ready list */
+typedef struct _Worker {
+    Coroutine *running;
+    /* why the running coroutine is switched out, it's queued by worker */
+    CoState state;
+    /* context of the thread, which runs coroutines */
+    ucontext_t ctx;
+} Worker;
+
+struct _Coroutine {
+    /* linked in ready list, wait list or joiners of other coroutine */
+    List link;
+    CoState state;
+    /* the coroutine to join, when it's CO_JOINING */
+    Coroutine *join;
+    /* coroutines which are blocked by koala_join */
+    List joiners;
+    /* koala_join calls, which are not returned */
+    int joins;
+    /* fd and events of koala_wait_fd */
+    int fd;
+    short events;
+    short revents;
+    void *stack;
+    ucontext_t uctx;
+    /* gc roots of coroutine, or of worker when it's running */
+    void *gcroots;
+    KoalaState ks;
+};
+
+/* the scheduler is shared by all workers, and it's protected by co_lock */
+static pthread_mutex_t co_lock = PTHREAD_MUTEX_INITIALIZER;
+/* a coroutine is ready, or the wait list is not polled */
+static pthread_cond_t co_cond = PTHREAD_COND_INITIALIZER;
+/* a coroutine is done, or all of them are not runnable */
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static List ready_list = LIST_INIT(ready_list);
+static List wait_list = LIST_INIT(wait_list);
+static int num_waits;
+/* coroutines which are running on workers */
+static int nrunning;
+/* one of workers is polling the wait list */
+static int polling;
+/* the poller is woken up by it, when it should poll again */
+static int wake_fds[2];
+static pthread_once_t workers_once = PTHREAD_ONCE_INIT;
+
+static __thread Worker *worker;
+
+/*
+ * A coroutine may be resumed on other worker, so the worker is read again
+ * after it's switched, not the cached address of the tls of old thread.
+ */
+static __attribute__((noinline)) Worker *get_worker(void)
+{
+    return worker;
+}
+
+static inline void wake_poller(void)
+{
+    char c = 0;
+    if (write(wake_fds[1], &c, 1) < 0) {
+        /* the pipe is full, the poller is already woken */
+    }
+}
+
+/* co_lock is held */
+static inline void co_ready(Coroutine *co)
+{
+    co->state = CO_READY;
+    list_push_back(&ready_list, &co->link);
+    pthread_cond_signal(&co_cond);
+    if (polling) wake_poller();
+}
+
+/* entry of coroutine, it returns to the worker which runs it at last */
+static void co_main(void)
+{
+    Coroutine *co = get_worker()->running;
+    KoalaState *ks = &co->ks;
+    koala_execute(ks, ks->ci);
+    Worker *w = get_worker();
+    w->state = CO_EXITING;
+    setcontext(&w->ctx);
+}
+
+/* switch from co to its worker, co is queued by state after it's switched */
+static inline void co_suspend(Coroutine *co, CoState state)
+{
+    Worker *w = get_worker();
+    w->state = state;
+    swapcontext(&co->uctx, &w->ctx);
+}
+
+/* the gc roots of thread are switched with coroutine */
+static inline void swap_roots(Coroutine *co)
+{
+    void *roots = gcroots;
+    gcroots = co->gcroots;
+    co->gcroots = roots;
+}
+
+static inline void co_run(Worker *w, Coroutine *co)
+{
+    w->running = co;
+    swap_roots(co);
+    swapcontext(&w->ctx, &co->uctx);
+    swap_roots(co);
+    w->running = nil;
+}
+
+/* queue co, which is switched out by state, co_lock is held */
+static void co_switched(Coroutine *co, CoState state)
+{
+    --nrunning;
+    switch (state) {
+    case CO_READY:
+        co_ready(co);
+        break;
+    case CO_BLOCKED:
+        co->state = CO_BLOCKED;
+        list_push_back(&wait_list, &co->link);
+        ++num_waits;
+        if (polling)
+            wake_poller();
+        else
+            pthread_cond_signal(&co_cond);
+        break;
+    case CO_JOINING:
+        if (co->join->state == CO_DONE) {
+            co_ready(co);
+        } else {
+            co->state = CO_JOINING;
+            list_push_back(&co->join->joiners, &co->link);
+        }
+        break;
+    default: {
+        co->state = CO_DONE;
+        List *link;
+        while ((link = list_pop_front(&co->joiners)))
+            co_ready(list_entry(link, Coroutine, link));
+        pthread_cond_broadcast(&done_cond);
+        break;
+    }
+    }
+
+    /* the threads in koala_join check deadlock */
+    if (!nrunning && list_empty(&ready_list))
+        pthread_cond_broadcast(&done_cond);
+}
+
+static void co_free(Coroutine *co)
+{
+    KoalaState *ks = &co->ks;
+    CallInfo *ci = ks->base_ci.next;
+    CallInfo *next;
+    while (ci) {
+        next = ci->next;
+        mm_free(ci);
+        ci = next;
+    }
+    mm_free(ks->stack);
+    gc_remove_roots(&co->gcroots);
+    koala_gc_unregister(ks);
+    munmap(co->stack, CO_STACK_SIZE);
+    mm_free(co);
+}
+
+/*
+ * Wake up coroutines whose fds are ready, timeout -1 is infinite. co_lock is
+ * held, and it's released during poll. Only the poller removes coroutines
+ * from the wait list, so they are still there after poll.
+ */
+static void poll_waits(int timeout)
+{
+    int n = num_waits;
+    struct pollfd fds[n + 1];
+    Coroutine *waits[n];
+    Coroutine *co;
+    int i = 0;
+    list_foreach(co, link, &wait_list, {
+        waits[i] = co;
+        fds[i].fd = co->fd;
+        fds[i].events = co->events;
+        fds[i].revents = 0;
+        ++i;
+    });
+    fds[n].fd = wake_fds[0];
+    fds[n].events = POLLIN;
+    fds[n].revents = 0;
+    polling = 1;
+    pthread_mutex_unlock(&co_lock);
+
+    /* the stacks of blocked coroutines are not changed during poll */
+    gc_enter_safe();
+    int ret = poll(fds, n + 1, timeout);
+    gc_leave_safe();
+    if (ret < 0 && errno != EINTR) {
+        printf("panic: poll failed, errno %d\n", errno);
+        abort();
+    }
+    if (ret > 0 && fds[n].revents) {
+        char buf[64];
+        while (read(wake_fds[0], buf, sizeof(buf)) > 0)
+            ;
+    }
+
+    pthread_mutex_lock(&co_lock);
+    polling = 0;
+    for (i = 0; ret > 0 && i < n; i++) {
+        if (fds[i].revents) {
+            co = waits[i];
+            co->revents = fds[i].revents;
+            list_remove(&co->link);
+            --num_waits;
+            co_ready(co);
+        }
+    }
+    /* other idle worker polls, if this one runs coroutine */
+    if (num_waits) pthread_cond_signal(&co_cond);
+}
+
+/*
+ * Run ready coroutines, or wait for fds if there is none. One of workers
+ * polls the wait list, and others sleep until a coroutine is ready. co_lock
+ * is not held across gc_leave_safe, or the gc waits for the workers which
+ * are blocked by co_lock.
+ */
+static void *worker_main(void *arg)
+{
+    Worker w = { nil };
+    worker = &w;
+    gc_attach();
+
+    pthread_mutex_lock(&co_lock);
+    for (;;) {
+        if (num_waits && !polling)
+            poll_waits(list_empty(&ready_list) ? -1 : 0);
+
+        List *link = list_pop_front(&ready_list);
+        if (link) {
+            Coroutine *co = list_entry(link, Coroutine, link);
+            co->state = CO_RUNNING;
+            ++nrunning;
+            pthread_mutex_unlock(&co_lock);
+            co_run(&w, co);
+            pthread_mutex_lock(&co_lock);
+            co_switched(co, w.state);
+            continue;
+        }
+
+        if (num_waits && !polling) continue;
+
+        gc_enter_safe();
+        pthread_cond_wait(&co_cond, &co_lock);
+        pthread_mutex_unlock(&co_lock);
+        gc_leave_safe();
+        pthread_mutex_lock(&co_lock);
+    }
+    return nil;
+}
+
+/* KOALA_CO_WORKERS, default is the number of cpus */
+static int num_workers(void)
+{
+    char *env = getenv("KOALA_CO_WORKERS");
+    int num = env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num < 1) num = 1;
+    return MIN(num, CO_MAX_WORKERS);
+}
+
+static void start_workers(void)
+{
+    if (pipe(wake_fds)) {
+        printf("panic: cannot create pipe of poller\n");
+        abort();
+    }
+    fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int num = num_workers();
+    pthread_t tid;
+    for (int i = 0; i < num; i++) {
+        if (pthread_create(&tid, &attr, worker_main, nil)) {
+            printf("panic: cannot create worker of coroutines\n");
+            abort();
+        }
+    }
+    pthread_attr_destroy(&attr);
+}
+
+Coroutine *koala_spawn(CodeInfo *code, StkVal *args, int argc)
+{
+    if (!code->stackmap) {
+        printf("error: code of coroutine is not verified\n");
+        return nil;
+    }
+
+    Coroutine *co = mm_alloc_obj(co);
+    co->stack = mmap(nil, CO_STACK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                     -1, 0);
+    if (co->stack == MAP_FAILED) {
+        printf("error: cannot allocate stack of coroutine\n");
+        mm_free(co);
+        return nil;
+    }
+    mprotect(co->stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+    init_list(&co->joiners);
+
+    KoalaState *ks = &co->ks;
+    ks->stack = mm_alloc(CO_VALUE_STACK_SIZE * sizeof(StkVal));
+    ks->stack_end = ks->stack + CO_VALUE_STACK_SIZE;
+    ks->ci = &ks->base_ci;
+    ks->nci = 1;
+    ks->co = co;
+    ks->budget = CO_TIME_SLICE;
+
+    CallInfo *ci = ks->ci;
+    ci->codeinfo = code;
+    ci->code = code->codes;
+    ci->savedpc = ci->code;
+    ci->icache = code->icache;
+    ci->relinfo = code->relinfo;
+    ci->base = ks->stack;
+    ci->top = ci->base + code->stacksize - 1;
+    ks->top = ci->top;
+    memcpy(ci->base, args, argc * sizeof(StkVal));
+
+    getcontext(&co->uctx);
+    /* it may exit on any worker, so co_main switches to it by itself */
+    co->uctx.uc_link = nil;
+    co->uctx.uc_stack.ss_sp = co->stack;
+    co->uctx.uc_stack.ss_size = CO_STACK_SIZE;
+    co->uctx.uc_stack.ss_flags = 0;
+    makecontext(&co->uctx, co_main, 0);
+    gc_add_roots(&co->gcroots);
+    koala_gc_register(ks);
+
+    pthread_once(&workers_once, start_workers);
+    pthread_mutex_lock(&co_lock);
+    co_ready(co);
+    pthread_mutex_unlock(&co_lock);
+    return co;
+}
+
+StkVal koala_join(Coroutine *co)
+{
+    pthread_mutex_lock(&co_lock);
+    ++co->joins;
+    Coroutine *self = koala_current();
+    if (self) {
+        if (co->state != CO_DONE) {
+            self->join = co;
+            pthread_mutex_unlock(&co_lock);
+            co_suspend(self, CO_JOINING);
+            pthread_mutex_lock(&co_lock);
+        }
+    } else {
+        /* the thread is in safe region, until the coroutine is done */
+        gc_enter_safe();
+        while (co->state != CO_DONE) {
+            if (list_empty(&ready_list) && !num_waits && !nrunning) {
+                printf("panic: coroutines are deadlocked\n");
+                abort();
+            }
+            pthread_cond_wait(&done_cond, &co_lock);
+        }
+        pthread_mutex_unlock(&co_lock);
+        gc_leave_safe();
+        pthread_mutex_lock(&co_lock);
+    }
+
+    /* the result is R(0), it's freed by the last joiner */
+    StkVal val = co->ks.stack[0];
+    int last = !--co->joins;
+    pthread_mutex_unlock(&co_lock);
+    if (last) co_free(co);
+    return val;
+}
+
+void koala_yield(void)
+{
+    Coroutine *co = koala_current();
+    if (co) co_suspend(co, CO_READY);
+}
+
+int koala_wait_fd(int fd, int events)
+{
+    Coroutine *co = koala_current();
+    if (!co) {
+        struct pollfd pfd = { fd, events, 0 };
+        gc_enter_safe();
+        int n = poll(&pfd, 1, -1);
+        gc_leave_safe();
+        if (n < 0) return -1;
+        return (pfd.revents & (POLLERR | POLLNVAL)) ? -1 : 0;
+    }
+
+    co->fd = fd;
+    co->events = events;
+    co->revents = 0;
+    co_suspend(co, CO_BLOCKED);
+    return (co->revents & (POLLERR | POLLNVAL)) ? -1 : 0;
+}
+
+Coroutine *koala_current(void)
+{
+    Worker *w = get_worker();
+    return w ? w->running : nil;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,75 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#ifndef _KOALA_COROUTINE_H_
+#define _KOALA_COROUTINE_H_
+
+#include "vm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Green threads of koala functions.
+ *
+ * Each coroutine has its own KoalaState and native stack, and is switched by
+ * ucontext, so a coroutine can be suspended in any depth of koala_execute or
+ * jit code. It's cooperative, koala_execute yields at calls and backward
+ * jumps after CO_TIME_SLICE of them, and koala_wait_fd yields until the fd
+ * is ready, which is the blocking point of I/O in c functions.
+ *
+ * Coroutines are run by a pool of worker threads(M:N scheduling), which are
+ * started at the first koala_spawn. A coroutine is resumed by any idle
+ * worker, so it may be moved to other thread at yields, and it can be joined
+ * by any thread or coroutine. The number of workers is KOALA_CO_WORKERS,
+ * default is the number of cpus.
+ */
+
+/* yield points between two yields */
+#define CO_TIME_SLICE 1000
+
+/* max number of workers of coroutines */
+#define CO_MAX_WORKERS 64
+
+/*
+ * Spawn a coroutine to run code with arguments. Its stack is scanned by gc,
+ * so the code must be verified, see vm/stackmap.h.
+ */
+Coroutine *koala_spawn(CodeInfo *code, StkVal *args, int argc);
+
+/*
+ * wait for coroutine done and return its result, it can be joined by more
+ * than one coroutines, and it's freed when all of them are returned, so all
+ * of them must be started before it's done
+ */
+StkVal koala_join(Coroutine *co);
+
+/* yield cpu to other coroutines, it's nothing outside coroutine */
+void koala_yield(void);
+
+/* block until fd is ready for events(POLLIN/POLLOUT), 0: ok, -1: failed */
+int koala_wait_fd(int fd, int events);
+
+/* the running coroutine, nil if it's not in coroutine */
+Coroutine *koala_current(void);
+
+/* yield point of interpreter, calls and backward jumps */
+#define CO_YIELD_POINT(ks)                         \
+    do {                                           \
+        if ((ks)->co && --(ks)->budget <= 0) {     \
+            (ks)->budget = CO_TIME_SLICE;          \
+            koala_yield();                         \
+        }                                          \
+    } while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _KOALA_COROUTINE_H_ */
@@ -0,0 +1,214 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#include "ffi.h"
+#include "util/hash.h"
+#include "util/mm.h"
+
+#if defined(KOALA_FFI)
+#include <ffi.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* max arguments of c function */
+#define FFI_MAX_ARGS 16
+
+/* clang-format off */
+
+static uintptr direct_0(FuncNode *fn, StkVal *args)
+{
+    return ((uintptr(*)(void))fn->ptr)();
+}
+
+static uintptr direct_1(FuncNode *fn, StkVal *args)
+{
+    return ((uintptr(*)(uintptr))fn->ptr)(args[0]);
+}
+
+static uintptr direct_2(FuncNode *fn, StkVal *args)
+{
+    return ((uintptr(*)(uintptr, uintptr))fn->ptr)(args[0], args[1]);
+}
+
+static uintptr direct_3(FuncNode *fn, StkVal *args)
+{
+    return ((uintptr(*)(uintptr, uintptr, uintptr))fn->ptr)(
+        args[0], args[1], args[2]);
+}
+
+static uintptr direct_4(FuncNode *fn, StkVal *args)
+{
+    return ((uintptr(*)(uintptr, uintptr, uintptr, uintptr))fn->ptr)(
+        args[0], args[1], args[2], args[3]);
+}
+
+/* clang-format on */
+
+static CFuncStub direct_stubs[] = {
+    direct_0, direct_1, direct_2, direct_3, direct_4,
+};
+
+/*
+ * The argument is in a 64-bit register, and i8, i16 and bool are i32 in
+ * stack already. The return value of i8, i16 and bool is only defined in the
+ * low byte(s), so it's extended by libffi.
+ */
+static int is_direct_arg(int kind)
+{
+    return kind != DESC_F32_KIND && kind != DESC_F64_KIND;
+}
+
+static int is_direct_ret(int kind)
+{
+    return is_direct_arg(kind) && kind != DESC_I8_KIND &&
+           kind != DESC_I16_KIND && kind != DESC_BOOL_KIND;
+}
+
+/*
+ * Signature of function, one char per kind, e.g. "cc:c" is (i32, i32) i32.
+ * 0 is uintptr, if there is no TypeDesc. Return -1 if it's not supported.
+ */
+static int signature(FuncNode *fn, int argc, char *sig)
+{
+    TypeProto *proto = (TypeProto *)fn->desc;
+    if (argc > FFI_MAX_ARGS) return -1;
+
+    if (!proto) {
+        memset(sig, '0', argc);
+        strcpy(sig + argc, ":0");
+        return 0;
+    }
+
+    if (proto->kind != DESC_PROTO_KIND || vector_size(proto->params) != argc)
+        return -1;
+
+    TypeDesc *desc;
+    for (int i = 0; i < argc; i++) {
+        vector_get(proto->params, i, &desc);
+        sig[i] = 'a' + desc->kind;
+    }
+    sig[argc] = ':';
+    sig[argc + 1] = proto->ret ? 'a' + proto->ret->kind : 'a';
+    sig[argc + 2] = '\0';
+    return 0;
+}
+
+static inline int sig_kind(char c)
+{
+    return c == '0' ? 0 : c - 'a';
+}
+
+#if defined(KOALA_FFI)
+
+/* prepared call interface of one signature */
+typedef struct _CifEntry {
+    HashMapEntry entry;
+    char sig[FFI_MAX_ARGS + 3];
+    ffi_cif cif;
+    ffi_type *types[FFI_MAX_ARGS];
+} CifEntry;
+
+static HashMap cifs;
+static int cifs_inited;
+
+static int cif_equal(void *e1, void *e2)
+{
+    return !strcmp(((CifEntry *)e1)->sig, ((CifEntry *)e2)->sig);
+}
+
+static ffi_type *ffi_type_of(int kind)
+{
+    switch (kind) {
+        case 0:
+            return &ffi_type_uint64;
+        case DESC_I8_KIND:
+            return &ffi_type_sint8;
+        case DESC_I16_KIND:
+            return &ffi_type_sint16;
+        case DESC_I32_KIND:
+        case DESC_CHAR_KIND:
+            return &ffi_type_sint32;
+        case DESC_I64_KIND:
+            return &ffi_type_sint64;
+        case DESC_F32_KIND:
+            return &ffi_type_float;
+        case DESC_F64_KIND:
+            return &ffi_type_double;
+        case DESC_BOOL_KIND:
+            return &ffi_type_uint8;
+        default:
+            return &ffi_type_pointer;
+    }
+}
+
+static ffi_cif *get_cif(char *sig, int argc)
+{
+    if (!cifs_inited) {
+        hashmap_init(&cifs, cif_equal);
+        cifs_inited = 1;
+    }
+
+    CifEntry key;
+    strcpy(key.sig, sig);
+    hashmap_entry_init(&key, str_hash(sig));
+    CifEntry *e = hashmap_get(&cifs, &key);
+    if (e) return &e->cif;
+
+    e = mm_alloc_obj(e);
+    strcpy(e->sig, sig);
+    for (int i = 0; i < argc; i++) e->types[i] = ffi_type_of(sig_kind(sig[i]));
+    /* 'a' is no return value */
+    char ret = sig[argc + 1];
+    ffi_type *rtype = ret == 'a' ? &ffi_type_void : ffi_type_of(sig_kind(ret));
+    if (ffi_prep_cif(&e->cif, FFI_DEFAULT_ABI, argc, rtype, e->types) !=
+        FFI_OK) {
+        mm_free(e);
+        return nil;
+    }
+    hashmap_entry_init(e, str_hash(sig));
+    hashmap_put_absent(&cifs, e);
+    return &e->cif;
+}
+
+static uintptr ffi_stub_call(FuncNode *fn, StkVal *args)
+{
+    ffi_cif *cif = fn->cif;
+    void *values[FFI_MAX_ARGS];
+    for (int i = 0; i < cif->nargs; i++) values[i] = args + i;
+    /* narrow integers are extended to ffi_arg */
+    uint64 ret = 0;
+    ffi_call(cif, FFI_FN(fn->ptr), &ret, values);
+    return ret;
+}
+
+#endif
+
+CFuncStub ffi_stub(FuncNode *fn, int argc)
+{
+    char sig[FFI_MAX_ARGS + 3];
+    if (signature(fn, argc, sig)) return nil;
+
+    int direct = argc <= FFI_MAX_DIRECT_ARGS;
+    for (int i = 0; direct && i < argc; i++)
+        direct = is_direct_arg(sig_kind(sig[i]));
+    if (direct && is_direct_ret(sig_kind(sig[argc + 1])))
+        return direct_stubs[argc];
+
+#if defined(KOALA_FFI)
+    fn->cif = get_cif(sig, argc);
+    if (fn->cif) return ffi_stub_call;
+#endif
+    return nil;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,62 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#ifndef _KOALA_FFI_H_
+#define _KOALA_FFI_H_
+
+#include "vm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Calls of c functions.
+ *
+ * The stub of c function is chosen at its first call, and saved in FuncNode.
+ * If the arguments and return value are integers or pointers, and there are
+ * at most FFI_MAX_DIRECT_ARGS arguments, the stub calls the function pointer
+ * directly. Otherwise, it's called by libffi, and the prepared ffi_cif is
+ * cached per signature, so it's shared by the functions with the same
+ * signature. A function without TypeDesc takes and returns uintptr values.
+ * The stub is for the number of arguments of the first call, so the later
+ * calls must pass the same number.
+ */
+
+/* max arguments of direct call */
+#define FFI_MAX_DIRECT_ARGS 4
+
+/* call c function with arguments in stack, return raw value */
+typedef uintptr (*CFuncStub)(FuncNode *fn, StkVal *args);
+
+/* stub of c function called with argc arguments, nil if not supported */
+CFuncStub ffi_stub(FuncNode *fn, int argc);
+
+/* call c function, the stub is resolved at the first call */
+static inline uintptr ffi_call_cfunc(FuncNode *fn, StkVal *args, int argc)
+{
+    if (!fn->stub) {
+        fn->stub = ffi_stub(fn, argc);
+        if (!fn->stub) {
+            printf("panic: unsupported signature of '%s'\n", fn->name);
+            abort();
+        }
+        fn->argc = argc;
+    } else if (fn->argc != argc) {
+        printf("panic: '%s' is called with %d arguments, but %d before\n",
+               fn->name, argc, fn->argc);
+        abort();
+    }
+    return ((CFuncStub)fn->stub)(fn, args);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _KOALA_FFI_H_ */
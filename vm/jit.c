@@ -0,0 +1,576 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#include "jit.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include "opcode.h"
+#include "perf.h"
+#include "gc/gc.h"
+#include "util/mm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__x86_64__)
+
+/* x86-64 registers */
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R12 12
+#define R13 13
+
+/* max bytes of native code per byte code */
+#define MAX_NATIVE_PER_BYTE 32
+
+/*
+ * native code header, before the code
+ * int: size of mapping
+ * int: number of osr entries
+ * int: offset of osr entries in code
+ */
+#define JIT_HEADER_SIZE 16
+
+/* max bytes of osr entry, prologue and jmp */
+#define MAX_OSR_ENTRY_SIZE 32
+
+/* entry of on-stack replacement at loop header */
+typedef struct _JitOsrEntry {
+    /* offset of loop header byte code */
+    int offset;
+    /* offset of native entry */
+    int entry;
+} JitOsrEntry;
+
+/* jump to be patched */
+typedef struct _JitFixup {
+    /* position of rel32 */
+    int pos;
+    /* offset of target byte code */
+    int target;
+} JitFixup;
+
+typedef struct _Jit {
+    CodeInfo *code;
+    uint8 *buf;
+    int len;
+    int size;
+    /* native offset of each byte code, -1 if not instruction boundary */
+    int *labels;
+    JitFixup *fixups;
+    int num_fixups;
+} Jit;
+
+static inline void emit_byte(Jit *j, int b)
+{
+    assert(j->len < j->size);
+    j->buf[j->len++] = (uint8)b;
+}
+
+static inline void emit_i32(Jit *j, int32 v)
+{
+    assert(j->len + 4 <= j->size);
+    memcpy(j->buf + j->len, &v, 4);
+    j->len += 4;
+}
+
+static inline void emit_i64(Jit *j, int64 v)
+{
+    assert(j->len + 8 <= j->size);
+    memcpy(j->buf + j->len, &v, 8);
+    j->len += 8;
+}
+
+static inline void emit_rex(Jit *j, int w, int reg, int rm)
+{
+    int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40) emit_byte(j, rex);
+}
+
+/* op reg, [base + disp] or op [base + disp], reg */
+static void emit_mem(Jit *j, int w, int op, int reg, int base, int32 disp)
+{
+    emit_rex(j, w, reg, base);
+    emit_byte(j, op);
+    int mod = (disp >= -128 && disp <= 127) ? 1 : 2;
+    emit_byte(j, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) emit_byte(j, 0x24);
+    if (mod == 1)
+        emit_byte(j, disp);
+    else
+        emit_i32(j, disp);
+}
+
+/* op rm, reg */
+static void emit_rr(Jit *j, int w, int op, int reg, int rm)
+{
+    emit_rex(j, w, reg, rm);
+    emit_byte(j, op);
+    emit_byte(j, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* offset of register in stack */
+#define SLOT(r) ((int32)((r) * sizeof(StkVal)))
+
+/* clang-format off */
+
+/* mov eax, R(r) */
+#define LOAD_I32(j, reg, r)     emit_mem(j, 0, 0x8B, reg, RBX, SLOT(r))
+/* mov R(r), eax */
+#define STORE_I32(j, reg, r)    emit_mem(j, 0, 0x89, reg, RBX, SLOT(r))
+/* mov rax, R(r) */
+#define LOAD(j, reg, r)         emit_mem(j, 1, 0x8B, reg, RBX, SLOT(r))
+/* mov R(r), rax */
+#define STORE(j, reg, r)        emit_mem(j, 1, 0x89, reg, RBX, SLOT(r))
+
+/* clang-format on */
+
+static void emit_fixup(Jit *j, int target)
+{
+    JitFixup *fix = j->fixups + j->num_fixups++;
+    fix->pos = j->len;
+    fix->target = target;
+    emit_i32(j, 0);
+}
+
+/* jcc rel32, cc is the second byte of opcode, 0x8F is jg */
+static void emit_jcc(Jit *j, int cc, int target)
+{
+    emit_byte(j, 0x0F);
+    emit_byte(j, cc);
+    emit_fixup(j, target);
+}
+
+/* call fn(ks, ci, pc) */
+static void emit_call(Jit *j, void *fn, uint8 *pc)
+{
+    emit_rr(j, 1, 0x89, R12, RDI);      /* mov rdi, r12 */
+    emit_rr(j, 1, 0x89, R13, RSI);      /* mov rsi, r13 */
+    emit_byte(j, 0x48);                 /* movabs rdx, imm64 */
+    emit_byte(j, 0xBA);
+    emit_i64(j, (int64)pc);
+    emit_byte(j, 0x48);                 /* movabs rax, imm64 */
+    emit_byte(j, 0xB8);
+    emit_i64(j, (int64)fn);
+    emit_byte(j, 0xFF);                 /* call rax */
+    emit_byte(j, 0xD0);
+}
+
+/*
+ * Conditional jump by jg, which is not taken to next. The backward one
+ * polls gc and coroutine like the interpreter, so a hot loop does not
+ * block stop-the-world gc, or the other coroutines.
+ */
+static void emit_jg(Jit *j, int target, int next)
+{
+    if (target >= next) {
+        emit_jcc(j, 0x8F, target);
+        return;
+    }
+
+    emit_jcc(j, 0x8E, next);            /* jle next */
+    emit_byte(j, 0x48);                 /* movabs rax, &gc_stopping */
+    emit_byte(j, 0xB8);
+    emit_i64(j, (int64)&gc_stopping);
+    emit_byte(j, 0x83);                 /* cmp dword [rax], 0 */
+    emit_byte(j, 0x38);
+    emit_byte(j, 0x00);
+    emit_byte(j, 0x75);                 /* jne slow */
+    int slow = j->len;
+    emit_byte(j, 0);
+    /* dec dword ks->budget */
+    emit_mem(j, 0, 0xFF, 1, R12, offsetof(KoalaState, budget));
+    emit_jcc(j, 0x8F, target);          /* jg target */
+    j->buf[slow] = j->len - (slow + 1);
+    emit_call(j, koala_poll, j->code->codes + target);
+    emit_byte(j, 0xE9);                 /* jmp target */
+    emit_fixup(j, target);
+}
+
+static void emit_prologue(Jit *j)
+{
+    emit_byte(j, 0x53);                 /* push rbx */
+    emit_byte(j, 0x41);                 /* push r12 */
+    emit_byte(j, 0x54);
+    emit_byte(j, 0x41);                 /* push r13 */
+    emit_byte(j, 0x55);
+    emit_rr(j, 1, 0x89, RDI, R12);      /* mov r12, rdi */
+    emit_rr(j, 1, 0x89, RSI, R13);      /* mov r13, rsi */
+    emit_mem(j, 1, 0x8B, RBX, R13, offsetof(CallInfo, base));
+}
+
+static void emit_epilogue(Jit *j)
+{
+    emit_rr(j, 0, 0x31, RAX, RAX);      /* xor eax, eax */
+    emit_byte(j, 0x41);                 /* pop r13 */
+    emit_byte(j, 0x5D);
+    emit_byte(j, 0x41);                 /* pop r12 */
+    emit_byte(j, 0x5C);
+    emit_byte(j, 0x5B);                 /* pop rbx */
+    emit_byte(j, 0xC3);                 /* ret */
+}
+
+/* ecx = eax > k ? 1 : (eax < k ? -1 : 0) */
+static void emit_cmp_result(Jit *j)
+{
+    emit_byte(j, 0x0F);                 /* setg cl */
+    emit_byte(j, 0x9F);
+    emit_byte(j, 0xC1);
+    emit_byte(j, 0x0F);                 /* setl dl */
+    emit_byte(j, 0x9C);
+    emit_byte(j, 0xC2);
+    emit_byte(j, 0x0F);                 /* movzx ecx, cl */
+    emit_byte(j, 0xB6);
+    emit_byte(j, 0xC9);
+    emit_byte(j, 0x0F);                 /* movzx edx, dl */
+    emit_byte(j, 0xB6);
+    emit_byte(j, 0xD2);
+    emit_rr(j, 0, 0x29, RDX, RCX);      /* sub ecx, edx */
+}
+
+/* rax = ++ks->top */
+static void emit_inc_top(Jit *j)
+{
+    emit_mem(j, 1, 0x8B, RAX, R12, offsetof(KoalaState, top));
+    emit_byte(j, 0x48);                 /* add rax, 8 */
+    emit_byte(j, 0x83);
+    emit_byte(j, 0xC0);
+    emit_byte(j, sizeof(StkVal));
+    emit_mem(j, 1, 0x89, RAX, R12, offsetof(KoalaState, top));
+}
+
+/* rax = ci->top */
+static void emit_ci_top(Jit *j)
+{
+    emit_mem(j, 1, 0x8B, RAX, R13, offsetof(CallInfo, top));
+}
+
+/* jmp rel32 to native offset */
+static void emit_jmp(Jit *j, int target)
+{
+    emit_byte(j, 0xE9);
+    emit_i32(j, target - (j->len + 4));
+}
+
+/*
+ * Entries of loop headers(targets of backward jumps), which are prologue and
+ * jmp to header, and the table of them is after them.
+ */
+static int emit_osr_entries(Jit *j, int *num)
+{
+    JitOsrEntry *entries = mm_alloc(sizeof(JitOsrEntry) * (j->num_fixups + 1));
+    JitFixup *fix;
+    int n = 0;
+    for (int i = 0; i < j->num_fixups; i++) {
+        fix = j->fixups + i;
+        /* forward jump */
+        if (j->labels[fix->target] > fix->pos) continue;
+        int dup = 0;
+        for (int k = 0; k < n; k++) {
+            if (entries[k].offset == fix->target) dup = 1;
+        }
+        if (dup) continue;
+        entries[n].offset = fix->target;
+        entries[n].entry = j->len;
+        emit_prologue(j);
+        emit_jmp(j, j->labels[fix->target]);
+        ++n;
+    }
+
+    j->len = ALIGN(j->len, 4);
+    int table = j->len;
+    assert(j->len + n * (int)sizeof(JitOsrEntry) <= j->size);
+    memcpy(j->buf + j->len, entries, n * sizeof(JitOsrEntry));
+    j->len += n * sizeof(JitOsrEntry);
+    mm_free(entries);
+    *num = n;
+    return table;
+}
+
+/* translate one instruction, return its length or -1 if not supported */
+static int emit_insn(Jit *j, uint8 *pc)
+{
+    int end = pc - j->code->codes;
+    switch (pc[0]) {
+        case OP_MOVE: {
+            LOAD(j, RAX, pc[2]);
+            STORE(j, RAX, pc[1]);
+            return 3;
+        }
+        case OP_NIL: {
+            /* mov qword R(A), 0 */
+            emit_mem(j, 1, 0xC7, 0, RBX, SLOT(pc[1]));
+            emit_i32(j, 0);
+            return 2;
+        }
+        case OP_I8K: {
+            /* mov dword R(A), K */
+            emit_mem(j, 0, 0xC7, 0, RBX, SLOT(pc[1]));
+            emit_i32(j, (int8)pc[2]);
+            return 3;
+        }
+        case OP_I32_ADD: {
+            LOAD_I32(j, RAX, pc[2]);
+            emit_mem(j, 0, 0x03, RAX, RBX, SLOT(pc[3]));
+            STORE_I32(j, RAX, pc[1]);
+            return 4;
+        }
+        case OP_I32_ADDK:
+        case OP_I32_SUBK: {
+            LOAD_I32(j, RAX, pc[2]);
+            /* add/sub eax, imm32 */
+            emit_byte(j, pc[0] == OP_I32_ADDK ? 0x05 : 0x2D);
+            emit_i32(j, pc[3]);
+            STORE_I32(j, RAX, pc[1]);
+            return 4;
+        }
+        case OP_I32_CMPK: {
+            LOAD_I32(j, RAX, pc[2]);
+            emit_byte(j, 0x3D);         /* cmp eax, imm32 */
+            emit_i32(j, pc[3]);
+            emit_cmp_result(j);
+            STORE_I32(j, RCX, pc[1]);
+            return 4;
+        }
+        case OP_I32_JMP_CMPKGT: {
+            int16 offset;
+            memcpy(&offset, pc + 3, 2);
+            LOAD_I32(j, RAX, pc[1]);
+            emit_byte(j, 0x3D);         /* cmp eax, imm32 */
+            emit_i32(j, pc[2]);
+            emit_jg(j, end + 5 + offset, end + 5);
+            return 5;
+        }
+        case OP_JGT: {
+            int16 offset;
+            memcpy(&offset, pc + 2, 2);
+            LOAD_I32(j, RAX, pc[1]);
+            emit_rr(j, 0, 0x85, RAX, RAX); /* test eax, eax */
+            emit_jg(j, end + 4 + offset, end + 4);
+            return 4;
+        }
+        case OP_RET: {
+            emit_epilogue(j);
+            return 1;
+        }
+        case OP_PUSH: {
+            emit_inc_top(j);
+            LOAD(j, RCX, pc[1]);
+            emit_byte(j, 0x48);         /* mov [rax], rcx */
+            emit_byte(j, 0x89);
+            emit_byte(j, 0x08);
+            return 2;
+        }
+        case OP_PUSH_I32_SUBK: {
+            emit_inc_top(j);
+            LOAD_I32(j, RCX, pc[1]);
+            emit_byte(j, 0x81);         /* sub ecx, imm32 */
+            emit_byte(j, 0xE9);
+            emit_i32(j, pc[2]);
+            emit_rr(j, 1, 0x63, RCX, RCX); /* movsxd rcx, ecx */
+            emit_byte(j, 0x48);            /* mov [rax], rcx */
+            emit_byte(j, 0x89);
+            emit_byte(j, 0x08);
+            return 3;
+        }
+        case OP_SAVE_RET: {
+            emit_ci_top(j);
+            emit_mem(j, 1, 0x8B, RAX, RAX, sizeof(StkVal));
+            STORE(j, RAX, pc[1]);
+            return 2;
+        }
+        case OP_I32_ADD_RET: {
+            emit_ci_top(j);
+            emit_mem(j, 0, 0x8B, RAX, RAX, sizeof(StkVal));
+            emit_mem(j, 0, 0x03, RAX, RBX, SLOT(pc[2]));
+            STORE_I32(j, RAX, pc[1]);
+            return 3;
+        }
+        case OP_CALL: {
+            emit_call(j, koala_call, pc + 4);
+            return 4;
+        }
+        default:
+            return -1;
+    }
+}
+
+/* the tier may be claimed by the caller already */
+static void claim_tier(CodeInfo *code)
+{
+    uint32 none = JIT_TIER_NONE;
+    __atomic_compare_exchange_n(&code->tier, &none, JIT_TIER_BASELINE, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+int jit_compile(CodeInfo *code)
+{
+    /* backward jump has 3 fixups, and is 4 bytes at least */
+    int num_fixups = code->size + 1;
+    int size = code->size * MAX_NATIVE_PER_BYTE + 64 +
+               num_fixups * (MAX_OSR_ENTRY_SIZE + sizeof(JitOsrEntry));
+    int mapsize = ALIGN(size + JIT_HEADER_SIZE, (int)sysconf(_SC_PAGESIZE));
+    uint8 *mem = mmap(nil, mapsize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    claim_tier(code);
+    if (mem == MAP_FAILED) return -1;
+    *(int *)mem = mapsize;
+
+    Jit j = {
+        .code = code,
+        .buf = mem + JIT_HEADER_SIZE,
+        .size = size,
+        .labels = mm_alloc(sizeof(int) * code->size),
+        .fixups = mm_alloc(sizeof(JitFixup) * num_fixups),
+    };
+
+    int ok = 1;
+    for (int i = 0; i < code->size; i++) j.labels[i] = -1;
+
+    emit_prologue(&j);
+
+    uint8 *pc = code->codes;
+    uint8 *end = pc + code->size;
+    int len;
+    while (pc < end) {
+        j.labels[pc - code->codes] = j.len;
+        len = emit_insn(&j, pc);
+        if (len < 0) {
+            ok = 0;
+            break;
+        }
+        pc += len;
+    }
+
+    /* patch jumps */
+    JitFixup *fix;
+    int32 rel;
+    for (int i = 0; ok && i < j.num_fixups; i++) {
+        fix = j.fixups + i;
+        if (fix->target < 0 || fix->target >= code->size ||
+            j.labels[fix->target] < 0) {
+            ok = 0;
+            break;
+        }
+        rel = j.labels[fix->target] - (fix->pos + 4);
+        memcpy(j.buf + fix->pos, &rel, 4);
+    }
+
+    if (ok) {
+        int num;
+        int table = emit_osr_entries(&j, &num);
+        ((int *)mem)[1] = num;
+        ((int *)mem)[2] = table;
+    }
+
+    mm_free(j.labels);
+    mm_free(j.fixups);
+
+    if (!ok || mprotect(mem, mapsize, PROT_READ | PROT_EXEC)) {
+        munmap(mem, mapsize);
+        return -1;
+    }
+
+    __atomic_store_n(&code->basecode, j.buf, __ATOMIC_RELEASE);
+    /* it may be optimized by another thread already */
+    void *none = nil;
+    __atomic_compare_exchange_n(&code->jitcode, &none, j.buf, 0,
+                                __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    perf_code_load(j.buf, j.len, code->name, "baseline");
+    return 0;
+}
+
+JitFunc jit_osr_entry(CodeInfo *code, uint8 *pc)
+{
+    uint8 *base = __atomic_load_n(&code->basecode, __ATOMIC_ACQUIRE);
+    if (!base) return nil;
+    uint8 *mem = base - JIT_HEADER_SIZE;
+    int num = ((int *)mem)[1];
+    JitOsrEntry *entries = (JitOsrEntry *)(mem + JIT_HEADER_SIZE +
+                                           ((int *)mem)[2]);
+    int offset = pc - code->codes;
+    for (int i = 0; i < num; i++) {
+        if (entries[i].offset == offset)
+            return (JitFunc)(base + entries[i].entry);
+    }
+    return nil;
+}
+
+void jit_free(CodeInfo *code)
+{
+    /* optimized code is owned by LLVM, aot code by shared object */
+    void *opt = code->optcode;
+    code->jitcode = nil;
+    code->optcode = nil;
+    jit_opt_release(opt);
+
+    if (!code->basecode) return;
+    uint8 *mem = (uint8 *)code->basecode - JIT_HEADER_SIZE;
+    munmap(mem, *(int *)mem);
+    code->basecode = nil;
+}
+
+#else
+
+int jit_compile(CodeInfo *code)
+{
+    uint32 none = JIT_TIER_NONE;
+    __atomic_compare_exchange_n(&code->tier, &none, JIT_TIER_BASELINE, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    return -1;
+}
+
+JitFunc jit_osr_entry(CodeInfo *code, uint8 *pc)
+{
+    return nil;
+}
+
+void jit_free(CodeInfo *code)
+{
+    void *opt = code->optcode;
+    code->jitcode = nil;
+    code->optcode = nil;
+    jit_opt_release(opt);
+}
+
+#endif
+
+#if !defined(KOALA_LLVM)
+
+int jit_opt_compile(CodeInfo *code)
+{
+    __atomic_store_n(&code->tier, JIT_TIER_FAILED, __ATOMIC_RELEASE);
+    return -1;
+}
+
+JitFunc jit_opt_hold(CodeInfo *code, void **opt)
+{
+    *opt = nil;
+    return __atomic_load_n(&code->jitcode, __ATOMIC_ACQUIRE);
+}
+
+void jit_opt_release(void *opt)
+{
+}
+
+void jit_opt_discard(CodeInfo *code, void *opt)
+{
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
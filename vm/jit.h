@@ -0,0 +1,115 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#ifndef _KOALA_JIT_H_
+#define _KOALA_JIT_H_
+
+#include "vm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Baseline jit, only x86-64 is supported.
+ *
+ * Each instruction is translated by its machine code template, and the
+ * registers are still in the stack of CallInfo, so the interpreter and the
+ * native code can be switched at any instruction boundary.
+ *
+ * rbx: ci->base
+ * r12: ks
+ * r13: ci
+ *
+ * A backward jump polls gc_stopping and decrements ks->budget inline, and
+ * calls koala_poll() if gc is stopping or the budget is used up.
+ *
+ * The hot function is compiled by optimizing jit(vm/jit_llvm.c) again,
+ * if LLVM is enabled.
+ */
+
+/* number of calls before a function is compiled by baseline jit */
+#define JIT_THRESHOLD 100
+
+/* number of calls before a function is compiled by optimizing jit */
+#define JIT_OPT_THRESHOLD 10000
+
+/* number of backward jumps before the running loop is replaced by jit code */
+#define JIT_OSR_THRESHOLD 1000
+
+/*
+ * jit tiers, a function is compiled by the thread which claims its next tier
+ * by CAS, and the others run its current code meanwhile.
+ */
+#define JIT_TIER_NONE     0
+#define JIT_TIER_BASELINE 1
+#define JIT_TIER_OPT      2
+#define JIT_TIER_AOT      3
+/* optimizing jit failed, it keeps the baseline code or is interpreted */
+#define JIT_TIER_FAILED   4
+
+/*
+ * Native code, the same as koala_execute() except OP_RET.
+ * It returns 0 if the function is returned, or 1 if it's deoptimized and
+ * must be resumed by interpreter at ci->savedpc.
+ */
+typedef int (*JitFunc)(KoalaState *ks, CallInfo *ci);
+
+/*
+ * Compile function to native code by templates, 0: ok, -1: failed.
+ * The tier is baseline even if it's failed, so it's not compiled again, and
+ * it's interpreted until it's hot enough for optimizing jit, which supports
+ * quickened instructions too.
+ */
+int jit_compile(CodeInfo *code);
+
+/*
+ * Compile function to optimized native code by LLVM, 0: ok, -1: failed.
+ * The registers are promoted to SSA values and optimized by O2. Guards of
+ * quickened instructions and division by zero are deoptimized.
+ * The tier is failed if it's failed, and it's not compiled again.
+ */
+int jit_opt_compile(CodeInfo *code);
+
+/*
+ * Native entry of baseline code at loop header pc, nil if there is none.
+ * The registers are in the stack of CallInfo, so the interpreted frame is
+ * continued by native code as it is(on-stack replacement). The optimized
+ * code has no entries, because its registers are SSA values.
+ */
+JitFunc jit_osr_entry(CodeInfo *code, uint8 *pc);
+
+/*
+ * Free native code of function, including the baseline code kept after it's
+ * optimized. The optimized code is removed from LLVM after its running
+ * frames are returned, see jit_opt_hold().
+ */
+void jit_free(CodeInfo *code);
+
+/*
+ * Native code to run a frame of function, nil if it's interpreted. If it's
+ * optimized, the optimized code is held by the frame in opt(nil if not), and
+ * it's released by jit_opt_release() after the frame is returned or
+ * deoptimized.
+ */
+JitFunc jit_opt_hold(CodeInfo *code, void **opt);
+
+void jit_opt_release(void *opt);
+
+/*
+ * Discard the optimized code opt of function, which is deoptimized, if it's
+ * not discarded yet. The function goes back to its baseline code, or is
+ * interpreted, and is profiled again to be optimized.
+ */
+void jit_opt_discard(CodeInfo *code, void *opt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _KOALA_JIT_H_ */
@@ -0,0 +1,760 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#include <pthread.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/Error.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Object.h>
+#include <llvm-c/Orc.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/Transforms/PassBuilder.h>
+#include "jit.h"
+#include "opcode.h"
+#include "perf.h"
+#include "gc/gc.h"
+#include "util/mm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The optimizing jit lowers byte codes of a hot function to LLVM IR:
+ *
+ * - each instruction is a basic block, so jumps are branches,
+ * - registers are loaded from the stack to allocas at entry, and promoted
+ *   to SSA values by O2,
+ * - registers are stored back to the stack before calls, returns and
+ *   deoptimizations, and are loaded again after calls, because gc may move
+ *   the objects of them,
+ * - backward branches poll gc and coroutine like baseline code,
+ * - a failed guard(type parameter of quickened instruction, or division by
+ *   zero) is deoptimized: it sets ci->savedpc to the instruction and returns
+ *   1, then the interpreter resumes from it.
+ */
+
+static LLVMOrcLLJITRef lljit;
+static LLVMOrcThreadSafeContextRef tsctx;
+static int num_funcs;
+
+/* LLVM and the statics here are shared, so one function at a time */
+static pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
+/* optimized code of functions, which is published and discarded */
+static pthread_mutex_t code_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Module of optimized function, which is referenced by CodeInfo and its
+ * running frames, so it's removed after it's discarded and its last frame
+ * is returned.
+ */
+typedef struct _OptCode {
+    LLVMOrcResourceTrackerRef rt;
+    int refs;
+} OptCode;
+
+typedef struct _OptJit {
+    CodeInfo *code;
+    LLVMContextRef ctx;
+    LLVMModuleRef mod;
+    LLVMBuilderRef b;
+    LLVMValueRef func;
+    LLVMTypeRef i8p;
+    LLVMTypeRef i32;
+    LLVMTypeRef i64;
+    LLVMTypeRef f32;
+    LLVMTypeRef f64;
+    /* arguments, i8 * */
+    LLVMValueRef ks;
+    LLVMValueRef ci;
+    /* ci->base, i64 * */
+    LLVMValueRef base;
+    /* allocas of registers */
+    LLVMValueRef *regs;
+    int nregs;
+    /* basic block of each instruction, nil if not instruction boundary */
+    LLVMBasicBlockRef *blocks;
+    /* unsupported or invalid byte codes */
+    int failed;
+} OptJit;
+
+static void print_error(LLVMErrorRef err)
+{
+    char *msg = LLVMGetErrorMessage(err);
+    printf("jit-error: %s\n", msg);
+    LLVMDisposeErrorMessage(msg);
+}
+
+/* name and size of function, which is compiling, for perf */
+static char *compiling_name;
+static uint64 compiled_size;
+
+/* find size of function in the object before it's linked */
+static LLVMErrorRef find_code_size(void *ctx, LLVMMemoryBufferRef *obj)
+{
+    char *msg = nil;
+    LLVMBinaryRef bin = LLVMCreateBinary(*obj, nil, &msg);
+    if (!bin) {
+        LLVMDisposeMessage(msg);
+        return nil;
+    }
+
+    /*
+     * LLVMGetSymbolSize() is the size of common symbol only. The module has
+     * only one function, so it's the rest of text section.
+     */
+    LLVMSymbolIteratorRef it = LLVMObjectFileCopySymbolIterator(bin);
+    uint64 offset = 0;
+    while (!LLVMObjectFileIsSymbolIteratorAtEnd(bin, it)) {
+        if (!strcmp(LLVMGetSymbolName(it), compiling_name)) {
+            offset = LLVMGetSymbolAddress(it);
+            break;
+        }
+        LLVMMoveToNextSymbol(it);
+    }
+    LLVMDisposeSymbolIterator(it);
+
+    LLVMSectionIteratorRef sect = LLVMObjectFileCopySectionIterator(bin);
+    const char *sname;
+    while (!LLVMObjectFileIsSectionIteratorAtEnd(bin, sect)) {
+        sname = LLVMGetSectionName(sect);
+        if (sname && !strcmp(sname, ".text")) {
+            compiled_size = LLVMGetSectionSize(sect) - offset;
+            break;
+        }
+        LLVMMoveToNextSection(sect);
+    }
+    LLVMDisposeSectionIterator(sect);
+    LLVMDisposeBinary(bin);
+    return nil;
+}
+
+static int init_llvm(void)
+{
+    if (lljit) return 0;
+
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    LLVMErrorRef err = LLVMOrcCreateLLJIT(&lljit, nil);
+    if (err) {
+        print_error(err);
+        lljit = nil;
+        return -1;
+    }
+    tsctx = LLVMOrcCreateNewThreadSafeContext();
+
+    if (perf_flags()) {
+        LLVMOrcObjectTransformLayerRef layer;
+        layer = LLVMOrcLLJITGetObjTransformLayer(lljit);
+        LLVMOrcObjectTransformLayerSetTransform(layer, find_code_size, nil);
+    }
+    return 0;
+}
+
+/* length of supported instruction, -1 if not supported */
+static int insn_length(uint8 op)
+{
+    switch (op) {
+        case OP_RET:
+            return 1;
+        case OP_NIL:
+        case OP_PUSH:
+        case OP_SAVE_RET:
+            return 2;
+        case OP_MOVE:
+        case OP_I8K:
+        case OP_PUSH_I32_SUBK:
+        case OP_I32_ADD_RET:
+            return 3;
+        case OP_I32_ADD:
+        case OP_I32_ADDK:
+        case OP_I32_SUBK:
+        case OP_I32_CMPK:
+        case OP_JGT:
+        case OP_CALL:
+            return 4;
+        case OP_I32_JMP_CMPKGT:
+            return 5;
+        default:
+            if (op >= OP_ADD_I32 && op <= OP_CMP_F64) return 6;
+            return -1;
+    }
+}
+
+/* typed pointer to field at offset of obj(i8 *) */
+static LLVMValueRef field(OptJit *j, LLVMValueRef obj, int offset,
+                          LLVMTypeRef ty)
+{
+    LLVMValueRef idx = LLVMConstInt(j->i64, offset, 0);
+    LLVMValueRef ptr = LLVMBuildGEP2(j->b, LLVMInt8TypeInContext(j->ctx), obj,
+                                     &idx, 1, "");
+    return LLVMBuildBitCast(j->b, ptr, LLVMPointerType(ty, 0), "");
+}
+
+static LLVMValueRef const_ptr(OptJit *j, void *ptr, LLVMTypeRef ty)
+{
+    LLVMValueRef v = LLVMConstInt(j->i64, (uintptr)ptr, 0);
+    return LLVMConstIntToPtr(v, ty);
+}
+
+static LLVMValueRef get_reg(OptJit *j, int r)
+{
+    if (r >= j->nregs) {
+        j->failed = 1;
+        r = 0;
+    }
+    return LLVMBuildLoad2(j->b, j->i64, j->regs[r], "");
+}
+
+static void set_reg(OptJit *j, int r, LLVMValueRef v)
+{
+    if (r >= j->nregs) {
+        j->failed = 1;
+        r = 0;
+    }
+    LLVMBuildStore(j->b, v, j->regs[r]);
+}
+
+static LLVMValueRef get_i32(OptJit *j, int r)
+{
+    return LLVMBuildTrunc(j->b, get_reg(j, r), j->i32, "");
+}
+
+/* the same as SET_STK_I32, the high 32 bits are kept */
+static void set_i32(OptJit *j, int r, LLVMValueRef v)
+{
+    LLVMValueRef hi = LLVMBuildAnd(j->b, get_reg(j, r),
+                                   LLVMConstInt(j->i64, ~0xFFFFFFFFULL, 0), "");
+    LLVMValueRef lo = LLVMBuildZExt(j->b, v, j->i64, "");
+    set_reg(j, r, LLVMBuildOr(j->b, hi, lo, ""));
+}
+
+static LLVMValueRef get_val(OptJit *j, int idx, int r)
+{
+    switch (idx) {
+        case 0:
+            return get_i32(j, r);
+        case 1:
+            return get_reg(j, r);
+        case 2:
+            return LLVMBuildBitCast(j->b, get_i32(j, r), j->f32, "");
+        default:
+            return LLVMBuildBitCast(j->b, get_reg(j, r), j->f64, "");
+    }
+}
+
+static void set_val(OptJit *j, int idx, int r, LLVMValueRef v)
+{
+    switch (idx) {
+        case 0:
+            set_i32(j, r, v);
+            break;
+        case 1:
+            set_reg(j, r, v);
+            break;
+        case 2:
+            set_i32(j, r, LLVMBuildBitCast(j->b, v, j->i32, ""));
+            break;
+        default:
+            set_reg(j, r, LLVMBuildBitCast(j->b, v, j->i64, ""));
+            break;
+    }
+}
+
+/* 1 if v1 > v2, -1 if v1 < v2, or 0 */
+static LLVMValueRef build_cmp(OptJit *j, int isfloat, LLVMValueRef v1,
+                              LLVMValueRef v2)
+{
+    LLVMValueRef gt, lt;
+    if (isfloat) {
+        gt = LLVMBuildFCmp(j->b, LLVMRealOGT, v1, v2, "");
+        lt = LLVMBuildFCmp(j->b, LLVMRealOLT, v1, v2, "");
+    } else {
+        gt = LLVMBuildICmp(j->b, LLVMIntSGT, v1, v2, "");
+        lt = LLVMBuildICmp(j->b, LLVMIntSLT, v1, v2, "");
+    }
+    gt = LLVMBuildZExt(j->b, gt, j->i32, "");
+    lt = LLVMBuildZExt(j->b, lt, j->i32, "");
+    return LLVMBuildSub(j->b, gt, lt, "");
+}
+
+/* store registers back to the stack */
+static void sync_regs(OptJit *j)
+{
+    LLVMValueRef idx, ptr;
+    for (int r = 0; r < j->nregs; r++) {
+        idx = LLVMConstInt(j->i64, r, 0);
+        ptr = LLVMBuildGEP2(j->b, j->i64, j->base, &idx, 1, "");
+        LLVMBuildStore(j->b, get_reg(j, r), ptr);
+    }
+}
+
+/* load registers from the stack */
+static void load_regs(OptJit *j)
+{
+    LLVMValueRef idx, ptr;
+    for (int r = 0; r < j->nregs; r++) {
+        idx = LLVMConstInt(j->i64, r, 0);
+        ptr = LLVMBuildGEP2(j->b, j->i64, j->base, &idx, 1, "");
+        LLVMBuildStore(j->b, LLVMBuildLoad2(j->b, j->i64, ptr, ""), j->regs[r]);
+    }
+}
+
+/* fn(ks, ci, pc), the registers are in the stack during the call */
+static void build_call(OptJit *j, void *fn, uint8 *pc)
+{
+    sync_regs(j);
+    LLVMTypeRef params[] = { j->i8p, j->i8p, j->i8p };
+    LLVMTypeRef fty =
+        LLVMFunctionType(LLVMVoidTypeInContext(j->ctx), params, 3, 0);
+    LLVMValueRef args[] = { j->ks, j->ci, const_ptr(j, pc, j->i8p) };
+    LLVMBuildCall2(j->b, fty, const_ptr(j, fn, LLVMPointerType(fty, 0)), args,
+                   3, "");
+    load_regs(j);
+}
+
+/*
+ * Branch to target if cond is true, or to next. The backward branch
+ * decrements ks->budget and calls koala_poll() if it's used up or gc is
+ * stopping, see vm/jit.h.
+ */
+static void build_branch(OptJit *j, LLVMValueRef cond, LLVMBasicBlockRef target,
+                         LLVMBasicBlockRef next, int backward, uint8 *pc)
+{
+    if (!backward) {
+        LLVMBuildCondBr(j->b, cond, target, next);
+        return;
+    }
+
+    LLVMBasicBlockRef poll = LLVMAppendBasicBlockInContext(j->ctx, j->func, "");
+    LLVMBasicBlockRef slow = LLVMAppendBasicBlockInContext(j->ctx, j->func, "");
+    LLVMBuildCondBr(j->b, cond, poll, next);
+
+    LLVMPositionBuilderAtEnd(j->b, poll);
+    LLVMValueRef stopping = LLVMBuildLoad2(
+        j->b, j->i32, const_ptr(j, &gc_stopping, LLVMPointerType(j->i32, 0)),
+        "");
+    LLVMSetOrdering(stopping, LLVMAtomicOrderingAcquire);
+    LLVMSetAlignment(stopping, 4);
+    LLVMValueRef budgetp =
+        field(j, j->ks, offsetof(KoalaState, budget), j->i32);
+    LLVMValueRef budget = LLVMBuildSub(
+        j->b, LLVMBuildLoad2(j->b, j->i32, budgetp, ""),
+        LLVMConstInt(j->i32, 1, 0), "");
+    LLVMBuildStore(j->b, budget, budgetp);
+    LLVMValueRef fast = LLVMBuildAnd(
+        j->b,
+        LLVMBuildICmp(j->b, LLVMIntEQ, stopping, LLVMConstInt(j->i32, 0, 0),
+                      ""),
+        LLVMBuildICmp(j->b, LLVMIntSGT, budget, LLVMConstInt(j->i32, 0, 0),
+                      ""),
+        "");
+    LLVMBuildCondBr(j->b, fast, target, slow);
+
+    LLVMPositionBuilderAtEnd(j->b, slow);
+    build_call(j, koala_poll, pc);
+    LLVMBuildBr(j->b, target);
+}
+
+/* deoptimize at pc, return the block to resume interpreter */
+static LLVMBasicBlockRef build_deopt(OptJit *j, uint8 *pc)
+{
+    LLVMBasicBlockRef cur = LLVMGetInsertBlock(j->b);
+    LLVMBasicBlockRef bb = LLVMAppendBasicBlockInContext(j->ctx, j->func, "");
+    LLVMPositionBuilderAtEnd(j->b, bb);
+    sync_regs(j);
+    LLVMValueRef savedpc = field(j, j->ci, offsetof(CallInfo, savedpc), j->i8p);
+    LLVMBuildStore(j->b, const_ptr(j, pc, j->i8p), savedpc);
+    LLVMBuildRet(j->b, LLVMConstInt(j->i32, 1, 0));
+    LLVMPositionBuilderAtEnd(j->b, cur);
+    return bb;
+}
+
+/* continue if cond is true, or deoptimize at pc */
+static void build_guard(OptJit *j, LLVMValueRef cond, uint8 *pc)
+{
+    LLVMBasicBlockRef deopt = build_deopt(j, pc);
+    LLVMBasicBlockRef cont = LLVMAppendBasicBlockInContext(j->ctx, j->func, "");
+    LLVMBuildCondBr(j->b, cond, cont, deopt);
+    LLVMPositionBuilderAtEnd(j->b, cont);
+}
+
+/* kinds of type parameter per quickened index, see quicken_index() */
+static uint32 quicken_kinds[] = {
+    (1 << TP_I8_KIND) | (1 << TP_I16_KIND) | (1 << TP_I32_KIND) |
+        (1 << TP_BOOL_KIND) | (1 << TP_CHAR_KIND),
+    1 << TP_I64_KIND,
+    1 << TP_F32_KIND,
+    1 << TP_F64_KIND,
+};
+
+static void build_quickened(OptJit *j, uint8 *pc)
+{
+    int op = OP_GENERIC(pc[0]);
+    int idx = (pc[0] - OP_ADD_I32) % 4;
+    int isfloat = idx >= 2;
+
+    /* guard: type parameter is not changed */
+    LLVMValueRef tp_map = LLVMBuildLoad2(
+        j->b, j->i32, field(j, j->ci, offsetof(CallInfo, tp_map), j->i32), "");
+    LLVMValueRef kind = LLVMBuildLShr(j->b, tp_map,
+                                      LLVMConstInt(j->i32, pc[4] * 4, 0), "");
+    kind = LLVMBuildAnd(j->b, kind, LLVMConstInt(j->i32, TP_KIND_MASK, 0), "");
+    LLVMValueRef ok = LLVMBuildLShr(
+        j->b, LLVMConstInt(j->i32, quicken_kinds[idx], 0), kind, "");
+    ok = LLVMBuildTrunc(j->b, ok, LLVMInt1TypeInContext(j->ctx), "");
+    build_guard(j, ok, pc);
+
+    LLVMValueRef v1 = get_val(j, idx, pc[2]);
+    LLVMValueRef v2 = get_val(j, idx, pc[3]);
+    LLVMValueRef v;
+    switch (op) {
+        case OP_ADD:
+            v = isfloat ? LLVMBuildFAdd(j->b, v1, v2, "")
+                        : LLVMBuildAdd(j->b, v1, v2, "");
+            break;
+        case OP_SUB:
+            v = isfloat ? LLVMBuildFSub(j->b, v1, v2, "")
+                        : LLVMBuildSub(j->b, v1, v2, "");
+            break;
+        case OP_MUL:
+            v = isfloat ? LLVMBuildFMul(j->b, v1, v2, "")
+                        : LLVMBuildMul(j->b, v1, v2, "");
+            break;
+        case OP_DIV:
+            if (isfloat) {
+                v = LLVMBuildFDiv(j->b, v1, v2, "");
+            } else {
+                /* interpreter will panic */
+                LLVMValueRef zero = LLVMConstInt(LLVMTypeOf(v2), 0, 0);
+                build_guard(j, LLVMBuildICmp(j->b, LLVMIntNE, v2, zero, ""),
+                            pc);
+                v = LLVMBuildSDiv(j->b, v1, v2, "");
+            }
+            break;
+        default:
+            set_i32(j, pc[1], build_cmp(j, isfloat, v1, v2));
+            return;
+    }
+    set_val(j, idx, pc[1], v);
+}
+
+/* R(++top) = v */
+static void build_push(OptJit *j, LLVMValueRef v)
+{
+    LLVMTypeRef i64p = LLVMPointerType(j->i64, 0);
+    LLVMValueRef topp = field(j, j->ks, offsetof(KoalaState, top), i64p);
+    LLVMValueRef top = LLVMBuildLoad2(j->b, i64p, topp, "");
+    LLVMValueRef one = LLVMConstInt(j->i64, 1, 0);
+    top = LLVMBuildGEP2(j->b, j->i64, top, &one, 1, "");
+    LLVMBuildStore(j->b, top, topp);
+    LLVMBuildStore(j->b, v, top);
+}
+
+/* R(top + 1) of the caller, the return value of callee */
+static LLVMValueRef build_ret_val(OptJit *j)
+{
+    LLVMTypeRef i64p = LLVMPointerType(j->i64, 0);
+    LLVMValueRef topp = field(j, j->ci, offsetof(CallInfo, top), i64p);
+    LLVMValueRef top = LLVMBuildLoad2(j->b, i64p, topp, "");
+    LLVMValueRef one = LLVMConstInt(j->i64, 1, 0);
+    top = LLVMBuildGEP2(j->b, j->i64, top, &one, 1, "");
+    return LLVMBuildLoad2(j->b, j->i64, top, "");
+}
+
+static LLVMBasicBlockRef target_block(OptJit *j, int target)
+{
+    if (target < 0 || target >= j->code->size || !j->blocks[target]) {
+        j->failed = 1;
+        return j->blocks[0];
+    }
+    return j->blocks[target];
+}
+
+/* build one instruction, return 1 if it's terminator */
+static int build_insn(OptJit *j, uint8 *pc, int len)
+{
+    int next = pc - j->code->codes + len;
+    switch (pc[0]) {
+        case OP_MOVE:
+            set_reg(j, pc[1], get_reg(j, pc[2]));
+            return 0;
+        case OP_NIL:
+            set_reg(j, pc[1], LLVMConstInt(j->i64, 0, 0));
+            return 0;
+        case OP_I8K:
+            set_i32(j, pc[1], LLVMConstInt(j->i32, (int8)pc[2], 1));
+            return 0;
+        case OP_I32_ADD: {
+            LLVMValueRef v =
+                LLVMBuildAdd(j->b, get_i32(j, pc[2]), get_i32(j, pc[3]), "");
+            set_i32(j, pc[1], v);
+            return 0;
+        }
+        case OP_I32_ADDK:
+        case OP_I32_SUBK: {
+            LLVMValueRef k = LLVMConstInt(j->i32, pc[3], 0);
+            LLVMValueRef v = get_i32(j, pc[2]);
+            if (pc[0] == OP_I32_ADDK)
+                v = LLVMBuildAdd(j->b, v, k, "");
+            else
+                v = LLVMBuildSub(j->b, v, k, "");
+            set_i32(j, pc[1], v);
+            return 0;
+        }
+        case OP_I32_CMPK: {
+            LLVMValueRef k = LLVMConstInt(j->i32, pc[3], 0);
+            set_i32(j, pc[1], build_cmp(j, 0, get_i32(j, pc[2]), k));
+            return 0;
+        }
+        case OP_I32_JMP_CMPKGT: {
+            int16 offset;
+            memcpy(&offset, pc + 3, 2);
+            LLVMValueRef k = LLVMConstInt(j->i32, pc[2], 0);
+            LLVMValueRef cond =
+                LLVMBuildICmp(j->b, LLVMIntSGT, get_i32(j, pc[1]), k, "");
+            build_branch(j, cond, target_block(j, next + offset),
+                         target_block(j, next), offset < 0,
+                         j->code->codes + next + offset);
+            return 1;
+        }
+        case OP_JGT: {
+            int16 offset;
+            memcpy(&offset, pc + 2, 2);
+            LLVMValueRef zero = LLVMConstInt(j->i32, 0, 0);
+            LLVMValueRef cond =
+                LLVMBuildICmp(j->b, LLVMIntSGT, get_i32(j, pc[1]), zero, "");
+            build_branch(j, cond, target_block(j, next + offset),
+                         target_block(j, next), offset < 0,
+                         j->code->codes + next + offset);
+            return 1;
+        }
+        case OP_RET:
+            sync_regs(j);
+            LLVMBuildRet(j->b, LLVMConstInt(j->i32, 0, 0));
+            return 1;
+        case OP_PUSH:
+            build_push(j, get_reg(j, pc[1]));
+            return 0;
+        case OP_PUSH_I32_SUBK: {
+            LLVMValueRef k = LLVMConstInt(j->i32, pc[2], 0);
+            LLVMValueRef v = LLVMBuildSub(j->b, get_i32(j, pc[1]), k, "");
+            build_push(j, LLVMBuildSExt(j->b, v, j->i64, ""));
+            return 0;
+        }
+        case OP_SAVE_RET:
+            set_reg(j, pc[1], build_ret_val(j));
+            return 0;
+        case OP_I32_ADD_RET: {
+            LLVMValueRef v = LLVMBuildTrunc(j->b, build_ret_val(j), j->i32, "");
+            v = LLVMBuildAdd(j->b, v, get_i32(j, pc[2]), "");
+            set_i32(j, pc[1], v);
+            return 0;
+        }
+        case OP_CALL:
+            build_call(j, koala_call, pc + len);
+            return 0;
+        default:
+            build_quickened(j, pc);
+            return 0;
+    }
+}
+
+static LLVMValueRef build_func(OptJit *j, char *name)
+{
+    CodeInfo *code = j->code;
+    LLVMTypeRef params[] = { j->i8p, j->i8p };
+    LLVMTypeRef fty = LLVMFunctionType(j->i32, params, 2, 0);
+    j->func = LLVMAddFunction(j->mod, name, fty);
+    j->ks = LLVMGetParam(j->func, 0);
+    j->ci = LLVMGetParam(j->func, 1);
+
+    LLVMBasicBlockRef entry =
+        LLVMAppendBasicBlockInContext(j->ctx, j->func, "entry");
+
+    /* basic blocks of instructions */
+    uint8 *pc = code->codes;
+    uint8 *end = pc + code->size;
+    int len;
+    while (pc < end) {
+        len = insn_length(pc[0]);
+        if (len < 0 || pc + len > end) return nil;
+        j->blocks[pc - code->codes] =
+            LLVMAppendBasicBlockInContext(j->ctx, j->func, "");
+        pc += len;
+    }
+
+    /* load registers */
+    LLVMPositionBuilderAtEnd(j->b, entry);
+    LLVMTypeRef i64p = LLVMPointerType(j->i64, 0);
+    j->base = LLVMBuildLoad2(
+        j->b, i64p, field(j, j->ci, offsetof(CallInfo, base), i64p), "base");
+    for (int r = 0; r < j->nregs; r++)
+        j->regs[r] = LLVMBuildAlloca(j->b, j->i64, "");
+    load_regs(j);
+    LLVMBuildBr(j->b, j->blocks[0]);
+
+    /* instructions */
+    pc = code->codes;
+    while (pc < end) {
+        len = insn_length(pc[0]);
+        LLVMPositionBuilderAtEnd(j->b, j->blocks[pc - code->codes]);
+        if (!build_insn(j, pc, len)) {
+            /* fall through, the last one must be terminator */
+            if (pc + len >= end) return nil;
+            LLVMBuildBr(j->b, j->blocks[pc - code->codes + len]);
+        }
+        pc += len;
+    }
+
+    return j->failed ? nil : j->func;
+}
+
+static int opt_compile(CodeInfo *code)
+{
+    if (!code->size || init_llvm()) return -1;
+
+    char name[32];
+    snprintf(name, sizeof(name), "__koala_opt_%d", ++num_funcs);
+
+    OptJit j = { .code = code, .nregs = code->stacksize };
+    j.ctx = LLVMOrcThreadSafeContextGetContext(tsctx);
+    j.mod = LLVMModuleCreateWithNameInContext(name, j.ctx);
+    j.b = LLVMCreateBuilderInContext(j.ctx);
+    j.i8p = LLVMPointerType(LLVMInt8TypeInContext(j.ctx), 0);
+    j.i32 = LLVMInt32TypeInContext(j.ctx);
+    j.i64 = LLVMInt64TypeInContext(j.ctx);
+    j.f32 = LLVMFloatTypeInContext(j.ctx);
+    j.f64 = LLVMDoubleTypeInContext(j.ctx);
+    j.regs = mm_alloc(sizeof(LLVMValueRef) * (j.nregs + 1));
+    j.blocks = mm_alloc(sizeof(LLVMBasicBlockRef) * code->size);
+
+    LLVMValueRef func = build_func(&j, name);
+
+    LLVMDisposeBuilder(j.b);
+    mm_free(j.regs);
+    mm_free(j.blocks);
+
+    char *msg = nil;
+    if (!func || LLVMVerifyModule(j.mod, LLVMReturnStatusAction, &msg)) {
+        if (msg) {
+            printf("jit-error: %s\n", msg);
+            LLVMDisposeMessage(msg);
+        }
+        LLVMDisposeModule(j.mod);
+        return -1;
+    }
+    if (msg) LLVMDisposeMessage(msg);
+
+    LLVMSetTarget(j.mod, (char *)LLVMOrcLLJITGetTripleString(lljit));
+    LLVMSetDataLayout(j.mod, LLVMOrcLLJITGetDataLayoutStr(lljit));
+
+    /* O2 */
+    LLVMPassBuilderOptionsRef opts = LLVMCreatePassBuilderOptions();
+    LLVMErrorRef err = LLVMRunPasses(j.mod, "default<O2>", nil, opts);
+    LLVMDisposePassBuilderOptions(opts);
+    if (err) {
+        print_error(err);
+        LLVMDisposeModule(j.mod);
+        return -1;
+    }
+
+    LLVMOrcThreadSafeModuleRef tsm = LLVMOrcCreateNewThreadSafeModule(j.mod, tsctx);
+    LLVMOrcJITDylibRef jd = LLVMOrcLLJITGetMainJITDylib(lljit);
+    OptCode *oc = mm_alloc_obj(oc);
+    oc->rt = LLVMOrcJITDylibCreateResourceTracker(jd);
+    oc->refs = 1;
+    err = LLVMOrcLLJITAddLLVMIRModuleWithRT(lljit, oc->rt, tsm);
+    if (err) {
+        print_error(err);
+        LLVMOrcDisposeThreadSafeModule(tsm);
+        jit_opt_release(oc);
+        return -1;
+    }
+
+    LLVMOrcJITTargetAddress addr;
+    compiling_name = name;
+    compiled_size = 0;
+    err = LLVMOrcLLJITLookup(lljit, &addr, name);
+    if (err) {
+        print_error(err);
+        jit_opt_release(oc);
+        return -1;
+    }
+
+    pthread_mutex_lock(&code_lock);
+    code->optcode = oc;
+    __atomic_store_n(&code->jitcode, (void *)(uintptr)addr, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&code_lock);
+    perf_code_load((void *)(uintptr)addr, compiled_size, code->name, "opt");
+    return 0;
+}
+
+int jit_opt_compile(CodeInfo *code)
+{
+    pthread_mutex_lock(&compile_lock);
+    int ret = opt_compile(code);
+    pthread_mutex_unlock(&compile_lock);
+    uint32 tier = ret ? JIT_TIER_FAILED : JIT_TIER_OPT;
+    __atomic_store_n(&code->tier, tier, __ATOMIC_RELEASE);
+    return ret;
+}
+
+JitFunc jit_opt_hold(CodeInfo *code, void **opt)
+{
+    *opt = nil;
+    void *fn = __atomic_load_n(&code->jitcode, __ATOMIC_ACQUIRE);
+    /* baseline and aot code are not freed while the function is alive */
+    if (!fn || fn == __atomic_load_n(&code->basecode, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&code->tier, __ATOMIC_ACQUIRE) == JIT_TIER_AOT)
+        return fn;
+
+    /* the code is referenced by function until it's discarded */
+    pthread_mutex_lock(&code_lock);
+    OptCode *oc = code->optcode;
+    if (oc) __atomic_add_fetch(&oc->refs, 1, __ATOMIC_RELAXED);
+    fn = code->jitcode;
+    pthread_mutex_unlock(&code_lock);
+    *opt = oc;
+    return fn;
+}
+
+void jit_opt_release(void *opt)
+{
+    OptCode *oc = opt;
+    if (!oc || __atomic_sub_fetch(&oc->refs, 1, __ATOMIC_ACQ_REL)) return;
+
+    LLVMErrorRef err = LLVMOrcResourceTrackerRemove(oc->rt);
+    if (err) print_error(err);
+    LLVMOrcReleaseResourceTracker(oc->rt);
+    mm_free(oc);
+}
+
+void jit_opt_discard(CodeInfo *code, void *opt)
+{
+    if (!opt) return;
+
+    /* it may be deoptimized by frames of other threads at the same time */
+    pthread_mutex_lock(&code_lock);
+    if (code->optcode != opt) {
+        pthread_mutex_unlock(&code_lock);
+        return;
+    }
+    code->optcode = nil;
+    __atomic_store_n(&code->jitcode, code->basecode, __ATOMIC_RELEASE);
+    __atomic_store_n(&code->calls, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&code->tier, JIT_TIER_BASELINE, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&code_lock);
+    jit_opt_release(opt);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,224 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#include "opcode.h"
+#include "util/common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* clang-format off */
+
+static char *opnames[256] = {
+    [OP_MOVE]          = "move",
+    [OP_NIL]           = "nil",
+    [OP_I8K]           = "i8k",
+    [OP_I16K]          = "i16k",
+    [OP_I32K]          = "i32k",
+    [OP_F32K]          = "f32k",
+    [OP_LDC_I64]       = "ldc_i64",
+    [OP_LDC_F64]       = "ldc_f64",
+    [OP_LDC_STR]       = "ldc_str",
+    [OP_I32_ADD]       = "i32_add",
+    [OP_I32_SUB]       = "i32_sub",
+    [OP_I32_MUL]       = "i32_mul",
+    [OP_I32_DIV]       = "i32_div",
+    [OP_I32_MOD]       = "i32_mod",
+    [OP_I32_NEG]       = "i32_neg",
+    [OP_I32_AND]       = "i32_and",
+    [OP_I32_OR]        = "i32_or",
+    [OP_I32_XOR]       = "i32_xor",
+    [OP_I32_SHL]       = "i32_shl",
+    [OP_I32_SHR]       = "i32_shr",
+    [OP_I32_USHR]      = "i32_ushr",
+    [OP_I32_CMP]       = "i32_cmp",
+    [OP_I32_ADDK]      = "i32_addk",
+    [OP_I32_SUBK]      = "i32_subk",
+    [OP_I32_MULK]      = "i32_mulk",
+    [OP_I32_DIVK]      = "i32_divk",
+    [OP_I32_MODK]      = "i32_modk",
+    [OP_I32_ANDK]      = "i32_andk",
+    [OP_I32_ORK]       = "i32_ork",
+    [OP_I32_XORK]      = "i32_xork",
+    [OP_I32_SHLK]      = "i32_shlk",
+    [OP_I32_SHRK]      = "i32_shrk",
+    [OP_I32_USHRK]     = "i32_ushrk",
+    [OP_I32_CMPK]      = "i32_cmpk",
+    [OP_I64_ADD]       = "i64_add",
+    [OP_I64_SUB]       = "i64_sub",
+    [OP_I64_MUL]       = "i64_mul",
+    [OP_I64_DIV]       = "i64_div",
+    [OP_I64_MOD]       = "i64_mod",
+    [OP_I64_NEG]       = "i64_neg",
+    [OP_I64_AND]       = "i64_and",
+    [OP_I64_OR]        = "i64_or",
+    [OP_I64_XOR]       = "i64_xor",
+    [OP_I64_SHL]       = "i64_shl",
+    [OP_I64_SHR]       = "i64_shr",
+    [OP_I64_USHR]      = "i64_ushr",
+    [OP_I64_CMP]       = "i64_cmp",
+    [OP_I64_ADDK]      = "i64_addk",
+    [OP_I64_SUBK]      = "i64_subk",
+    [OP_I64_MULK]      = "i64_mulk",
+    [OP_I64_DIVK]      = "i64_divk",
+    [OP_I64_MODK]      = "i64_modk",
+    [OP_I64_ANDK]      = "i64_andk",
+    [OP_I64_ORK]       = "i64_ork",
+    [OP_I64_XORK]      = "i64_xork",
+    [OP_I64_SHLK]      = "i64_shlk",
+    [OP_I64_SHRK]      = "i64_shrk",
+    [OP_I64_USHRK]     = "i64_ushrk",
+    [OP_I64_CMPK]      = "i64_cmpk",
+    [OP_F32_ADD]       = "f32_add",
+    [OP_F32_SUB]       = "f32_sub",
+    [OP_F32_MUL]       = "f32_mul",
+    [OP_F32_DIV]       = "f32_div",
+    [OP_F32_MOD]       = "f32_mod",
+    [OP_F32_NEG]       = "f32_neg",
+    [OP_F32_CMP]       = "f32_cmp",
+    [OP_F64_ADD]       = "f64_add",
+    [OP_F64_SUB]       = "f64_sub",
+    [OP_F64_MUL]       = "f64_mul",
+    [OP_F64_DIV]       = "f64_div",
+    [OP_F64_MOD]       = "f64_mod",
+    [OP_F64_NEG]       = "f64_neg",
+    [OP_F64_CMP]       = "f64_cmp",
+    [OP_JMP]           = "jmp",
+    [OP_JEQ]           = "jeq",
+    [OP_JNE]           = "jne",
+    [OP_JLT]           = "jlt",
+    [OP_JLE]           = "jle",
+    [OP_JGT]           = "jgt",
+    [OP_JGE]           = "jge",
+    [OP_RET]           = "ret",
+    [OP_RETV]          = "retv",
+    [OP_RETK]          = "retk",
+    [OP_CALL]          = "call",
+    [OP_DYN_CALL]      = "dyn_call",
+    [OP_CALL_METHOD]   = "call_method",
+    [OP_TAIL_CALL]     = "tail_call",
+    [OP_PUSH]          = "push",
+    [OP_PUSH_I32_ADD]  = "push_i32_add",
+    [OP_PUSH_I32_SUB]  = "push_i32_sub",
+    [OP_PUSH_I32_ADDK] = "push_i32_addk",
+    [OP_PUSH_I32_SUBK] = "push_i32_subk",
+    [OP_SAVE_RET]      = "save_ret",
+    [OP_I32_ADD_RET]   = "i32_add_ret",
+    [OP_I32_SUB_RET]   = "i32_sub_ret",
+    [OP_I32_ADDK_RET]  = "i32_addk_ret",
+    [OP_I32_SUBK_RET]  = "i32_subk_ret",
+    [OP_I32_JMP_CMPEQ] = "i32_jmp_cmpeq",
+    [OP_I32_JMP_CMPNE] = "i32_jmp_cmpne",
+    [OP_I32_JMP_CMPLT] = "i32_jmp_cmplt",
+    [OP_I32_JMP_CMPLE] = "i32_jmp_cmple",
+    [OP_I32_JMP_CMPGT] = "i32_jmp_cmpgt",
+    [OP_I32_JMP_CMPGE] = "i32_jmp_cmpge",
+    [OP_I32_JMP_CMPKEQ]= "i32_jmp_cmpkeq",
+    [OP_I32_JMP_CMPKNE]= "i32_jmp_cmpkne",
+    [OP_I32_JMP_CMPKLT]= "i32_jmp_cmpklt",
+    [OP_I32_JMP_CMPKLE]= "i32_jmp_cmpkle",
+    [OP_I32_JMP_CMPKGT]= "i32_jmp_cmpkgt",
+    [OP_I32_JMP_CMPKGE]= "i32_jmp_cmpkge",
+    [OP_ADD]           = "add",
+    [OP_SUB]           = "sub",
+    [OP_MUL]           = "mul",
+    [OP_DIV]           = "div",
+    [OP_CMP]           = "cmp",
+    [OP_ADD_I32]       = "add_i32",
+    [OP_ADD_I64]       = "add_i64",
+    [OP_ADD_F32]       = "add_f32",
+    [OP_ADD_F64]       = "add_f64",
+    [OP_SUB_I32]       = "sub_i32",
+    [OP_SUB_I64]       = "sub_i64",
+    [OP_SUB_F32]       = "sub_f32",
+    [OP_SUB_F64]       = "sub_f64",
+    [OP_MUL_I32]       = "mul_i32",
+    [OP_MUL_I64]       = "mul_i64",
+    [OP_MUL_F32]       = "mul_f32",
+    [OP_MUL_F64]       = "mul_f64",
+    [OP_DIV_I32]       = "div_i32",
+    [OP_DIV_I64]       = "div_i64",
+    [OP_DIV_F32]       = "div_f32",
+    [OP_DIV_F64]       = "div_f64",
+    [OP_CMP_I32]       = "cmp_i32",
+    [OP_CMP_I64]       = "cmp_i64",
+    [OP_CMP_F32]       = "cmp_f32",
+    [OP_CMP_F64]       = "cmp_f64",
+    [OP_TO_ANY]        = "to_any",
+    [OP_FROM_ANY]      = "from_any",
+    [OP_ANY_ADD]       = "any_add",
+    [OP_ANY_SUB]       = "any_sub",
+    [OP_ANY_MUL]       = "any_mul",
+    [OP_ANY_DIV]       = "any_div",
+    [OP_ANY_CMP]       = "any_cmp",
+};
+
+/*
+ * Operands of instruction, which is executed by interpreter:
+ *   r: register
+ *   k: 1 byte constant
+ *   n: argc of call
+ *   t: index of type parameter
+ *   c: counter of quickening
+ *   j: 2 bytes jump offset
+ *   x: 2 bytes constant
+ */
+static char *formats[256] = {
+    [OP_MOVE]           = "rr",
+    [OP_NIL]            = "r",
+    [OP_I8K]            = "rk",
+    [OP_I32_ADD]        = "rrr",
+    [OP_I32_ADDK]       = "rrk",
+    [OP_I32_SUBK]       = "rrk",
+    [OP_I32_CMPK]       = "rrk",
+    [OP_I32_JMP_CMPKGT] = "rkj",
+    [OP_JGT]            = "rj",
+    [OP_RET]            = "",
+    [OP_CALL]           = "nx",
+    [OP_CALL_METHOD]    = "nx",
+    [OP_TAIL_CALL]      = "nx",
+    [OP_PUSH]           = "r",
+    [OP_PUSH_I32_SUBK]  = "rk",
+    [OP_SAVE_RET]       = "r",
+    [OP_I32_ADD_RET]    = "rr",
+    [OP_ADD ... OP_CMP_F64] = "rrrtc",
+    [OP_TO_ANY]         = "rrk",
+    [OP_FROM_ANY]       = "rrk",
+    [OP_ANY_ADD ... OP_ANY_CMP] = "rrr",
+};
+
+/* clang-format on */
+
+char *opcode_name(int op)
+{
+    if (op < 0 || op >= 256 || !opnames[op]) return "unknown";
+    return opnames[op];
+}
+
+char *opcode_format(int op)
+{
+    if (op < 0 || op >= 256) return nil;
+    return formats[op];
+}
+
+int opcode_length(int op)
+{
+    char *fmt = opcode_format(op);
+    if (!fmt) return -1;
+    int len = 1;
+    while (*fmt) {
+        len += (*fmt == 'j' || *fmt == 'x') ? 2 : 1;
+        ++fmt;
+    }
+    return len;
+}
+
+#ifdef __cplusplus
+}
+#endif
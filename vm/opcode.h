@@ -146,6 +146,8 @@ typedef enum {
 
     OP_CALL,                /* K1(1) = argc  K2(2) = offset                 */
     OP_DYN_CALL,            /* K1(1) = argc  K2(2) = offset                 */
+    OP_CALL_METHOD,         /* K1(1) = argc  K2(2) = index of inline cache  */
+    OP_TAIL_CALL,           /* K1(1) = argc  K2(2) = offset, reuse frame    */
 
     OP_PUSH,                /* A                R(++top) = R(A)             */
     OP_PUSH_I32_ADD,        /* A  B             R(++top) = R(A) + R(B)      */
@@ -173,10 +175,79 @@ typedef enum {
     OP_I32_JMP_CMPKGT,      /* A  K1(1)  K2(2)  R(A) > K1, pc += K2         */
     OP_I32_JMP_CMPKGE,      /* A  K1(1)  K2(2)  R(A) >= K1, pc += K2        */
 
+    /*
+     * Generic instructions for `Any` values. T is the index of type parameter
+     * in CallInfo tp_map and N is the hotness counter. After N reaches
+     * QUICKEN_THRESHOLD, the instruction is rewritten in place to the
+     * specialized one with the same length. The specialized instruction
+     * checks T again and rewrites itself back if the type is changed.
+     */
+    OP_ADD,                 /* A  B  C  T  N    R(A) = R(B) + R(C)          */
+    OP_SUB,                 /* A  B  C  T  N    R(A) = R(B) - R(C)          */
+    OP_MUL,                 /* A  B  C  T  N    R(A) = R(B) * R(C)          */
+    OP_DIV,                 /* A  B  C  T  N    R(A) = R(B) / R(C)          */
+    OP_CMP,                 /* A  B  C  T  N    R(A) = 1/0/-1               */
+
+    OP_ADD_I32,             /* A  B  C  T  N    quickened OP_ADD            */
+    OP_ADD_I64,             /* A  B  C  T  N    quickened OP_ADD            */
+    OP_ADD_F32,             /* A  B  C  T  N    quickened OP_ADD            */
+    OP_ADD_F64,             /* A  B  C  T  N    quickened OP_ADD            */
+    OP_SUB_I32,             /* A  B  C  T  N    quickened OP_SUB            */
+    OP_SUB_I64,             /* A  B  C  T  N    quickened OP_SUB            */
+    OP_SUB_F32,             /* A  B  C  T  N    quickened OP_SUB            */
+    OP_SUB_F64,             /* A  B  C  T  N    quickened OP_SUB            */
+    OP_MUL_I32,             /* A  B  C  T  N    quickened OP_MUL            */
+    OP_MUL_I64,             /* A  B  C  T  N    quickened OP_MUL            */
+    OP_MUL_F32,             /* A  B  C  T  N    quickened OP_MUL            */
+    OP_MUL_F64,             /* A  B  C  T  N    quickened OP_MUL            */
+    OP_DIV_I32,             /* A  B  C  T  N    quickened OP_DIV            */
+    OP_DIV_I64,             /* A  B  C  T  N    quickened OP_DIV            */
+    OP_DIV_F32,             /* A  B  C  T  N    quickened OP_DIV            */
+    OP_DIV_F64,             /* A  B  C  T  N    quickened OP_DIV            */
+    OP_CMP_I32,             /* A  B  C  T  N    quickened OP_CMP            */
+    OP_CMP_I64,             /* A  B  C  T  N    quickened OP_CMP            */
+    OP_CMP_F32,             /* A  B  C  T  N    quickened OP_CMP            */
+    OP_CMP_F64,             /* A  B  C  T  N    quickened OP_CMP            */
+
+    /*
+     * Instructions of `Any` slots, which are tagged values(see vm/value.h).
+     * K is TP_*_KIND of raw value. The type of operand is tested by its
+     * tag, so it's not boxed.
+     */
+    OP_TO_ANY,              /* A  B  K(1)       R(A) = tag(R(B))            */
+    OP_FROM_ANY,            /* A  B  K(1)       R(A) = untag(R(B))          */
+    OP_ANY_ADD,             /* A  B  C          R(A) = R(B) + R(C)          */
+    OP_ANY_SUB,             /* A  B  C          R(A) = R(B) - R(C)          */
+    OP_ANY_MUL,             /* A  B  C          R(A) = R(B) * R(C)          */
+    OP_ANY_DIV,             /* A  B  C          R(A) = R(B) / R(C)          */
+    OP_ANY_CMP,             /* A  B  C          R(A) = 1/0/-1               */
+
 } OpCode;
 
 /* clang-format on */
 
+/* executions of generic instruction before it is quickened */
+#define QUICKEN_THRESHOLD 8
+
+/* the quickened instructions of one generic are I32, I64, F32 and F64 */
+#define OP_QUICKEN(op, idx) (OP_ADD_I32 + ((op)-OP_ADD) * 4 + (idx))
+#define OP_GENERIC(op)      (OP_ADD + ((op)-OP_ADD_I32) / 4)
+
+/* the generic arithmetic of OP_ANY_* */
+#define OP_ANY_GENERIC(op)  (OP_ADD + ((op)-OP_ANY_ADD))
+
+/* name of opcode, e.g. "i32_add" */
+char *opcode_name(int op);
+
+/*
+ * Operands of opcode, one letter each(see vm/opcode.c), e.g. "rrk", nil if
+ * it's not executed by interpreter.
+ */
+char *opcode_format(int op);
+
+/* length of instruction with its operands, -1 if it's not executed */
+int opcode_length(int op);
+
 #ifdef __cplusplus
 }
 #endif
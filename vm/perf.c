@@ -0,0 +1,238 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#include "perf.h"
+#include <elf.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static pthread_once_t flags_once = PTHREAD_ONCE_INIT;
+static int flags;
+static FILE *perf_map;
+static FILE *jitdump;
+static uint64 code_index;
+/* code is loaded by jit of any thread */
+static pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define JITDUMP_MAGIC   0x4A695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD   0
+
+typedef struct _JitDumpHeader {
+    uint32 magic;
+    uint32 version;
+    uint32 total_size;
+    uint32 elf_mach;
+    uint32 pad1;
+    uint32 pid;
+    uint64 timestamp;
+    uint64 flags;
+} JitDumpHeader;
+
+typedef struct _JitCodeLoad {
+    uint32 id;
+    uint32 total_size;
+    uint64 timestamp;
+    uint32 pid;
+    uint32 tid;
+    uint64 vma;
+    uint64 code_addr;
+    uint64 code_size;
+    uint64 code_index;
+} JitCodeLoad;
+
+static int env_on(char *name)
+{
+    char *val = getenv(name);
+    return val && val[0] && strcmp(val, "0");
+}
+
+static uint64 timestamp(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static FILE *open_perf_map(void)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+    FILE *fp = fopen(path, "w");
+    if (!fp) printf("error: cannot open '%s'\n", path);
+    return fp;
+}
+
+static FILE *open_jitdump(void)
+{
+    char *dir = getenv("JITDUMPDIR");
+    if (!dir) dir = ".";
+    char path[256];
+    snprintf(path, sizeof(path), "%s/jit-%d.dump", dir, getpid());
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+    if (fd < 0) {
+        printf("error: cannot open '%s'\n", path);
+        return nil;
+    }
+
+    /* perf finds the dump file by this executable mapping */
+    void *marker = mmap(nil, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC,
+                        MAP_PRIVATE, fd, 0);
+    if (marker == MAP_FAILED) {
+        close(fd);
+        return nil;
+    }
+
+    FILE *fp = fdopen(fd, "w");
+    JitDumpHeader hdr = {
+        .magic = JITDUMP_MAGIC,
+        .version = JITDUMP_VERSION,
+        .total_size = sizeof(JitDumpHeader),
+#if defined(__x86_64__)
+        .elf_mach = EM_X86_64,
+#elif defined(__aarch64__)
+        .elf_mach = EM_AARCH64,
+#endif
+        .pid = getpid(),
+        .timestamp = timestamp(),
+    };
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    fflush(fp);
+    return fp;
+}
+
+static void init_flags(void)
+{
+    if (env_on("KOALA_PERF_MAP")) {
+        perf_map = open_perf_map();
+        if (perf_map) flags |= PERF_MAP;
+    }
+    if (env_on("KOALA_JITDUMP")) {
+        jitdump = open_jitdump();
+        if (jitdump) flags |= PERF_JITDUMP;
+    }
+    /* trampolines without symbols are useless */
+    if (flags && env_on("KOALA_PERF_TRAMPOLINE")) flags |= PERF_TRAMPOLINE;
+}
+
+int perf_flags(void)
+{
+    pthread_once(&flags_once, init_flags);
+    return flags;
+}
+
+void perf_code_load(void *addr, uint32 size, char *name, char *tier)
+{
+    if (!perf_flags()) return;
+
+    char sym[256];
+    snprintf(sym, sizeof(sym), "koala:%s:%s", name ? name : "<anonymous>",
+             tier);
+
+    pthread_mutex_lock(&perf_lock);
+    if (perf_map) {
+        fprintf(perf_map, "%lx %x %s\n", (uintptr)addr, size, sym);
+        fflush(perf_map);
+    }
+
+    if (jitdump) {
+        int len = strlen(sym) + 1;
+        JitCodeLoad rec = {
+            .id = JIT_CODE_LOAD,
+            .total_size = sizeof(JitCodeLoad) + len + size,
+            .timestamp = timestamp(),
+            .pid = getpid(),
+            .tid = syscall(SYS_gettid),
+            .vma = (uintptr)addr,
+            .code_addr = (uintptr)addr,
+            .code_size = size,
+            .code_index = code_index++,
+        };
+        fwrite(&rec, sizeof(rec), 1, jitdump);
+        fwrite(sym, len, 1, jitdump);
+        fwrite(addr, size, 1, jitdump);
+        fflush(jitdump);
+    }
+    pthread_mutex_unlock(&perf_lock);
+}
+
+#if defined(__x86_64__)
+
+/* clang-format off */
+
+/*
+ * push rbp
+ * mov rbp, rsp
+ * movabs rax, koala_execute
+ * call rax
+ * pop rbp
+ * ret
+ */
+static uint8 tramp_codes[] = {
+    0x55,
+    0x48, 0x89, 0xE5,
+    0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0,
+    0xFF, 0xD0,
+    0x5D,
+    0xC3,
+};
+
+/* clang-format on */
+
+#define TRAMP_SIZE 32
+
+static uint8 *tramp_page;
+static int tramp_used;
+static int tramp_pagesize;
+
+void *perf_trampoline(CodeInfo *code)
+{
+    if (!tramp_page || tramp_used + TRAMP_SIZE > tramp_pagesize) {
+        tramp_pagesize = sysconf(_SC_PAGESIZE);
+        tramp_page = mmap(nil, tramp_pagesize, PROT_READ | PROT_EXEC,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (tramp_page == MAP_FAILED) {
+            tramp_page = nil;
+            return nil;
+        }
+        tramp_used = 0;
+    }
+
+    if (mprotect(tramp_page, tramp_pagesize, PROT_READ | PROT_WRITE))
+        return nil;
+    uint8 *tramp = tramp_page + tramp_used;
+    void *target = koala_execute;
+    memcpy(tramp, tramp_codes, sizeof(tramp_codes));
+    memcpy(tramp + 6, &target, 8);
+    tramp_used += TRAMP_SIZE;
+    mprotect(tramp_page, tramp_pagesize, PROT_READ | PROT_EXEC);
+
+    perf_code_load(tramp, sizeof(tramp_codes), code->name, "interp");
+    return tramp;
+}
+
+#else
+
+void *perf_trampoline(CodeInfo *code)
+{
+    return nil;
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
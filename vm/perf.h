@@ -0,0 +1,49 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#ifndef _KOALA_PERF_H_
+#define _KOALA_PERF_H_
+
+#include "vm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Symbols of native code for linux perf, enabled by environment:
+ *
+ * KOALA_PERF_MAP=1: /tmp/perf-<pid>.map, read by `perf report`.
+ * KOALA_JITDUMP=1: $JITDUMPDIR/jit-<pid>.dump(default is current directory),
+ *   read by `perf inject --jit`, and `perf record -k mono` is required.
+ * KOALA_PERF_TRAMPOLINE=1: each interpreted function is entered by its own
+ *   native trampoline(x86-64 only), which calls koala_execute, so
+ *   `perf record -g` attributes the interpreted time to koala functions.
+ *
+ * The symbol is `koala:<function>:<tier>`. The aot code is in a shared
+ * object, so perf resolves it by the symbol table of the shared object.
+ */
+
+#define PERF_MAP        1
+#define PERF_JITDUMP    2
+#define PERF_TRAMPOLINE 4
+
+/* PERF_* flags, which are read at the first call */
+int perf_flags(void);
+
+/* report native code of function */
+void perf_code_load(void *addr, uint32 size, char *name, char *tier);
+
+/* create trampoline of function, nil if failed */
+void *perf_trampoline(CodeInfo *code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _KOALA_PERF_H_ */
@@ -0,0 +1,161 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#include "profile.h"
+#include "opcode.h"
+#include "util/mm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+OpProfile profile_ops[256];
+
+/* the first instruction is added to them */
+static OpProfile none_op;
+static FuncProfile none_func;
+
+OpProfile *profile_last_op = &none_op;
+FuncProfile *profile_last_func = &none_func;
+uint64 profile_last_clock;
+
+static HashMap func_map;
+static int func_inited;
+
+static int func_equal(void *e1, void *e2)
+{
+    FuncProfile *f1 = e1;
+    FuncProfile *f2 = e2;
+    return f1->code == f2->code;
+}
+
+typedef struct _FuncArray {
+    FuncProfile **funcs;
+    int num;
+} FuncArray;
+
+static void _collect_func(void *entry, void *arg)
+{
+    FuncArray *arr = arg;
+    arr->funcs[arr->num++] = entry;
+}
+
+static int _cmp_op(const void *p1, const void *p2)
+{
+    OpProfile *op1 = profile_ops + *(int *)p1;
+    OpProfile *op2 = profile_ops + *(int *)p2;
+    if (op1->count == op2->count) return 0;
+    return op1->count < op2->count ? 1 : -1;
+}
+
+static int _cmp_func(const void *p1, const void *p2)
+{
+    FuncProfile *f1 = *(FuncProfile **)p1;
+    FuncProfile *f2 = *(FuncProfile **)p2;
+    if (f1->insns == f2->insns) return 0;
+    return f1->insns < f2->insns ? 1 : -1;
+}
+
+static void dump_json(int *ops, int nops, FuncArray *arr)
+{
+    char *path = getenv("KOALA_PROFILE_JSON");
+    if (!path) path = "koala_profile.json";
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        printf("error: cannot open '%s'\n", path);
+        return;
+    }
+
+    OpProfile *op;
+    fprintf(fp, "{\n  \"opcodes\": [");
+    for (int i = 0; i < nops; i++) {
+        op = profile_ops + ops[i];
+        fprintf(fp, "%s\n    {\"name\": \"%s\", \"count\": %lu, \"cycles\": %lu}",
+                i ? "," : "", opcode_name(ops[i]), op->count, op->cycles);
+    }
+    fprintf(fp, "\n  ],\n  \"functions\": [");
+
+    FuncProfile *func;
+    for (int i = 0; i < arr->num; i++) {
+        func = arr->funcs[i];
+        fprintf(fp,
+                "%s\n    {\"name\": \"%s\", \"calls\": %lu, \"insns\": %lu, "
+                "\"cycles\": %lu}",
+                i ? "," : "", func->name, func->calls, func->insns,
+                func->cycles);
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    fclose(fp);
+}
+
+static void profile_dump(void)
+{
+    int ops[256];
+    int nops = 0;
+    for (int i = 0; i < 256; i++) {
+        if (profile_ops[i].count) ops[nops++] = i;
+    }
+    qsort(ops, nops, sizeof(int), _cmp_op);
+
+    FuncArray arr;
+    arr.funcs = mm_alloc(hashmap_size(&func_map) * sizeof(void *) + 1);
+    arr.num = 0;
+    hashmap_visit(&func_map, _collect_func, &arr);
+    qsort(arr.funcs, arr.num, sizeof(void *), _cmp_func);
+
+    OpProfile *op;
+    puts("------ Opcode Profile ------");
+    printf("%-20s %16s %16s\n", "opcode", "count", "cycles");
+    for (int i = 0; i < nops; i++) {
+        op = profile_ops + ops[i];
+        printf("%-20s %16lu %16lu\n", opcode_name(ops[i]), op->count,
+               op->cycles);
+    }
+
+    FuncProfile *func;
+    puts("------ Function Profile ------");
+    printf("%-20s %12s %16s %16s\n", "function", "calls", "insns", "cycles");
+    for (int i = 0; i < arr.num; i++) {
+        func = arr.funcs[i];
+        printf("%-20s %12lu %16lu %16lu\n", func->name, func->calls,
+               func->insns, func->cycles);
+    }
+    puts("------------------------------");
+
+    dump_json(ops, nops, &arr);
+    mm_free(arr.funcs);
+}
+
+FuncProfile *profile_func(CodeInfo *code)
+{
+    if (!func_inited) {
+        hashmap_init(&func_map, func_equal);
+        profile_last_clock = profile_clock();
+        atexit(profile_dump);
+        func_inited = 1;
+    }
+
+    FuncProfile key = { .code = code };
+    hashmap_entry_init(&key, (unsigned int)((uintptr)code >> 4));
+    FuncProfile *func = hashmap_get(&func_map, &key);
+    if (func) return func;
+
+    func = mm_alloc_obj(func);
+    func->code = code;
+    if (!code)
+        func->name = "<codes>";
+    else
+        func->name = code->name ? code->name : "<anonymous>";
+    hashmap_entry_init(func, (unsigned int)((uintptr)code >> 4));
+    hashmap_put_absent(&func_map, func);
+    return func;
+}
+
+#ifdef __cplusplus
+}
+#endif
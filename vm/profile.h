@@ -0,0 +1,110 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#ifndef _KOALA_PROFILE_H_
+#define _KOALA_PROFILE_H_
+
+#include "vm.h"
+
+#if defined(KOALA_PROFILE_RDTSC)
+#include <x86intrin.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Profiling build of interpreter(ENABLE_PROFILE).
+ *
+ * Each executed instruction is counted by its opcode and by its function.
+ * With ENABLE_PROFILE_RDTSC, the cycles between two instructions are added to
+ * the former one and its function, so the cycles are self time, and a call
+ * instruction does not include its callee.
+ *
+ * The counters are dumped at exit, as text to stdout and as json to the file
+ * $KOALA_PROFILE_JSON(default is koala_profile.json).
+ */
+
+#if defined(KOALA_PROFILE)
+
+typedef struct _OpProfile {
+    uint64 count;
+    uint64 cycles;
+} OpProfile;
+
+typedef struct _FuncProfile {
+    HashMapEntry entry;
+    /* nil if it's raw byte codes */
+    CodeInfo *code;
+    /* copied, code may be freed before exit */
+    char *name;
+    uint64 calls;
+    uint64 insns;
+    uint64 cycles;
+} FuncProfile;
+
+extern OpProfile profile_ops[256];
+
+/* instruction, which is executing */
+extern OpProfile *profile_last_op;
+extern FuncProfile *profile_last_func;
+extern uint64 profile_last_clock;
+
+/* the profile of function, it's created at the first call */
+FuncProfile *profile_func(CodeInfo *code);
+
+static inline uint64 profile_clock(void)
+{
+#if defined(KOALA_PROFILE_RDTSC)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static inline void profile_op(FuncProfile *func, int op)
+{
+    uint64 now = profile_clock();
+    uint64 delta = now - profile_last_clock;
+    profile_last_op->cycles += delta;
+    profile_last_func->cycles += delta;
+    profile_last_clock = now;
+
+    OpProfile *prof = profile_ops + op;
+    ++prof->count;
+    ++func->insns;
+    profile_last_op = prof;
+    profile_last_func = func;
+}
+
+/* clang-format off */
+
+#define PROFILE_ENTER(code) \
+    FuncProfile *__prof__ = profile_func(code); ++__prof__->calls
+
+#define PROFILE_SWITCH(code) \
+    __prof__ = profile_func(code); ++__prof__->calls
+
+#define PROFILE_OP(op) profile_op(__prof__, op)
+
+/* clang-format on */
+
+#else
+
+#define PROFILE_ENTER(code)
+#define PROFILE_SWITCH(code)
+#define PROFILE_OP(op)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _KOALA_PROFILE_H_ */
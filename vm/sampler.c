@@ -0,0 +1,161 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#include "sampler.h"
+#include <signal.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* must be power of 2 */
+#define MAX_STACKS 1024
+
+typedef struct _Stack {
+    uint32 hash;
+    int depth;
+    int count;
+    /* the innermost is the first */
+    char *names[SAMPLER_MAX_DEPTH];
+} Stack;
+
+/* it's filled by signal handler, so it's not allocated */
+static Stack stacks[MAX_STACKS];
+/* samples, which are not counted because the table is full */
+static volatile int dropped;
+static KoalaState *volatile sampled_ks;
+static struct sigaction old_action;
+static timer_t timer;
+
+static inline char *frame_name(CallInfo *ci)
+{
+    CodeInfo *code = ci->codeinfo;
+    if (!code) return "<codes>";
+    return code->name ? code->name : "<anonymous>";
+}
+
+static void on_sigprof(int sig)
+{
+    KoalaState *ks = sampled_ks;
+    if (!ks) return;
+
+    char *names[SAMPLER_MAX_DEPTH];
+    int depth = 0;
+    uint32 hash = 5381;
+    CallInfo *ci = ks->ci;
+    while (ci && depth < SAMPLER_MAX_DEPTH) {
+        names[depth] = frame_name(ci);
+        hash = hash * 31 + (uint32)(uintptr)names[depth];
+        ++depth;
+        ci = ci->prev;
+    }
+    if (!depth) return;
+
+    Stack *s;
+    int idx = hash & (MAX_STACKS - 1);
+    for (int i = 0; i < MAX_STACKS; i++) {
+        s = stacks + ((idx + i) & (MAX_STACKS - 1));
+        if (!s->count) {
+            s->hash = hash;
+            s->depth = depth;
+            memcpy(s->names, names, depth * sizeof(char *));
+            s->count = 1;
+            return;
+        }
+        if (s->hash == hash && s->depth == depth &&
+            !memcmp(s->names, names, depth * sizeof(char *))) {
+            ++s->count;
+            return;
+        }
+    }
+    ++dropped;
+}
+
+int sampler_start(KoalaState *ks, int hz)
+{
+    if (hz <= 0 || hz > 1000000) return -1;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigprof;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, &old_action)) return -1;
+
+    sampled_ks = ks;
+
+    /*
+     * The cpu time of this thread only, and the signal is sent to it, so
+     * the other threads, e.g. gc workers, are never interrupted.
+     */
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer)) {
+        sampled_ks = nil;
+        sigaction(SIGPROF, &old_action, nil);
+        return -1;
+    }
+
+    struct itimerspec its;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 1000000000 / hz;
+    its.it_value = its.it_interval;
+    if (timer_settime(timer, 0, &its, nil)) {
+        timer_delete(timer);
+        sampled_ks = nil;
+        sigaction(SIGPROF, &old_action, nil);
+        return -1;
+    }
+    return 0;
+}
+
+int sampler_stop(char *path)
+{
+    timer_delete(timer);
+    sampled_ks = nil;
+    sigaction(SIGPROF, &old_action, nil);
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        printf("error: cannot open '%s'\n", path);
+        return -1;
+    }
+
+    int total = 0;
+    Stack *s;
+    for (int i = 0; i < MAX_STACKS; i++) {
+        s = stacks + i;
+        if (!s->count) continue;
+        /* the outermost is the first in folded stack */
+        for (int j = s->depth - 1; j >= 0; j--)
+            fprintf(fp, "%s%s", s->names[j], j ? ";" : "");
+        fprintf(fp, " %d\n", s->count);
+        total += s->count;
+    }
+    fclose(fp);
+
+    if (dropped) printf("warn: %d samples are dropped\n", dropped);
+
+    memset(stacks, 0, sizeof(stacks));
+    dropped = 0;
+    return total;
+}
+
+#ifdef __cplusplus
+}
+#endif
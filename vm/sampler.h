@@ -0,0 +1,48 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#ifndef _KOALA_SAMPLER_H_
+#define _KOALA_SAMPLER_H_
+
+#include "vm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Sampling profiler of koala functions.
+ *
+ * On each SIGPROF tick(cpu time of the thread, which calls sampler_start and
+ * runs the KoalaState), the signal handler walks the CallInfo chain of
+ * KoalaState and counts the stack of function names in a fixed table, so it
+ * does not allocate memory or take locks, and a tick costs the depth of
+ * stack only. The signal is sent to that thread only, not to gc workers. It's cheap enough to be enabled at a low
+ * rate(e.g. 19Hz) in production.
+ *
+ * The samples are written as folded stacks, one stack per line:
+ *
+ *     main;fib;fib 12
+ *
+ * which is the input of flamegraph.pl.
+ */
+
+/* max frames of sample, the outermost frames are dropped */
+#define SAMPLER_MAX_DEPTH 64
+
+/* start sampling ks at hz ticks per second, 0: ok, -1: failed */
+int sampler_start(KoalaState *ks, int hz);
+
+/* stop sampling and write folded stacks to path, return number of samples */
+int sampler_stop(char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _KOALA_SAMPLER_H_ */
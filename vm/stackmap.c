@@ -0,0 +1,109 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#include "stackmap.h"
+#include "gc/gc.h"
+#include "util/mm.h"
+#include "value.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+StackMap *stackmap_new(int count, int nslots)
+{
+    int nwords = (nslots + 31) / 32;
+    StackMap *map =
+        mm_alloc(sizeof(StackMap) + count * (1 + nwords * 2) * sizeof(uint32));
+    map->count = count;
+    map->nwords = nwords;
+    return map;
+}
+
+void stackmap_free(StackMap *map)
+{
+    mm_free(map);
+}
+
+uint32 *stackmap_find(StackMap *map, int offset)
+{
+    int lo = 0;
+    int hi = map->count - 1;
+    int mid;
+    uint32 off;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        off = stackmap_offset(map, mid);
+        if (off == offset) return stackmap_bits(map, mid);
+        if (off < offset)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return nil;
+}
+
+#define has_bit(bits, i) ((bits)[(i) / 32] & (1U << ((i) % 32)))
+
+static uint32 *frame_bits(CallInfo *ci, int nslots)
+{
+    CodeInfo *code = ci->codeinfo;
+    StackMap *map = code ? code->stackmap : nil;
+    int offset = code ? ci->savedpc - code->codes : -1;
+    uint32 *bits = map ? stackmap_find(map, offset) : nil;
+    if (!bits || nslots > map->nwords * 32) {
+        printf("gc-error: no stack map of frame at offset %d\n", offset);
+        abort();
+    }
+    return bits;
+}
+
+/* npushed: the pushed arguments of innermost frame, or 0 */
+static void scan_frame(CallInfo *ci, int npushed, GcVisitFunc visit,
+                       void *ctx)
+{
+    if (!ci->base) return;
+    int nslots = ci->top - ci->base + 1 + npushed;
+    uint32 *refs = frame_bits(ci, nslots);
+    uint32 *anys = refs + ((StackMap *)ci->codeinfo->stackmap)->nwords;
+    StkVal *slot;
+
+    for (int i = 0; i < nslots; i++) {
+        slot = ci->base + i;
+        if (has_bit(refs, i) || (has_bit(anys, i) && val_is_ref(*slot)))
+            visit(ctx, (void **)slot);
+    }
+}
+
+static void scan_state(void *arg, GcVisitFunc visit, void *ctx)
+{
+    KoalaState *ks = arg;
+    CallInfo *ci = ks->ci;
+    if (!ci || !ks->stack) return;
+
+    /* the arguments of other frames are registers of their callees */
+    scan_frame(ci, ks->top - ci->top, visit, ctx);
+    for (ci = ci->prev; ci; ci = ci->prev) scan_frame(ci, 0, visit, ctx);
+}
+
+void koala_gc_register(KoalaState *ks)
+{
+    for (CallInfo *ci = ks->ci; ci; ci = ci->prev) {
+        if (ci->base) frame_bits(ci, 0);
+    }
+    gc_add_scanner(scan_state, ks);
+}
+
+void koala_gc_unregister(KoalaState *ks)
+{
+    gc_remove_scanner(scan_state, ks);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,75 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#ifndef _KOALA_STACKMAP_H_
+#define _KOALA_STACKMAP_H_
+
+#include "vm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Stack maps of koala functions, which are the gc roots in vm stacks.
+ *
+ * A function is stopped by gc at its safepoints only, which are the calls,
+ * the backward jumps and the instructions boxing numbers, and savedpc of its
+ * CallInfo is the instruction after the call, the target of the jump or the
+ * boxing instruction itself, or the entry before it's run. The verifier
+ * knows the slots there, the registers and then the pushed arguments, and
+ * records two bitmaps per safepoint, keyed on the offset of savedpc: the
+ * references, and the `Any` slots, which are references if their tags say
+ * so. A slot can't be a number on one path and a reference on the other.
+ *
+ * The slots of integers and floats, and the ones not written yet, are not in
+ * the map, so the stale pointers in them are not seen by gc. The jit code
+ * keeps the registers in the stack at safepoints, so its frames are scanned
+ * by the map too, and a frame without map at gc is a fatal error.
+ */
+
+typedef struct _StackMap {
+    /* number of safepoints */
+    int count;
+    /* words of one bitmap */
+    int nwords;
+    /* sorted offsets of safepoints, then bitmaps of them */
+    uint32 data[0];
+} StackMap;
+
+/* new stack map of count safepoints, all bitmaps are empty */
+StackMap *stackmap_new(int count, int nslots);
+
+void stackmap_free(StackMap *map);
+
+/* offset of i-th safepoint */
+#define stackmap_offset(map, i) ((map)->data[i])
+
+/* bitmap of references of i-th safepoint */
+#define stackmap_bits(map, i) \
+    ((map)->data + (map)->count + (i) * (map)->nwords * 2)
+
+/* bitmap of `Any` slots of i-th safepoint */
+#define stackmap_anys(map, i) (stackmap_bits(map, i) + (map)->nwords)
+
+/* bitmap of references at offset, nil if it's not a safepoint */
+uint32 *stackmap_find(StackMap *map, int offset);
+
+/*
+ * Scan the stacks of ks at gc, until it's unregistered. All its frames must
+ * have stack maps, i.e. their code is verified.
+ */
+void koala_gc_register(KoalaState *ks);
+
+void koala_gc_unregister(KoalaState *ks);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _KOALA_STACKMAP_H_ */
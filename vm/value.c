@@ -0,0 +1,176 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#include "value.h"
+#include "opcode.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* tagged int, or boxed if it's out of 49 bits */
+static StkVal new_int(int64 i)
+{
+    if (!val_int_fits(i)) return (StkVal)int_new(i);
+    return val_int(i);
+}
+
+/* tagged or boxed int */
+static inline int val_is_int64(StkVal v)
+{
+    return val_is_int(v) || val_is_bigint(v);
+}
+
+StkVal val_from_raw(int kind, StkVal raw)
+{
+    switch (kind) {
+        case TP_I8_KIND:
+        case TP_I16_KIND:
+        case TP_I32_KIND:
+            return val_int((int32)raw);
+        case TP_I64_KIND:
+            return new_int((int64)raw);
+        case TP_F32_KIND: {
+            float f;
+            memcpy(&f, &raw, sizeof(f));
+            return val_f64(f);
+        }
+        case TP_F64_KIND: {
+            double d;
+            memcpy(&d, &raw, sizeof(d));
+            return val_f64(d);
+        }
+        case TP_BOOL_KIND:
+            return val_bool((int32)raw);
+        case TP_CHAR_KIND:
+            return val_char((int32)raw);
+        case TP_REF_KIND:
+            return raw;
+        default:
+            printf("panic: invalid type kind %d\n", kind);
+            abort();
+    }
+}
+
+static int val_is_kind(int kind, StkVal v)
+{
+    switch (kind) {
+        case TP_I8_KIND:
+        case TP_I16_KIND:
+        case TP_I32_KIND:
+            return val_is_int(v);
+        case TP_I64_KIND:
+            return val_is_int64(v);
+        case TP_F32_KIND:
+        case TP_F64_KIND:
+            return val_is_f64(v);
+        case TP_BOOL_KIND:
+            return val_is_bool(v);
+        case TP_CHAR_KIND:
+            return val_is_char(v);
+        case TP_REF_KIND:
+            return val_is_ref(v);
+        default:
+            return 0;
+    }
+}
+
+StkVal val_to_raw(int kind, StkVal v)
+{
+    if (!val_is_kind(kind, v)) {
+        printf("panic: Any value %lx is not type kind %d\n", v, kind);
+        abort();
+    }
+
+    StkVal raw = 0;
+    switch (kind) {
+        case TP_I8_KIND:
+        case TP_I16_KIND:
+        case TP_I32_KIND:
+        case TP_BOOL_KIND:
+        case TP_CHAR_KIND: {
+            /* i32 in stack */
+            int32 i = kind == TP_BOOL_KIND   ? val_get_bool(v)
+                      : kind == TP_CHAR_KIND ? val_get_char(v)
+                                             : (int32)val_get_int(v);
+            memcpy(&raw, &i, sizeof(i));
+            return raw;
+        }
+        case TP_I64_KIND:
+            return (StkVal)val_get_int64(v);
+        case TP_F32_KIND: {
+            float f = (float)val_get_f64(v);
+            memcpy(&raw, &f, sizeof(f));
+            return raw;
+        }
+        case TP_F64_KIND: {
+            double d = val_get_f64(v);
+            memcpy(&raw, &d, sizeof(d));
+            return raw;
+        }
+        default:
+            return v;
+    }
+}
+
+static inline int32 cmp_f64(double x, double y)
+{
+    return x > y ? 1 : (x < y ? -1 : 0);
+}
+
+StkVal val_arith(int op, StkVal a, StkVal b)
+{
+    if (val_both_int(a, b) || (val_is_int64(a) && val_is_int64(b))) {
+        int64 x = val_get_int64(a);
+        int64 y = val_get_int64(b);
+        switch (op) {
+            /* i64 wraps around */
+            case OP_ADD:
+                return new_int((int64)((uint64)x + (uint64)y));
+            case OP_SUB:
+                return new_int((int64)((uint64)x - (uint64)y));
+            case OP_MUL:
+                return new_int((int64)((uint64)x * (uint64)y));
+            case OP_DIV:
+                if (!y) {
+                    printf("panic: divided by zero\n");
+                    abort();
+                }
+                if (y == -1) return new_int((int64)(0 - (uint64)x));
+                return new_int(x / y);
+            default:
+                return (StkVal)(uint32)(x > y ? 1 : (x < y ? -1 : 0));
+        }
+    }
+
+    if ((!val_is_number(a) && !val_is_bigint(a)) ||
+        (!val_is_number(b) && !val_is_bigint(b))) {
+        printf("panic: unsupported operand type\n");
+        abort();
+    }
+
+    /* int and double are double */
+    double x = val_to_f64(a);
+    double y = val_to_f64(b);
+    switch (op) {
+        case OP_ADD:
+            return val_f64(x + y);
+        case OP_SUB:
+            return val_f64(x - y);
+        case OP_MUL:
+            return val_f64(x * y);
+        case OP_DIV:
+            return val_f64(x / y);
+        default:
+            return (StkVal)(uint32)cmp_f64(x, y);
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
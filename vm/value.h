@@ -0,0 +1,144 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#ifndef _KOALA_VALUE_H_
+#define _KOALA_VALUE_H_
+
+#include "vm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Tagged value of `Any` slot, which is one StkVal.
+ *
+ *   ref:    0000:pppp:pppp:pppp  raw pointer, nil is 0
+ *   bool:   0000:0000:0000:0006  false, 0x7 is true
+ *   char:   0000:0000:cccc:ccca  code point << 4 | 0xA
+ *   double: 0002:xxxx:xxxx:xxxx
+ *           ...                  bits of double + (1 << 49)
+ *           FFFA:xxxx:xxxx:xxxx
+ *   int:    FFFE:iiii:iiii:iiii  49 bits signed integer
+ *   Int:    0000:pppp:pppp:pppp  boxed integer out of 49 bits, see int_new
+ *
+ * The references are not changed, so the gc sees them as they are. All
+ * numbers have some of the high 15 bits set, and the ints have all of them,
+ * so the type test is one mask. i8, i16 and i32 are ints, and f32 is
+ * widened to double exactly.
+ */
+
+/* clang-format off */
+
+#define VAL_NUMBER_TAG    0xFFFE000000000000UL
+#define VAL_OTHER_TAG     0x2UL
+#define VAL_DOUBLE_OFFSET 0x0002000000000000UL
+#define VAL_FALSE         0x6UL
+#define VAL_TRUE          0x7UL
+#define VAL_CHAR_TAG      0xAUL
+#define VAL_CHAR_MASK     (VAL_NUMBER_TAG | 0xFUL)
+#define VAL_NIL           0UL
+
+#define val_is_number(v)  (((v) & VAL_NUMBER_TAG) != 0)
+#define val_is_int(v)     (((v) & VAL_NUMBER_TAG) == VAL_NUMBER_TAG)
+#define val_is_f64(v)     (val_is_number(v) && !val_is_int(v))
+#define val_is_ref(v)     (((v) & (VAL_NUMBER_TAG | VAL_OTHER_TAG)) == 0)
+#define val_is_bool(v)    (((v) & ~1UL) == VAL_FALSE)
+#define val_is_char(v)    (((v) & VAL_CHAR_MASK) == VAL_CHAR_TAG)
+
+/* both are ints */
+#define val_both_int(a, b) (((a) & (b) & VAL_NUMBER_TAG) == VAL_NUMBER_TAG)
+
+/* boxed integer, it's a reference */
+#define val_is_bigint(v)  (val_is_ref(v) && int_check((objref)(v)))
+
+/* clang-format on */
+
+/* the int is in 49 bits */
+static inline int val_int_fits(int64 i)
+{
+    return i == (int64)((uint64)i << 15) >> 15;
+}
+
+static inline StkVal val_int(int64 i)
+{
+    return VAL_NUMBER_TAG | ((uint64)i & ~VAL_NUMBER_TAG);
+}
+
+static inline int64 val_get_int(StkVal v)
+{
+    return (int64)((uint64)v << 15) >> 15;
+}
+
+static inline StkVal val_f64(double d)
+{
+    uint64 bits;
+    /* one NaN, the others overlap with ints */
+    if (d != d) d = __builtin_nan("");
+    memcpy(&bits, &d, sizeof(bits));
+    return bits + VAL_DOUBLE_OFFSET;
+}
+
+static inline double val_get_f64(StkVal v)
+{
+    uint64 bits = v - VAL_DOUBLE_OFFSET;
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+/* tagged or boxed int, it's int64 */
+static inline int64 val_get_int64(StkVal v)
+{
+    return val_is_int(v) ? val_get_int(v) : int_get((objref)v);
+}
+
+/* int or double as double */
+static inline double val_to_f64(StkVal v)
+{
+    if (val_is_f64(v)) return val_get_f64(v);
+    return (double)val_get_int64(v);
+}
+
+static inline StkVal val_bool(int b)
+{
+    return b ? VAL_TRUE : VAL_FALSE;
+}
+
+static inline int val_get_bool(StkVal v)
+{
+    return v & 1;
+}
+
+static inline StkVal val_char(int32 ch)
+{
+    return ((StkVal)(uint32)ch << 4) | VAL_CHAR_TAG;
+}
+
+static inline int32 val_get_char(StkVal v)
+{
+    return (int32)(v >> 4);
+}
+
+/* tag the raw value of TP_*_KIND, see OP_TO_ANY, i64 may be boxed */
+StkVal val_from_raw(int kind, StkVal raw);
+
+/* untag to the raw value of TP_*_KIND, see OP_FROM_ANY */
+StkVal val_to_raw(int kind, StkVal v);
+
+/*
+ * OP_ADD, OP_SUB, OP_MUL, OP_DIV and OP_CMP of numbers, see OP_ANY_ADD
+ * The ints are i64, which are boxed if they're out of tagged int.
+ */
+StkVal val_arith(int op, StkVal a, StkVal b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _KOALA_VALUE_H_ */
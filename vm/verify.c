@@ -0,0 +1,552 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#include "verify.h"
+#include "opcode.h"
+#include "stackmap.h"
+#include "util/mm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* abstract values of register */
+#define V_I32   1
+#define V_REF   2
+#define V_ANY   3
+/* i64, f32 or f64, which is not tagged */
+#define V_RAW   4
+/* flag, the register is not written on some path */
+#define V_UNSET 8
+#define V_UNDEF V_UNSET
+
+#define V_KIND(val) ((val) & ~V_UNSET)
+
+/* the register may hold a reference */
+#define V_MAYBE_REF(val) ((val) == V_REF || (val) == V_ANY)
+
+/* abstract value of type kind, 0 is Any */
+static uint8 kind_value(int kind)
+{
+    switch (kind) {
+        case 0:
+            return V_ANY;
+        case TP_REF_KIND:
+            return V_REF;
+        case TP_I64_KIND:
+        case TP_F32_KIND:
+        case TP_F64_KIND:
+            return V_RAW;
+        default:
+            return V_I32;
+    }
+}
+
+/* max type parameters in tp_map */
+#define MAX_TP_INDEX 8
+
+typedef struct _Verifier {
+    CodeInfo *code;
+    int nregs;
+    /* registers, then the pushed arguments */
+    int nslots;
+    int ninsns;
+    /* instruction index of offset, -1 if it's not instruction boundary */
+    int *index;
+    /* offset of instruction */
+    int *offsets;
+    /* abstract slots before instruction */
+    uint8 *regs;
+    /* pushed arguments before instruction, -1 if it's not visited */
+    int *pushed;
+    /* instructions to be visited */
+    int *worklist;
+    int nwork;
+    /* abstract state of current instruction */
+    uint8 *cur;
+    int cur_pushed;
+} Verifier;
+
+static int error(int offset, char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    printf("verify-error: offset %d, ", offset);
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+    return -1;
+}
+
+/* 1 if it's a jump, and target is relative to the instruction */
+static int jump_target(uint8 *pc, int *target)
+{
+    char *fmt = opcode_format(pc[0]);
+    int off = 1;
+    int16 offset;
+    while (*fmt) {
+        if (*fmt == 'j') {
+            memcpy(&offset, pc + off, 2);
+            *target = opcode_length(pc[0]) + offset;
+            return 1;
+        }
+        off += (*fmt == 'x') ? 2 : 1;
+        ++fmt;
+    }
+    return 0;
+}
+
+/* decode instructions and check the operands */
+static int decode(Verifier *v)
+{
+    CodeInfo *code = v->code;
+    uint8 *codes = code->codes;
+    int size = code->size;
+    char *fmt;
+    int off = 0;
+    int len;
+
+    for (int i = 0; i < size; i++) v->index[i] = -1;
+
+    while (off < size) {
+        len = opcode_length(codes[off]);
+        if (len < 0) return error(off, "unknown opcode %d", codes[off]);
+        if (off + len > size) return error(off, "truncated instruction");
+        v->index[off] = v->ninsns;
+        v->offsets[v->ninsns++] = off;
+        if (codes[off] == OP_PUSH || codes[off] == OP_PUSH_I32_SUBK)
+            ++v->nslots;
+        off += len;
+    }
+
+    uint8 *pc;
+    int target;
+    for (int i = 0; i < v->ninsns; i++) {
+        off = v->offsets[i];
+        pc = codes + off;
+        fmt = opcode_format(pc[0]);
+        for (int k = 1; *fmt; fmt++) {
+            if (*fmt == 'r' && pc[k] >= v->nregs)
+                return error(off, "register %d out of frame(%d)", pc[k],
+                             v->nregs);
+            if (*fmt == 't' && pc[k] >= MAX_TP_INDEX)
+                return error(off, "type parameter %d out of tp_map", pc[k]);
+            if (*fmt == 'n' && (int8)pc[k] < 0)
+                return error(off, "negative argc %d", (int8)pc[k]);
+            k += (*fmt == 'j' || *fmt == 'x') ? 2 : 1;
+        }
+
+        if (!jump_target(pc, &target)) continue;
+        target += off;
+        if (target < 0 || target >= size || v->index[target] < 0)
+            return error(off, "invalid jump target %d", target);
+    }
+
+    return 0;
+}
+
+/*
+ * Merged value of two paths, -1 if it's a number on one path and a reference
+ * on the other, so gc knows if a slot is a root without testing its bits.
+ */
+static inline int merge_value(uint8 a, uint8 b)
+{
+    int unset = (a | b) & V_UNSET;
+    a = V_KIND(a);
+    b = V_KIND(b);
+    if (!a || a == b) return b | unset;
+    if (!b) return a | unset;
+    /* i32 and raw numbers are not references */
+    if (!V_MAYBE_REF(a) && !V_MAYBE_REF(b)) return V_RAW | unset;
+    /* a reference is an Any too */
+    if (V_MAYBE_REF(a) && V_MAYBE_REF(b)) return V_ANY | unset;
+    return -1;
+}
+
+static int merge_error(int off, int slot, int nregs)
+{
+    if (slot < nregs)
+        return error(off, "register %d is number or reference on other path",
+                     slot);
+    return error(off, "argument %d is number or reference on other path",
+                 slot - nregs);
+}
+
+/* merge current state into the instruction at offset */
+static int merge(Verifier *v, int from, int off)
+{
+    if (off >= v->code->size)
+        return error(from, "falls off the end of function");
+
+    int idx = v->index[off];
+    uint8 *regs = v->regs + idx * v->nslots;
+
+    if (v->pushed[idx] < 0) {
+        memcpy(regs, v->cur, v->nslots);
+        v->pushed[idx] = v->cur_pushed;
+        v->worklist[v->nwork++] = idx;
+        return 0;
+    }
+
+    if (v->pushed[idx] != v->cur_pushed)
+        return error(off, "pushed %d arguments, but %d on other path",
+                     v->cur_pushed, v->pushed[idx]);
+
+    int changed = 0;
+    int val;
+    for (int i = 0; i < v->nslots; i++) {
+        val = merge_value(regs[i], v->cur[i]);
+        if (val < 0) return merge_error(off, i, v->nregs);
+        if (val != regs[i]) {
+            regs[i] = val;
+            changed = 1;
+        }
+    }
+
+    /* it's in worklist, if it's changed, and it's not visited again */
+    if (changed) {
+        int i;
+        for (i = 0; i < v->nwork; i++) {
+            if (v->worklist[i] == idx) break;
+        }
+        if (i >= v->nwork) v->worklist[v->nwork++] = idx;
+    }
+    return 0;
+}
+
+static int read_reg(Verifier *v, int off, int reg, int i32)
+{
+    uint8 val = v->cur[reg];
+    if (val & V_UNSET)
+        return error(off, "register %d is read before written", reg);
+    if (i32 && val == V_REF)
+        return error(off, "register %d is not i32", reg);
+    return 0;
+}
+
+static int call_args(Verifier *v, int off, int argc)
+{
+    if (v->cur_pushed != argc)
+        return error(off, "pushed %d arguments, but argc is %d",
+                     v->cur_pushed, argc);
+    /* the arguments are registers of callee */
+    memset(v->cur + v->nregs, V_UNDEF, argc);
+    v->cur_pushed = 0;
+    return 0;
+}
+
+/* the pushed arguments are slots after registers */
+static int push_arg(Verifier *v, int off, uint8 val)
+{
+    int slot = v->nregs + v->cur_pushed;
+    if (slot >= v->nslots) return error(off, "too many pushed arguments");
+    v->cur[slot] = val;
+    ++v->cur_pushed;
+    return 0;
+}
+
+/* clang-format off */
+
+#define READ(reg, i32) if (read_reg(v, off, reg, i32)) return -1
+#define WRITE(reg, val) v->cur[reg] = (val)
+#define PUSH(val) if (push_arg(v, off, val)) return -1
+
+/* clang-format on */
+
+/* simulate the instruction, 1: it has next instruction */
+static int transfer(Verifier *v, int off)
+{
+    uint8 *pc = v->code->codes + off;
+    switch (pc[0]) {
+        case OP_MOVE:
+            READ(pc[2], 0);
+            WRITE(pc[1], v->cur[pc[2]]);
+            return 1;
+        case OP_NIL:
+            WRITE(pc[1], V_REF);
+            return 1;
+        case OP_I8K:
+            WRITE(pc[1], V_I32);
+            return 1;
+        case OP_I32_ADD:
+            READ(pc[2], 1);
+            READ(pc[3], 1);
+            WRITE(pc[1], V_I32);
+            return 1;
+        case OP_I32_ADDK:
+        case OP_I32_SUBK:
+        case OP_I32_CMPK:
+            READ(pc[2], 1);
+            WRITE(pc[1], V_I32);
+            return 1;
+        case OP_I32_JMP_CMPKGT:
+        case OP_JGT:
+            READ(pc[1], 1);
+            return 1;
+        case OP_RET:
+            if (v->cur_pushed)
+                return error(off, "%d pushed arguments are not called",
+                             v->cur_pushed);
+            return 0;
+        case OP_CALL:
+            if (call_args(v, off, (int8)pc[1])) return -1;
+            return 1;
+        case OP_CALL_METHOD:
+            if (!pc[1]) return error(off, "method call without receiver");
+            if (call_args(v, off, (int8)pc[1])) return -1;
+            return 1;
+        case OP_TAIL_CALL:
+            if (call_args(v, off, (int8)pc[1])) return -1;
+            return 0;
+        case OP_PUSH:
+            READ(pc[1], 0);
+            PUSH(v->cur[pc[1]]);
+            return 1;
+        case OP_PUSH_I32_SUBK:
+            READ(pc[1], 1);
+            PUSH(V_I32);
+            return 1;
+        case OP_SAVE_RET:
+            WRITE(pc[1], V_ANY);
+            return 1;
+        case OP_I32_ADD_RET:
+            READ(pc[2], 1);
+            WRITE(pc[1], V_I32);
+            return 1;
+        case OP_TO_ANY: {
+            READ(pc[2], 0);
+            int kind = pc[3];
+            if (kind < TP_I8_KIND || kind > TP_REF_KIND)
+                return error(off, "invalid type kind %d", kind);
+            /* the source is boxed by kind, so it must be of kind */
+            if (v->cur[pc[2]] != kind_value(kind))
+                return error(off, "register %d is not of kind %d", pc[2],
+                             kind);
+            WRITE(pc[1], V_ANY);
+            return 1;
+        }
+        case OP_FROM_ANY: {
+            READ(pc[2], 0);
+            int kind = pc[3];
+            if (kind < TP_I8_KIND || kind > TP_REF_KIND)
+                return error(off, "invalid type kind %d", kind);
+            if (!V_MAYBE_REF(v->cur[pc[2]]))
+                return error(off, "register %d is not Any", pc[2]);
+            WRITE(pc[1], kind_value(kind));
+            return 1;
+        }
+        case OP_ANY_ADD:
+        case OP_ANY_SUB:
+        case OP_ANY_MUL:
+        case OP_ANY_DIV:
+        case OP_ANY_CMP:
+            READ(pc[2], 0);
+            READ(pc[3], 0);
+            WRITE(pc[1], pc[0] == OP_ANY_CMP ? V_I32 : V_ANY);
+            return 1;
+        default: {
+            /* generic and quickened instructions */
+            assert(pc[0] >= OP_ADD && pc[0] <= OP_CMP_F64);
+            int op = pc[0] < OP_ADD_I32 ? pc[0] : OP_GENERIC(pc[0]);
+            READ(pc[2], 0);
+            READ(pc[3], 0);
+            /* the operands are numbers of tp_map, not tagged */
+            WRITE(pc[1], op == OP_CMP ? V_I32 : V_RAW);
+            return 1;
+        }
+    }
+}
+
+/* visit all reachable instructions until the states are not changed */
+static int dataflow(Verifier *v, int argc, uint8 *kinds)
+{
+    int nslots = v->nslots;
+    for (int i = 0; i < v->ninsns; i++) v->pushed[i] = -1;
+
+    /* entry, arguments are of their kinds */
+    for (int i = 0; i < nslots; i++) {
+        if (i >= argc)
+            v->cur[i] = V_UNDEF;
+        else
+            v->cur[i] = kind_value(kinds ? kinds[i] : 0);
+    }
+    v->cur_pushed = 0;
+    if (merge(v, 0, 0)) return -1;
+
+    int idx, off, next, target;
+    while (v->nwork > 0) {
+        idx = v->worklist[--v->nwork];
+        off = v->offsets[idx];
+        memcpy(v->cur, v->regs + idx * nslots, nslots);
+        v->cur_pushed = v->pushed[idx];
+
+        next = transfer(v, off);
+        if (next < 0) return -1;
+
+        if (jump_target(v->code->codes + off, &target) &&
+            merge(v, off, off + target))
+            return -1;
+
+        if (next) {
+            next = off + opcode_length(v->code->codes[off]);
+            if (merge(v, off, next)) return -1;
+        }
+    }
+    return 0;
+}
+
+/* safepoint of instruction, its savedpc at gc, -1 if it's not */
+static int safepoint(Verifier *v, int off)
+{
+    uint8 *pc = v->code->codes + off;
+    switch (pc[0]) {
+        /* it may box number, before it writes the register */
+        case OP_TO_ANY:
+        case OP_ANY_ADD:
+        case OP_ANY_SUB:
+        case OP_ANY_MUL:
+        case OP_ANY_DIV:
+            return off;
+        case OP_CALL:
+        case OP_CALL_METHOD:
+        case OP_TAIL_CALL:
+            return off + opcode_length(pc[0]);
+        case OP_JGT:
+        case OP_I32_JMP_CMPKGT: {
+            int target;
+            if (!jump_target(pc, &target)) return -1;
+            /* the negative offset, a jump to itself is backward too */
+            return target <= 0 ? off + target : -1;
+        }
+        default:
+            return -1;
+    }
+}
+
+static int cmp_offset(const void *a, const void *b)
+{
+    return *(int *)a - *(int *)b;
+}
+
+/* merge the slots of instruction into its safepoint */
+static int merge_point(Verifier *v, uint8 *state, int *set, int idx)
+{
+    uint8 *regs = v->regs + idx * v->nslots;
+    if (!*set) {
+        memcpy(state, regs, v->nslots);
+        *set = 1;
+        return 0;
+    }
+
+    int val;
+    for (int i = 0; i < v->nslots; i++) {
+        val = merge_value(state[i], regs[i]);
+        if (val < 0) return merge_error(v->offsets[idx], i, v->nregs);
+        state[i] = val;
+    }
+    return 0;
+}
+
+/*
+ * References and Anys at safepoints and at entry. A call does not change
+ * registers until it's returned, so the slots of a safepoint are merged from
+ * the instructions stopped there.
+ */
+static int build_stackmap(Verifier *v)
+{
+    CodeInfo *code = v->code;
+    int nslots = v->nslots;
+    int *points = v->worklist;
+    int count = 0;
+    int point, k;
+
+    /* the worklist is empty, reuse it for the sorted offsets */
+    points[count++] = 0;
+    for (int i = 0; i < v->ninsns; i++) {
+        if (v->pushed[i] < 0) continue;
+        point = safepoint(v, v->offsets[i]);
+        if (point > 0) points[count++] = point;
+    }
+    qsort(points, count, sizeof(int), cmp_offset);
+    for (int i = k = 1; i < count; i++) {
+        if (points[i] != points[k - 1]) points[k++] = points[i];
+    }
+    count = k;
+
+    uint8 *states = mm_alloc(count * nslots + 1);
+    int *set = mm_alloc(count * sizeof(int));
+    int *p;
+    int ret = merge_point(v, states, set, 0);
+    for (int i = 0; i < v->ninsns && !ret; i++) {
+        if (v->pushed[i] < 0) continue;
+        point = safepoint(v, v->offsets[i]);
+        if (point < 0) continue;
+        p = bsearch(&point, points, count, sizeof(int), cmp_offset);
+        k = p - points;
+        ret = merge_point(v, states + k * nslots, set + k, i);
+    }
+
+    if (!ret) {
+        if (code->stackmap) stackmap_free(code->stackmap);
+        StackMap *map = stackmap_new(count, nslots);
+        uint8 *state;
+        uint32 *refs, *anys;
+        for (int i = 0; i < count; i++) {
+            stackmap_offset(map, i) = points[i];
+            state = states + i * nslots;
+            refs = stackmap_bits(map, i);
+            anys = stackmap_anys(map, i);
+            for (k = 0; k < nslots; k++) {
+                if (state[k] == V_REF) refs[k / 32] |= 1U << (k % 32);
+                if (state[k] == V_ANY) anys[k / 32] |= 1U << (k % 32);
+            }
+        }
+        code->stackmap = map;
+    }
+
+    mm_free(states);
+    mm_free(set);
+    return ret;
+}
+
+int verify_code(CodeInfo *code, int argc, uint8 *kinds)
+{
+    if (!code->size) return error(0, "empty function");
+
+    int nregs = code->stacksize;
+    if (argc < 0 || argc > nregs)
+        return error(0, "%d arguments out of frame(%d)", argc, nregs);
+
+    int size = code->size;
+    Verifier v = { .code = code, .nregs = nregs, .nslots = nregs };
+    v.index = mm_alloc(size * sizeof(int));
+    v.offsets = mm_alloc(size * sizeof(int));
+    v.pushed = mm_alloc(size * sizeof(int));
+    /* and the entry of stack map */
+    v.worklist = mm_alloc((size + 1) * sizeof(int));
+
+    int ret = decode(&v);
+    if (!ret) {
+        v.cur = mm_alloc(v.nslots + 1);
+        v.regs = mm_alloc(v.ninsns * v.nslots + 1);
+        ret = dataflow(&v, argc, kinds);
+        if (!ret) ret = build_stackmap(&v);
+        mm_free(v.regs);
+        mm_free(v.cur);
+    }
+
+    mm_free(v.index);
+    mm_free(v.offsets);
+    mm_free(v.pushed);
+    mm_free(v.worklist);
+    return ret;
+}
+
+#ifdef __cplusplus
+}
+#endif
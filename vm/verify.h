@@ -0,0 +1,49 @@
+/*===----------------------------------------------------------------------===*\
+|*                                                                            *|
+|* This file is part of the koala-lang project, under the MIT License.        *|
+|*                                                                            *|
+|* Copyright (c) 2018-2021 James <zhuguangxiang@gmail.com>                    *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#ifndef _KOALA_VERIFY_H_
+#define _KOALA_VERIFY_H_
+
+#include "vm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bytecode verifier, which is run once when a function is loaded.
+ *
+ * The static checks are:
+ *   - instruction is known and is not truncated,
+ *   - register index is less than stacksize,
+ *   - jump target is at instruction boundary,
+ *   - type parameter index is in tp_map.
+ *
+ * The data flow checks, on all paths, are:
+ *   - register is written before it is read,
+ *   - register of i32 instruction is not a reference,
+ *   - register is not a number on one path and a reference on the other,
+ *   - source of OP_TO_ANY is of its kind, and source of OP_FROM_ANY is Any,
+ *   - number of pushed arguments is argc of call,
+ *   - the function does not fall off its end.
+ *
+ * The interpreter does not check them any more, so the untrusted code must
+ * be verified before it is executed.
+ */
+
+/*
+ * argc: number of arguments, which are in R(0) ... R(argc - 1)
+ * kinds: type kinds(TP_XXX_KIND) of arguments, 0 is Any, nil if all are Any
+ */
+int verify_code(CodeInfo *code, int argc, uint8 *kinds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _KOALA_VERIFY_H_ */
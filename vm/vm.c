@@ -7,7 +7,15 @@
 \*===----------------------------------------------------------------------===*/
 
 #include "vm.h"
+#include "core/core.h"
+#include "coroutine.h"
+#include "ffi.h"
+#include "jit.h"
 #include "opcode.h"
+#include "perf.h"
+#include "profile.h"
+#include "value.h"
+#include "gc/gc.h"
 #include "util/mm.h"
 
 #ifdef __cplusplus
@@ -25,26 +33,388 @@ extern "C" {
 #define SET_STK_I32(reg, val) *(int32 *)(ci->base + reg) = (val)
 #define GET_STK_I32(reg) *(int32 *)(ci->base + reg)
 
+#define SET_STK(T, reg, val) *(T *)(ci->base + reg) = (val)
+#define GET_STK(T, reg) *(T *)(ci->base + reg)
+
 #define MOVE(ra, rb) ci->base[ra] = ci->base[rb]
 #define PUSH(ra) *++ks->top = ci->base[ra]
 #define SAVE_RET(ra) ci->base[ra] = *(ci->top + 1)
 
+/* yield point of coroutine, and safepoint of gc */
+#define YIELD_POINT(ks) ({ CO_YIELD_POINT(ks); gc_safepoint(); })
+
 #define GET_RET_I32() *(int32 *)(ci->top + 1)
 
 #define STK_NIL(ra) ci->base[ra] = (StkVal)nil
 
+#define CMP(v1, v2) ((v1) > (v2) ? 1 : ((v1) < (v2) ? -1 : 0))
+
+/* R(A) = R(B) op R(C), the values are T */
+#define ARITH(T, op, ra, rb, rc) ({                         \
+    T v1 = GET_STK(T, rb);                                  \
+    T v2 = GET_STK(T, rc);                                  \
+    switch (op) {                                           \
+        case OP_ADD: SET_STK(T, ra, v1 + v2); break;        \
+        case OP_SUB: SET_STK(T, ra, v1 - v2); break;        \
+        case OP_MUL: SET_STK(T, ra, v1 * v2); break;        \
+        case OP_DIV: SET_STK(T, ra, v1 / v2); break;        \
+        case OP_CMP: SET_STK_I32(ra, CMP(v1, v2)); break;   \
+        default: assert(0); break;                          \
+    }                                                       \
+})
+
+/* clang-format on */
+
+/*
+ * The quickened instruction index, see OP_QUICKEN.
+ * i8, i16, bool and char are i32 in stack.
+ */
+static inline int quicken_index(int kind)
+{
+    switch (kind) {
+        case TP_I8_KIND:
+        case TP_I16_KIND:
+        case TP_I32_KIND:
+        case TP_BOOL_KIND:
+        case TP_CHAR_KIND:
+            return 0;
+        case TP_I64_KIND:
+            return 1;
+        case TP_F32_KIND:
+            return 2;
+        case TP_F64_KIND:
+            return 3;
+        default:
+            return -1;
+    }
+}
+
+static void generic_arith(CallInfo *ci, int op, int idx, int ra, int rb, int rc)
+{
+    switch (idx) {
+        case 0: {
+            if (op == OP_DIV && !GET_STK_I32(rc)) {
+                printf("panic: divided by zero\n");
+                abort();
+            }
+            ARITH(int32, op, ra, rb, rc);
+            break;
+        }
+        case 1: {
+            if (op == OP_DIV && !GET_STK(int64, rc)) {
+                printf("panic: divided by zero\n");
+                abort();
+            }
+            ARITH(int64, op, ra, rb, rc);
+            break;
+        }
+        case 2:
+            ARITH(float, op, ra, rb, rc);
+            break;
+        case 3:
+            ARITH(double, op, ra, rb, rc);
+            break;
+        default:
+            printf("panic: unsupported operand type\n");
+            abort();
+            break;
+    }
+}
+
+/* clang-format off */
+
+/*
+ * The specialized instruction, if type parameter is changed,
+ * rewrite it back to generic one and execute it again.
+ */
+#define CASE_QUICKENED(opcode, idx, T, op)                          \
+    case opcode: {                                                  \
+        ra = NEXT_REG();                                            \
+        rb = NEXT_REG();                                            \
+        rc = NEXT_REG();                                            \
+        uint8 tp = NEXT_REG();                                      \
+        ++pc;                                                       \
+        if (quicken_index(tp_index(ci->tp_map, tp)) != (idx)) {     \
+            pc -= 6;                                                \
+            pc[0] = OP_GENERIC(opcode);                             \
+            pc[5] = 0;                                              \
+            break;                                                  \
+        }                                                           \
+        if ((op) == OP_DIV && (idx) < 2 && !GET_STK(T, rc)) {       \
+            printf("panic: divided by zero\n");                     \
+            abort();                                                \
+        }                                                           \
+        ARITH(T, op, ra, rb, rc);                                   \
+        break;                                                      \
+    }
+
+#define CASE_QUICKENED_ALL(op)                          \
+    CASE_QUICKENED(OP_QUICKEN(op, 0), 0, int32, op)     \
+    CASE_QUICKENED(OP_QUICKEN(op, 1), 1, int64, op)     \
+    CASE_QUICKENED(OP_QUICKEN(op, 2), 2, float, op)     \
+    CASE_QUICKENED(OP_QUICKEN(op, 3), 3, double, op)
+
+/* clang-format on */
+
+/* the registers of frame at base must be in the value stack */
+static inline void check_stack(KoalaState *ks, StkVal *base, int stacksize)
+{
+    if (base + stacksize > ks->stack_end) {
+        printf("panic: stack overflow\n");
+        abort();
+    }
+}
+
+static inline CallInfo *next_callinfo(KoalaState *ks, CallInfo *ci,
+                                      int stacksize)
+{
+    check_stack(ks, ci->top + 1, stacksize);
+    CallInfo *_ci = ci->next;
+    if (!_ci) {
+        // printf("new callinfo\n");
+        _ci = mm_alloc_obj(_ci);
+    } else {
+        // printf("use exist callinfo\n");
+    }
+    _ci->base = ci->top + 1;
+    _ci->top = _ci->base + stacksize - 1;
+    ks->top = _ci->top;
+    _ci->prev = ci;
+    ci->next = _ci;
+    ks->ci = _ci;
+    ++ks->nci;
+    return _ci;
+}
+
+static inline void init_callinfo(CallInfo *ci, CodeInfo *code)
+{
+    ci->codeinfo = code;
+    ci->code = code->codes;
+    ci->savedpc = ci->code;
+    ci->icache = code->icache;
+    ci->relinfo = code->relinfo;
+    ci->tp_map = 0;
+}
+
+/* interpret the new frame, by its trampoline if perf is enabled */
+static inline void interpret(KoalaState *ks, CallInfo *ci)
+{
+    CodeInfo *code = ci->codeinfo;
+    if (!code->trampoline && (perf_flags() & PERF_TRAMPOLINE))
+        code->trampoline = perf_trampoline(code);
+
+    if (code->trampoline)
+        ((void (*)(KoalaState *, CallInfo *))code->trampoline)(ks, ci);
+    else
+        koala_execute(ks, ci);
+}
+
+/*
+ * Claim the next tier of function, so it's compiled by one thread, and the
+ * other threads run its current code.
+ */
+static int claim_tier(CodeInfo *code, uint32 tier, uint32 next)
+{
+    return __atomic_compare_exchange_n(&code->tier, &tier, next, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/*
+ * Count a call of function, and compile it if it's hot. The counter is not
+ * locked, a lost call of another thread only delays the compile.
+ */
+static void count_call(CodeInfo *code)
+{
+    uint32 calls = __atomic_load_n(&code->calls, __ATOMIC_RELAXED) + 1;
+    __atomic_store_n(&code->calls, calls, __ATOMIC_RELAXED);
+    uint32 tier = __atomic_load_n(&code->tier, __ATOMIC_RELAXED);
+    if (tier == JIT_TIER_NONE && calls >= JIT_THRESHOLD) {
+        if (claim_tier(code, tier, JIT_TIER_BASELINE)) jit_compile(code);
+    } else if (tier == JIT_TIER_BASELINE && calls >= JIT_OPT_THRESHOLD) {
+        if (claim_tier(code, tier, JIT_TIER_OPT)) jit_opt_compile(code);
+    }
+}
+
+/*
+ * Run the frame by native code of function, 1 if it's returned, or 0 if it
+ * has no native code or is deoptimized, and it's resumed at ci->savedpc by
+ * interpreter.
+ */
+static int run_native(KoalaState *ks, CallInfo *ci)
+{
+    CodeInfo *code = ci->codeinfo;
+    void *opt;
+    JitFunc fn = jit_opt_hold(code, &opt);
+    if (!fn) return 0;
+
+    if (fn(ks, ci)) {
+        /*
+         * Deoptimized, the assumption of native code is broken, so discard
+         * it and profile again. It may be running in outer frames, so it's
+         * freed after they are returned.
+         */
+        jit_opt_discard(code, opt);
+        jit_opt_release(opt);
+        return 0;
+    }
+    jit_opt_release(opt);
+
+    /* the same as OP_RET */
+    ks->ci = ci->prev;
+    ks->top = ci->base - 1;
+    --ks->nci;
+    return 1;
+}
+
+/* execute the new frame, by native code if the function is hot */
+static void execute(KoalaState *ks, CallInfo *ci)
+{
+    count_call(ci->codeinfo);
+    if (!run_native(ks, ci)) interpret(ks, ci);
+}
+
+int koala_tail_calls(CodeInfo *code)
+{
+    uint8 *pc = code->codes;
+    uint8 *end = pc + code->size;
+    int count = 0;
+    int len;
+    while (pc < end) {
+        len = opcode_length(pc[0]);
+        if (len < 0) return count;
+        /*
+         * The callee returns value in R(0), which is R(0) of caller too,
+         * so the following instructions are only used by jumps.
+         */
+        if (pc[0] == OP_CALL && pc + 7 <= end && pc[4] == OP_SAVE_RET &&
+            pc[5] == 0 && pc[6] == OP_RET) {
+            pc[0] = OP_TAIL_CALL;
+            ++count;
+        }
+        pc += len;
+    }
+    return count;
+}
+
+/* inline cache miss, look up method by name and cache it */
+static FuncNode *ic_lookup(InlineCache *ic, VTable *vtbl, objref obj)
+{
+    for (int i = 1; i < ic->count; i++) {
+        if (ic->entries[i].vtbl == vtbl) return ic->entries[i].fn;
+    }
+
+    ++ic->misses;
+    int slot = type_get_func_slot(vtbl->type, ic->name);
+    if (slot < 0) {
+        printf("panic: '%s' has no method '%s'\n", vtbl->type->name, ic->name);
+        abort();
+    }
+    FuncNode *fn = object_get_func(obj, slot);
+
+    if (ic->count < IC_POLY_SIZE) {
+        int i = ic->count++;
+        ic->entries[i].vtbl = vtbl;
+        ic->entries[i].fn = fn;
+        ic->entries[i].slot = slot;
+    }
+    return fn;
+}
+
+void koala_call(KoalaState *ks, CallInfo *ci, uint8 *pc)
+{
+    /* gc finds the stack map of frame by savedpc */
+    ci->savedpc = pc;
+    YIELD_POINT(ks);
+
+    /* argc and index of relocation are before pc */
+    int8 argc = (int8)pc[-3];
+    int16 index = *(int16 *)(pc - 2);
+    FuncNode *fn = (FuncNode *)ci->relinfo[index].addr;
+    if (fn->kind == MNODE_CFUNC_KIND) {
+        ci->top[1] = ffi_call_cfunc(fn, ci->top + 1, argc);
+        ks->top = ci->top;
+        return;
+    }
+
+    CodeInfo *code = (CodeInfo *)fn->ptr;
+    CallInfo *_ci = next_callinfo(ks, ci, code->stacksize);
+    init_callinfo(_ci, code);
+    execute(ks, _ci);
+}
+
+void koala_poll(KoalaState *ks, CallInfo *ci, uint8 *pc)
+{
+    ci->savedpc = pc;
+    if (ks->budget <= 0) {
+        ks->budget = CO_TIME_SLICE;
+        if (ks->co) koala_yield();
+    }
+    gc_safepoint();
+}
+
+/*
+ * On-stack replacement at loop header pc, which is hot. The frame is
+ * continued by baseline code, and 1 is returned if it's returned. If it's
+ * deoptimized, pc is updated to resume.
+ */
+static int osr(KoalaState *ks, CallInfo *ci, uint8 **pc)
+{
+    CodeInfo *code = ci->codeinfo;
+    __atomic_store_n(&code->loops, 0, __ATOMIC_RELAXED);
+    if (claim_tier(code, JIT_TIER_NONE, JIT_TIER_BASELINE)) jit_compile(code);
+
+    JitFunc entry = jit_osr_entry(code, *pc);
+    if (!entry) return 0;
+
+    ci->savedpc = *pc;
+    if (entry(ks, ci)) {
+        *pc = ci->savedpc;
+        return 0;
+    }
+
+    /* the same as OP_RET */
+    ks->ci = ci->prev;
+    ks->top = ci->base - 1;
+    --ks->nci;
+    return 1;
+}
+
+/* the same as the calls, see count_call() */
+static inline int hot_loop(CodeInfo *code)
+{
+    uint32 loops = __atomic_load_n(&code->loops, __ATOMIC_RELAXED) + 1;
+    __atomic_store_n(&code->loops, loops, __ATOMIC_RELAXED);
+    return loops >= JIT_OSR_THRESHOLD;
+}
+
+/* clang-format off */
+
+/* yield point, and replaced by jit code if the loop is hot */
+#define BACKWARD_JUMP() ({                                              \
+    ci->savedpc = pc;                                                   \
+    YIELD_POINT(ks);                                                    \
+    if (ci->codeinfo && hot_loop(ci->codeinfo) && osr(ks, ci, &pc))     \
+        return;                                                         \
+})
+
 /* clang-format on */
 
 #if 1
+/*
+ * The code is verified when it is loaded(see vm/verify.h), so the registers,
+ * jump targets and operand types are not checked here.
+ */
 void koala_execute(KoalaState *ks, CallInfo *ci)
 {
     uint8 op;
     uint8 ra, rb, rc;
     uint8 *pc = ci->savedpc;
+    PROFILE_ENTER(ci->codeinfo);
 
     /* main loop */
     for (;;) {
         op = NEXT_OP();
+        PROFILE_OP(op);
         switch (op) {
             case OP_MOVE: {
                 ra = NEXT_REG();
@@ -103,14 +473,20 @@ void koala_execute(KoalaState *ks, CallInfo *ci)
                 uint8 v2 = (uint8)NEXT_I8();
                 int16 offset = NEXT_I16();
                 int32 res = v1 > v2 ? 1 : (v1 < v2 ? -1 : 0);
-                if (res > 0) pc += offset;
+                if (res > 0) {
+                    pc += offset;
+                    if (offset < 0) BACKWARD_JUMP();
+                }
                 break;
             }
             case OP_JGT: {
                 ra = NEXT_REG();
                 int16 offset = NEXT_I16();
                 int32 v1 = GET_STK_I32(ra);
-                if (v1 > 0) pc += offset;
+                if (v1 > 0) {
+                    pc += offset;
+                    if (offset < 0) BACKWARD_JUMP();
+                }
                 break;
             }
             case OP_RET: {
@@ -147,27 +523,123 @@ void koala_execute(KoalaState *ks, CallInfo *ci)
                 break;
             }
             case OP_CALL: {
-                CallInfo *_ci = ci->next;
-                if (!_ci) {
-                    // printf("new callinfo\n");
-                    _ci = mm_alloc_obj(_ci);
-                } else {
-                    // printf("use exist callinfo\n");
+                pc += 3;
+                koala_call(ks, ci, pc);
+                break;
+            }
+            case OP_TAIL_CALL: {
+                int8 argc = NEXT_I8();
+                int16 index = NEXT_I16();
+                ci->savedpc = pc;
+                YIELD_POINT(ks);
+                FuncNode *fn = (FuncNode *)ci->relinfo[index].addr;
+                if (fn->kind == MNODE_CFUNC_KIND) {
+                    ci->base[0] = ffi_call_cfunc(fn, ci->top + 1, argc);
+                    ks->ci = ci->prev;
+                    ks->top = ci->base - 1;
+                    --ks->nci;
+                    return;
                 }
-                _ci->base = ci->top + 1;
-                _ci->top = _ci->base + 2;
-                ks->top = _ci->top;
-                _ci->prev = ci;
-                ci->next = _ci;
-                ks->ci = _ci;
-                ++ks->nci;
-                int8 num = NEXT_I8();
-                int16 offset = NEXT_I16();
-                _ci->relinfo = ci->relinfo;
-                _ci->code = (uint8 *)ci->relinfo;
-                _ci->savedpc = _ci->code;
+                CodeInfo *code = (CodeInfo *)fn->ptr;
+                /* callee frame may be larger than caller's */
+                check_stack(ks, ci->base, code->stacksize);
+                /* arguments are the first registers of callee */
+                memmove(ci->base, ci->top + 1, argc * sizeof(StkVal));
+                ci->top = ci->base + code->stacksize - 1;
+                ks->top = ci->top;
+                init_callinfo(ci, code);
+                PROFILE_SWITCH(code);
+                /* the callee is hot like a called one */
+                count_call(code);
+                if (run_native(ks, ci)) return;
+                pc = ci->savedpc;
+                break;
+            }
+            case OP_CALL_METHOD: {
+                int8 argc = NEXT_I8();
+                int16 index = NEXT_I16();
                 ci->savedpc = pc;
-                koala_execute(ks, _ci);
+                YIELD_POINT(ks);
+                InlineCache *ic = ci->icache + index;
+                /* receiver is the first argument */
+                objref obj = (objref)ci->top[1];
+                VTable *vtbl = __GET_VTBL(obj);
+                FuncNode *fn;
+                if (ic->entries[0].vtbl == vtbl)
+                    fn = ic->entries[0].fn;
+                else
+                    fn = ic_lookup(ic, vtbl, obj);
+
+                if (fn->kind == MNODE_CFUNC_KIND) {
+                    ci->top[1] = ffi_call_cfunc(fn, ci->top + 1, argc);
+                    ks->top = ci->top;
+                    break;
+                }
+
+                CodeInfo *code = (CodeInfo *)fn->ptr;
+                CallInfo *_ci = next_callinfo(ks, ci, code->stacksize);
+                init_callinfo(_ci, code);
+                execute(ks, _ci);
+                break;
+            }
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_CMP: {
+                uint8 *ip = pc - 1;
+                ra = NEXT_REG();
+                rb = NEXT_REG();
+                rc = NEXT_REG();
+                uint8 tp = NEXT_REG();
+                uint8 *cnt = pc++;
+                int idx = quicken_index(tp_index(ci->tp_map, tp));
+                generic_arith(ci, op, idx, ra, rb, rc);
+                if (++*cnt >= QUICKEN_THRESHOLD) *ip = OP_QUICKEN(op, idx);
+                break;
+            }
+            CASE_QUICKENED_ALL(OP_ADD)
+            CASE_QUICKENED_ALL(OP_SUB)
+            CASE_QUICKENED_ALL(OP_MUL)
+            CASE_QUICKENED_ALL(OP_DIV)
+            CASE_QUICKENED_ALL(OP_CMP)
+            case OP_TO_ANY: {
+                ra = NEXT_REG();
+                rb = NEXT_REG();
+                uint8 kind = NEXT_REG();
+                /* i64 may be boxed, gc finds stack map of the instruction */
+                ci->savedpc = pc - 4;
+                ci->base[ra] = val_from_raw(kind, ci->base[rb]);
+                break;
+            }
+            case OP_FROM_ANY: {
+                ra = NEXT_REG();
+                rb = NEXT_REG();
+                uint8 kind = NEXT_REG();
+                ci->base[ra] = val_to_raw(kind, ci->base[rb]);
+                break;
+            }
+            case OP_ANY_ADD:
+            case OP_ANY_SUB:
+            case OP_ANY_MUL:
+            case OP_ANY_DIV:
+            case OP_ANY_CMP: {
+                ra = NEXT_REG();
+                rb = NEXT_REG();
+                rc = NEXT_REG();
+                StkVal v1 = ci->base[rb];
+                StkVal v2 = ci->base[rc];
+                /* fast path of ints */
+                if (op == OP_ANY_ADD && val_both_int(v1, v2)) {
+                    int64 v = val_get_int(v1) + val_get_int(v2);
+                    if (val_int_fits(v)) {
+                        ci->base[ra] = val_int(v);
+                        break;
+                    }
+                }
+                /* the result may be boxed, see OP_TO_ANY */
+                ci->savedpc = pc - 4;
+                ci->base[ra] = val_arith(OP_ANY_GENERIC(op), v1, v2);
                 break;
             }
             default: {
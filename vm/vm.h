@@ -9,7 +9,7 @@
 #ifndef _KOALA_VM_H_
 #define _KOALA_VM_H_
 
-#include "util/common.h"
+#include "core/core.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -17,8 +17,35 @@ extern "C" {
 
 typedef struct _CallInfo CallInfo;
 typedef struct _KoalaState KoalaState;
+typedef struct _InlineCache InlineCache;
+typedef struct _Coroutine Coroutine;
 typedef uintptr StkVal;
 
+/* max number of receiver types cached by one call site */
+#define IC_POLY_SIZE 4
+
+/*
+ * Inline cache of method call site, keyed on the receiver's VTable.
+ * count == 1 is monomorphic, count > 1 is polymorphic. If more than
+ * IC_POLY_SIZE types are seen, it is megamorphic and looks up the method
+ * by name each time.
+ */
+struct _InlineCache {
+    /* method name */
+    char *name;
+    /* number of cached types */
+    int count;
+    /* number of misses */
+    int misses;
+    struct {
+        VTable *vtbl;
+        FuncNode *fn;
+        int slot;
+    } entries[IC_POLY_SIZE];
+};
+
+#define ic_is_megamorphic(ic) ((ic)->misses > (ic)->count)
+
 struct _CallInfo {
     // next callinfo
     CallInfo *next;
@@ -32,8 +59,14 @@ struct _CallInfo {
     uint8 *code;
     /* code index */
     uint8 *savedpc;
-    /* relocations */
-    uintptr relinfo;
+    /* relocations of package, K2 of OP_CALL is index */
+    RelInfo *relinfo;
+    /* type parameters bitmap of generic function */
+    uint32 tp_map;
+    /* inline caches of method call sites */
+    InlineCache *icache;
+    /* running function, nil if it's raw byte codes */
+    CodeInfo *codeinfo;
     // gc stack
     void *gc_stack[0];
 };
@@ -51,12 +84,33 @@ struct _KoalaState {
     // stack end
     StkVal *stack_end;
 
+    /* coroutine running this state, nil if it's not scheduled */
+    Coroutine *co;
+    /* yield points(calls and backward jumps) before next yield */
+    int budget;
+
     // first call info
     CallInfo base_ci;
 };
 
 void koala_execute(KoalaState *ks, CallInfo *ci);
 
+/* call the function of OP_CALL, pc is the next instruction */
+void koala_call(KoalaState *ks, CallInfo *ci, uint8 *pc);
+
+/*
+ * Slow path of the poll at backward jump of native code, pc is the target.
+ * The native code decrements budget, and calls it if the budget is used up
+ * or gc is stopping the world.
+ */
+void koala_poll(KoalaState *ks, CallInfo *ci, uint8 *pc);
+
+/*
+ * Rewrite OP_CALL in tail position(followed by `OP_SAVE_RET 0` and `OP_RET`)
+ * to OP_TAIL_CALL, return the number of rewritten calls.
+ */
+int koala_tail_calls(CodeInfo *code);
+
 #ifdef __cplusplus
 }
 #endif